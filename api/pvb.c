@@ -0,0 +1,199 @@
+#include "pvb.h"
+#include "../src/jit.h"
+#include "../src/optimize.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static PvbStatus Fail(PvbVm* vm, PvbStatus status, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(vm->error.message, sizeof(vm->error.message), format, args);
+    va_end(args);
+
+    vm->error.status = status;
+    return status;
+}
+
+// free the program and clear the machine, keeping the streams the host set
+static void Unload(PvbVm* vm) {
+    Machine* machine = &vm->machine;
+    FILE* input = machine->input;
+    FILE* output = machine->output;
+    FILE* errors = machine->errors;
+
+#ifdef VM_JIT
+    JitDestroy(machine->jit);
+#endif
+    DestroyStack(machine);
+    FreeMemory(machine);
+
+    if (vm->lexed == TRUE)
+        FreeLexer(&vm->lexer);
+#ifndef USING_ARDUINO
+    UnmapBytecode(&vm->bytecode);
+#endif
+
+    memset(machine, 0, sizeof(Machine));
+    memset(&vm->error, 0, sizeof(PvbError));
+    machine->input = input;
+    machine->output = output;
+    machine->errors = errors;
+    vm->lexed = FALSE;
+    vm->loaded = FALSE;
+}
+
+// unload the last program and give the machine an empty stack for the next
+static void Reload(PvbVm* vm) {
+    Unload(vm);
+    CreateStack(&vm->machine, vm->stackCapacity, (vm->flags & PVB_GUARD_STACK) != 0);
+    vm->machine.checkMemory = (vm->flags & PVB_CHECK_MEMORY) != 0;
+}
+
+static PvbStatus Loaded(PvbVm* vm) {
+    vm->loaded = TRUE;
+
+#ifdef VM_JIT
+    if ((vm->flags & PVB_NO_JIT) == 0)
+        vm->machine.jit = JitCreate(&vm->machine);
+#endif
+
+    return PVB_OK;
+}
+
+// lex text the vm owns from now on and load it
+static PvbStatus Lex(PvbVm* vm, char* name, char* text, long length) {
+    vm->lexed = TRUE;
+
+    if (setjmp(vm->trap) != 0) {
+        PvbStatus status =
+            (vm->lexer.errorCode == ERR_TYPE_ERROR) ? PVB_TYPE_ERROR : PVB_SYNTAX_ERROR;
+        Fail(vm, status, "%s", vm->lexer.error);
+        vm->error.line = vm->lexer.lineNumber;
+
+        FreeLexer(&vm->lexer);
+        vm->lexed = FALSE;
+        return status;
+    }
+
+    LexSource(&vm->lexer, name, text, length, vm->lexThreads, &vm->trap);
+    vm->lexer.trap = NULL;
+
+    if ((vm->flags & PVB_NO_FUSE) == 0)
+        FuseInstructions(vm->lexer.program, vm->lexer.numTokens);
+
+    LoadProgram(&vm->machine, &vm->lexer);
+    return Loaded(vm);
+}
+
+PvbVm* PvbCreate(uint32_t flags) {
+    PvbVm* vm = calloc(1, sizeof(PvbVm));
+    if (vm == NULL)
+        return NULL;
+
+    vm->flags = flags;
+    vm->lexThreads = 1;
+    vm->stackCapacity = STACK_CAPACITY;
+    return vm;
+}
+
+void PvbDestroy(PvbVm* vm) {
+    if (vm == NULL)
+        return;
+
+    Unload(vm);
+    free(vm);
+}
+
+PvbStatus PvbLoadText(PvbVm* vm, const char* name, const char* text, size_t length) {
+    Reload(vm);
+
+#ifdef USING_ARDUINO
+    return Lex(vm, (char*)name, (char*)text, length);
+#else
+    char* copy = malloc(length + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "Buffer allocation error for program text.\n");
+        exit(1);
+    }
+
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return Lex(vm, (char*)name, copy, length);
+#endif
+}
+
+PvbStatus PvbLoadInstructions(PvbVm* vm, Instruction* program, uint32_t size) {
+    Reload(vm);
+
+    vm->machine.program = program;
+    vm->machine.programSize = size;
+    vm->machine.rp = -1;
+    vm->machine.started = TRUE; // no labels to find _start in
+    return Loaded(vm);
+}
+
+#ifndef USING_ARDUINO
+PvbStatus PvbLoadFile(PvbVm* vm, const char* path) {
+    Reload(vm);
+
+    if (IsBytecodeFile(path)) {
+        if (MapBytecode(&vm->bytecode, path, vm->error.message, sizeof(vm->error.message)) ==
+            FALSE)
+            return vm->error.status = PVB_IO_ERROR;
+
+        LoadBytecode(&vm->machine, &vm->bytecode);
+        return Loaded(vm);
+    }
+
+    long length = 0;
+    char* text = ReadTextFile(path, &length);
+    if (text == NULL)
+        return Fail(vm, PVB_IO_ERROR, "Error opening file. Path: %s\n", path);
+
+    return Lex(vm, (char*)path, text, length);
+}
+
+PvbStatus PvbWriteBytecode(PvbVm* vm, const char* path) {
+    if (vm->lexed == FALSE)
+        return Fail(vm, PVB_IO_ERROR, "Error writing bytecode file. Path: %s: nothing lexed\n",
+                    path);
+
+    uint32_t flags = (vm->flags & PVB_NO_FUSE) ? 0 : PVBC_FUSED;
+    if (WriteBytecode(path, &vm->lexer, vm->lexer.program, flags, vm->error.message,
+                      sizeof(vm->error.message)) == FALSE)
+        return vm->error.status = PVB_IO_ERROR;
+
+    return PVB_OK;
+}
+#endif
+
+PvbStatus PvbRun(PvbVm* vm, uint64_t budget) {
+    Machine* machine = &vm->machine;
+
+    if (vm->loaded == FALSE)
+        return Fail(vm, PVB_NOT_LOADED, "No program loaded.\n");
+    if (vm->error.status != PVB_OK)
+        return vm->error.status;
+    if (machine->exited == TRUE)
+        return PVB_EXITED;
+
+    machine->cycleLimit = (budget == 0) ? 0 : machine->cycles + budget;
+    machine->trap = &vm->trap;
+
+    if (setjmp(vm->trap) != 0) {
+        machine->trap = NULL;
+        vm->error.ip = machine->ip;
+        return Fail(vm, PVB_RUNTIME_ERROR, "runtime error. %s\n", machine->error);
+    }
+
+    RunInstructions(machine);
+    machine->trap = NULL;
+
+    if (machine->exited == TRUE)
+        return PVB_EXITED;
+
+    return (machine->ip < machine->programSize) ? PVB_BUDGET : PVB_OK;
+}
\ No newline at end of file
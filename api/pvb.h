@@ -0,0 +1,138 @@
+/// libpvb, the virtual machine as a library
+///
+/// Loads and runs programs inside a host process without ever ending it.
+/// Syntax errors, runtime errors, exit instructions and missing files all
+/// come back as a PvbStatus, with the details in PvbVm.error, so a failing
+/// script cannot take its host down with it. A run can be given a cycle
+/// budget and continued later by calling PvbRun again.
+///
+/// Running out of memory still ends the process.
+///
+///     PvbVm* vm = PvbCreate(0);
+///     if (PvbLoadFile(vm, "script.pvb") == PVB_OK)
+///         while (PvbRun(vm, 100000) == PVB_BUDGET)
+///             ; // do other work between slices
+///     PvbDestroy(vm);
+
+#ifndef PVB_H
+#define PVB_H
+
+#include "../src/lexer.h" // for Lexer, Machine and Instruction
+
+#ifndef USING_ARDUINO
+#include "../src/bytecode.h" // for Bytecode
+#endif
+
+#include <setjmp.h>
+
+#ifdef USING_ARDUINO
+#define PVB_MESSAGE_LEN 64
+#else
+#define PVB_MESSAGE_LEN 512
+#endif
+
+typedef enum {
+    PVB_OK = 0,        // loaded, or the program ran to its end
+    PVB_EXITED,        // an exit instruction ran, the code is in machine.exitCode
+    PVB_BUDGET,        // the cycle budget ran out, PvbRun continues where it stopped
+    PVB_SYNTAX_ERROR,  // the program could not be lexed
+    PVB_TYPE_ERROR,    // an operand has the wrong type
+    PVB_RUNTIME_ERROR, // the program did something invalid while running
+    PVB_IO_ERROR,      // a file could not be read or written
+    PVB_NOT_LOADED,    // PvbRun without a program
+} PvbStatus;
+
+typedef enum {
+    PVB_NO_FUSE = 1 << 0,      // run programs exactly as written, see FuseInstructions
+    PVB_NO_JIT = 1 << 1,       // only interpret
+    PVB_GUARD_STACK = 1 << 2,  // put the stack between guard pages, see CreateStack
+    PVB_CHECK_MEMORY = 1 << 3, // keep loads and stores inside SYS_ALLOC memory, see CheckMemory
+} PvbFlags;
+
+/// @brief What went wrong
+///
+/// @param status: the error, PVB_OK if there was none
+/// @param message: description formatted the way the command line prints it
+/// @param line: source line of a syntax or type error
+/// @param ip: instruction a runtime error happened at
+typedef struct {
+    PvbStatus status;
+    char message[PVB_MESSAGE_LEN];
+    long line;
+    uint32_t ip;
+} PvbError;
+
+/// @brief A machine and the program loaded into it
+///
+/// Fields may be read at any time, e.g the registers in machine.registers.
+/// machine.input, output and errors can be set to redirect the program
+/// and are kept when another program is loaded
+typedef struct {
+    Machine machine;
+    Lexer lexer; // the program when it was lexed, owns everything machine points into
+#ifndef USING_ARDUINO
+    Bytecode bytecode; // the program when it was mapped from a .pvbc file
+#endif
+    PvbError error;
+
+    uint32_t flags;          // PvbFlags
+    unsigned int lexThreads; // threads large files are lexed on, see ParseTokensParallel
+    uint32_t stackCapacity;  // values the stack holds, used by the next program loaded
+    BOOL lexed;              // lexer holds the program
+    BOOL loaded;
+
+    jmp_buf trap; // errors jump here instead of ending the process
+} PvbVm;
+
+/// @brief Create a virtual machine with no program
+/// @param flags - PvbFlags
+/// @return - the machine, or NULL if out of memory
+PvbVm* PvbCreate(uint32_t flags);
+
+/// @brief Free a virtual machine and its program
+/// @param vm - machine from PvbCreate
+void PvbDestroy(PvbVm* vm);
+
+/// @brief Lex a program from text and load it, replacing any program loaded before
+/// @param vm - machine to load into
+/// @param name - file name used in error messages, must outlive the program
+/// @param text - program source. copied, except on Arduino where it must outlive the program
+/// @param length - characters in text
+/// @return - PVB_OK, PVB_SYNTAX_ERROR or PVB_TYPE_ERROR
+PvbStatus PvbLoadText(PvbVm* vm, const char* name, const char* text, size_t length);
+
+/// @brief Load already decoded instructions, starting at the first one
+///
+/// Nothing is copied, program must outlive the run. There are no labels,
+/// constants or strings, so operands must be registers or inline immediates
+/// @param vm - machine to load into
+/// @param program - instructions to run
+/// @param size - number of instructions
+/// @return - PVB_OK
+PvbStatus PvbLoadInstructions(PvbVm* vm, Instruction* program, uint32_t size);
+
+#ifndef USING_ARDUINO
+/// @brief Load a program from a file
+///
+/// A .pvbc file is mapped, anything else is lexed
+/// @param vm - machine to load into
+/// @param path - file to load, must outlive the program
+/// @return - PVB_OK, PVB_IO_ERROR, PVB_SYNTAX_ERROR or PVB_TYPE_ERROR
+PvbStatus PvbLoadFile(PvbVm* vm, const char* path);
+
+/// @brief Write the lexed program to a .pvbc file, before it is run
+/// @param vm - machine whose program was lexed
+/// @param path - file to create
+/// @return - PVB_OK or PVB_IO_ERROR
+PvbStatus PvbWriteBytecode(PvbVm* vm, const char* path);
+#endif
+
+/// @brief Run the loaded program, or continue it
+/// @param vm - machine to run
+/// @param budget - instructions to run before returning PVB_BUDGET, 0 for no limit.
+///                 checked when jumping, so a run can go a little over
+/// @return - PVB_OK when the program ended, PVB_EXITED, PVB_BUDGET or an error.
+///           After an error or exit it keeps returning the same status
+PvbStatus PvbRun(PvbVm* vm, uint64_t budget);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,371 @@
+/// Interpreter benchmark
+///
+/// Lexes a .pvb program once and runs it on a fresh machine several times,
+/// reporting how many instructions per second RunInstructions manages.
+/// With --lex the program is only lexed, over and over, and the lexer
+/// throughput is reported instead. bench/gen-lex.py writes a suitable file.
+/// --parallel lexes with ParseTokensParallel on every core.
+///
+/// --suite runs the fixed corpus below instead, interpreted and with the
+/// jit, plus the lexer on the generated file given. This is the baseline
+/// for judging changes to RunInstructions and ParseTokens. ./build.sh bench
+/// builds and runs it from the repository root.
+///
+/// Every benchmark gets a warm-up run that is not timed, then the median
+/// of the timed runs is reported along with the best and the spread. Each
+/// runs in a child process of its own so its peak rss is its own.
+/// --json prints the results as JSON instead of a table.
+///
+/// Usage: bench [--no-fuse] [--no-jit] [--lex] [--parallel] [--json] <file.pvb> [runs]
+///        bench --suite [--json] <generated.pvb> [runs]
+
+#include "../src/jit.h"
+#include "../src/lexer.h"
+#include "../src/optimize.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LEX_BYTES_PER_RUN (32 << 20) // text lexed per --lex run, so small files time well
+#define BENCH_MAX_RUNS 64
+
+typedef enum {
+    BENCH_RUN,
+    BENCH_LEX,
+} BenchKind;
+
+/// @brief One program of the suite
+typedef struct {
+    const char* name;
+    const char* path; // NULL for the generated file given on the command line
+    BenchKind kind;
+} BenchCase;
+
+static const BenchCase suite[] = {
+    {"int-loop", "bench/cmpjne.pvb", BENCH_RUN},    // cmp and branch dispatch
+    {"int-kernel", "bench/lcg.pvb", BENCH_RUN},     // mul, add, mod on registers
+    {"float", "bench/float.pvb", BENCH_RUN},        // f64 arithmetic
+    {"stack-or", "bench/digwrite.pvb", BENCH_RUN},  // push, shl, OR, pop sequences
+    {"call-ret", "bench/callret.pvb", BENCH_RUN},   // call and ret
+    {"output", "bench/output.pvb", BENCH_RUN},      // write to a file descriptor
+    {"lex", NULL, BENCH_LEX},                       // lexing a large generated source
+};
+
+/// @brief Timings of one benchmark in one mode, passed back from the child that ran it
+typedef struct {
+    char name[32];
+    char mode[16];
+    BOOL failed;
+    int runs;
+
+    uint64_t instructions; // ran per run, for BENCH_RUN
+    uint64_t bytes;        // lexed per run, for BENCH_LEX
+    double median;         // seconds per run
+    double best;
+    double worst;
+    long peakRss; // KB
+
+    // arena of the last lex, for the allocation counts
+    uint32_t arenaAllocations;
+    uint32_t arenaBlocks;
+    uint64_t arenaBytes;
+} BenchResult;
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Lexer Lex(char* path, BOOL parallel) {
+    return parallel == TRUE ? ParseTokensParallel(path, 0) : ParseTokens(path);
+}
+
+static int CompareTimes(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// sort the timed runs into the result
+static void Summarize(BenchResult* result, double* times, int runs) {
+    qsort(times, runs, sizeof(double), CompareTimes);
+
+    result->runs = runs;
+    result->best = times[0];
+    result->worst = times[runs - 1];
+    result->median =
+        (runs % 2 == 1) ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+}
+
+// run a lexed program once on a fresh machine, returning the seconds it took
+static double RunOnce(Lexer* lexer, BOOL jit, FILE* output, uint64_t* instructions) {
+    Machine* machine = calloc(1, sizeof(Machine));
+    if (machine == NULL) {
+        fprintf(stderr, "Buffer allocation error for machine.\n");
+        exit(1);
+    }
+
+    CreateStack(machine, STACK_CAPACITY, FALSE);
+    LoadProgram(machine, lexer);
+    machine->output = output;
+
+    double start = Now();
+#ifdef VM_JIT
+    if (jit == TRUE)
+        machine->jit = JitCreate(machine);
+#endif
+    RunInstructions(machine);
+#ifdef VM_JIT
+    JitDestroy(machine->jit);
+#endif
+    double elapsed = Now() - start;
+
+    *instructions = machine->cycles;
+    DestroyStack(machine);
+    free(machine);
+    return elapsed;
+}
+
+static void MeasureRun(char* path, BOOL fuse, BOOL jit, int runs, BenchResult* result) {
+    Lexer lexer = ParseTokens(path);
+    if (fuse == TRUE)
+        FuseInstructions(lexer.program, lexer.numTokens);
+
+    // programs that write are measured without a terminal in the way
+    FILE* output = fopen("/dev/null", "w");
+    double times[BENCH_MAX_RUNS];
+
+    RunOnce(&lexer, jit, output, &result->instructions); // warm-up
+    for (int run = 0; run < runs; run++)
+        times[run] = RunOnce(&lexer, jit, output, &result->instructions);
+
+    Summarize(result, times, runs);
+    if (output != NULL)
+        fclose(output);
+    FreeLexer(&lexer);
+}
+
+static void MeasureLex(char* path, BOOL parallel, int runs, BenchResult* result) {
+    double times[BENCH_MAX_RUNS];
+
+    for (int run = -1; run < runs; run++) { // run -1 is the warm-up
+        uint64_t lexed = 0;
+        double start = Now();
+        while (lexed < LEX_BYTES_PER_RUN) {
+            Lexer lexer = Lex(path, parallel);
+            lexed += lexer.textLength;
+
+            result->arenaAllocations = lexer.arena.allocations;
+            result->arenaBlocks = lexer.arena.blocks;
+            result->arenaBytes = lexer.arena.bytes;
+            FreeLexer(&lexer);
+        }
+
+        if (run >= 0)
+            times[run] = Now() - start;
+        result->bytes = lexed;
+    }
+
+    Summarize(result, times, runs);
+}
+
+// measure one benchmark in a child process, so a lexer error can't end the
+// suite and peak rss covers that benchmark only
+static BenchResult Measure(const char* name, const char* mode, char* path, BenchKind kind,
+                           BOOL fuse, BOOL fast, int runs) {
+    BenchResult result = {0};
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    snprintf(result.mode, sizeof(result.mode), "%s", mode);
+    result.failed = TRUE;
+
+    int pipes[2];
+    if (pipe(pipes) != 0)
+        return result;
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        close(pipes[0]);
+
+        if (kind == BENCH_LEX)
+            MeasureLex(path, fast, runs, &result);
+        else
+            MeasureRun(path, fuse, fast, runs, &result);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        result.peakRss = usage.ru_maxrss;
+        result.failed = FALSE;
+
+        _exit(write(pipes[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+    }
+
+    close(pipes[1]);
+    if (child > 0) {
+        BenchResult measured;
+        if (read(pipes[0], &measured, sizeof(measured)) == sizeof(measured))
+            result = measured;
+        waitpid(child, NULL, 0);
+    }
+    close(pipes[0]);
+
+    return result;
+}
+
+static void PrintHeader() {
+    printf("%-12s %-9s %12s %10s %10s %7s %9s %10s %9s %9s\n", "benchmark", "mode",
+           "instructions", "median ms", "best ms", "spread", "ns/inst", "M inst/s", "lex MB/s",
+           "rss MB");
+}
+
+static void PrintResult(const BenchResult* result) {
+    if (result->failed == TRUE) {
+        printf("%-12s %-9s failed\n", result->name, result->mode);
+        return;
+    }
+
+    printf("%-12s %-9s %12lu %10.2f %10.2f %6.1f%%", result->name, result->mode,
+           result->instructions, result->median * 1e3, result->best * 1e3,
+           100 * (result->worst - result->best) / result->median);
+
+    if (result->instructions > 0)
+        printf(" %9.2f %10.1f %9s", result->median * 1e9 / result->instructions,
+               result->instructions / result->median / 1e6, "-");
+    else
+        printf(" %9s %10s %9.2f", "-", "-", result->bytes / result->median / 1e6);
+
+    printf(" %9.1f\n", result->peakRss / 1e3);
+}
+
+static void PrintJson(const BenchResult* results, int count) {
+    printf("{\"benchmarks\": [\n");
+    for (int i = 0; i < count; i++) {
+        const BenchResult* r = &results[i];
+        printf("  {\"name\": \"%s\", \"mode\": \"%s\", \"failed\": %s", r->name, r->mode,
+               r->failed == TRUE ? "true" : "false");
+
+        if (r->failed == FALSE) {
+            printf(", \"runs\": %d, \"median_s\": %.9f, \"best_s\": %.9f, \"worst_s\": %.9f, "
+                   "\"peak_rss_kb\": %ld",
+                   r->runs, r->median, r->best, r->worst, r->peakRss);
+
+            if (r->instructions > 0)
+                printf(", \"instructions\": %lu, \"ns_per_inst\": %.3f, \"inst_per_s\": %.0f",
+                       r->instructions, r->median * 1e9 / r->instructions,
+                       r->instructions / r->median);
+            else
+                printf(", \"bytes\": %lu, \"lex_mb_per_s\": %.3f, \"arena_allocations\": %u, "
+                       "\"arena_blocks\": %u, \"arena_bytes\": %lu",
+                       r->bytes, r->bytes / r->median / 1e6, r->arenaAllocations,
+                       r->arenaBlocks, r->arenaBytes);
+        }
+
+        printf("}%s\n", i + 1 < count ? "," : "");
+    }
+    printf("]}\n");
+}
+
+static void PrintResults(const BenchResult* results, int count, BOOL json) {
+    if (json == TRUE) {
+        PrintJson(results, count);
+        return;
+    }
+
+    PrintHeader();
+    for (int i = 0; i < count; i++)
+        PrintResult(&results[i]);
+}
+
+static int RunSuite(char* generated, int runs, BOOL json) {
+    BenchResult results[2 * sizeof(suite) / sizeof(suite[0])];
+    int count = 0;
+
+    for (size_t i = 0; i < sizeof(suite) / sizeof(suite[0]); i++) {
+        const BenchCase* bench = &suite[i];
+        char* path = (char*)(bench->path != NULL ? bench->path : generated);
+
+        if (bench->kind == BENCH_LEX) {
+            results[count++] = Measure(bench->name, "serial", path, BENCH_LEX, TRUE, FALSE, runs);
+#ifdef LXR_PARALLEL
+            results[count++] = Measure(bench->name, "parallel", path, BENCH_LEX, TRUE, TRUE, runs);
+#endif
+            continue;
+        }
+
+        results[count++] = Measure(bench->name, "interp", path, BENCH_RUN, TRUE, FALSE, runs);
+#ifdef VM_JIT
+        results[count++] = Measure(bench->name, "jit", path, BENCH_RUN, TRUE, TRUE, runs);
+#endif
+    }
+
+    PrintResults(results, count, json);
+
+    for (int i = 0; i < count; i++) {
+        if (results[i].failed == TRUE)
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    BOOL fuse = TRUE;
+    BOOL jit = TRUE;
+    BOOL lex = FALSE;
+    BOOL parallel = FALSE;
+    BOOL json = FALSE;
+    BOOL all = FALSE;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--lex") == 0)
+            lex = TRUE;
+        else if (strcmp(argv[1], "--parallel") == 0)
+            parallel = TRUE;
+        else if (strcmp(argv[1], "--no-fuse") == 0)
+            fuse = FALSE;
+        else if (strcmp(argv[1], "--no-jit") == 0)
+            jit = FALSE;
+        else if (strcmp(argv[1], "--json") == 0)
+            json = TRUE;
+        else if (strcmp(argv[1], "--suite") == 0)
+            all = TRUE;
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "usage: %s [--no-fuse] [--no-jit] [--lex] [--parallel] [--json] <file.pvb> [runs]\n"
+                "       %s --suite [--json] <generated.pvb> [runs]\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+
+    int runs = (argc > 2) ? atoi(argv[2]) : 5;
+    if (runs < 1)
+        runs = 1;
+    if (runs > BENCH_MAX_RUNS)
+        runs = BENCH_MAX_RUNS;
+
+    if (all == TRUE)
+        return RunSuite(argv[1], runs, json);
+
+    BenchResult result;
+    if (lex == TRUE)
+        result = Measure("lex", parallel == TRUE ? "parallel" : "serial", argv[1], BENCH_LEX,
+                         fuse, parallel, runs);
+    else
+        result = Measure(argv[1], jit == TRUE ? "jit" : "interp", argv[1], BENCH_RUN, fuse, jit,
+                         runs);
+
+    PrintResults(&result, 1, json);
+    if (lex == TRUE && json == FALSE && result.failed == FALSE)
+        printf("%u arena allocations in %u blocks, %.1f KB per lex\n", result.arenaAllocations,
+               result.arenaBlocks, result.arenaBytes / 1e3);
+
+    return result.failed == TRUE ? 1 : 0;
+}
\ No newline at end of file
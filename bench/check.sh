@@ -0,0 +1,111 @@
+#!/bin/bash
+
+# Differential test of every way the vm can run a program.
+#
+# Each program in bench/corpus, and programs generated by bench/gen-fuzz.py,
+# first runs on a plain interpreter: --no-jit --no-fuse on a default build.
+# It then runs with fusion, with the jit, from compiled bytecode, on a
+# guarded stack and on builds with VM_NANBOX, VM_NO_QUICKEN,
+# VM_NO_COMPUTED_GOTO and VM_NO_AVX2. Output, errors and exit code must be
+# the same as the plain run. Every mode also runs on a stack of 10 values
+# and has to match the plain run with --stack 10. Job lists in bench/corpus
+# (*.jobs) run through --batch on every build and thread count and must
+# match a single threaded batch, less the timing summary.
+#
+# Programs read nothing, stdin is /dev/null. Anything that differs is
+# printed with the command that ran it, the exit code is the number of
+# differences.
+#
+# Usage: bench/check.sh [fuzzed programs]
+#        ./build.sh check [fuzzed programs] from the repository root
+
+cd "$(dirname "$0")/.." || exit 1
+
+FUZZ=${1:-200}
+OUT=out/check
+SRC=$(find src api -name "*.c")
+mkdir -p "$OUT"
+
+BUILDS="pvb pvb-nanbox pvb-noquicken pvb-switch pvb-noavx2"
+gcc -O2 $SRC -pthread -o "$OUT/pvb" &&
+    gcc -O2 -DVM_NANBOX $SRC -pthread -o "$OUT/pvb-nanbox" &&
+    gcc -O2 -DVM_NO_QUICKEN $SRC -pthread -o "$OUT/pvb-noquicken" &&
+    gcc -O2 -DVM_NO_COMPUTED_GOTO $SRC -pthread -o "$OUT/pvb-switch" &&
+    gcc -O2 -DVM_NO_AVX2 $SRC -pthread -o "$OUT/pvb-noavx2" || exit 1
+
+MODES=("--no-jit --no-fuse" "--no-jit" "--no-fuse" "" "--guard-stack")
+differ=0
+compared=0
+
+# output, errors and exit code of one run, with the file name as given
+run() {
+    (timeout 10 "$@" </dev/null 2>&1; echo "exit $?") | md5sum
+}
+
+check() {
+    local program=$1
+    local expected plain small
+    plain=$(run "$OUT/pvb" --no-jit --no-fuse "$program")
+    # a stack that isn't whole pages can't be guarded, it has to overflow the same
+    small=$(run "$OUT/pvb" --stack 10 --no-jit --no-fuse "$program")
+
+    for build in $BUILDS; do
+        for stack in "" "--stack 10"; do
+            expected=$plain
+            [ -n "$stack" ] && expected=$small
+            for mode in "${MODES[@]}"; do
+                compared=$((compared + 1))
+                if [ "$(run "$OUT/$build" $stack $mode "$program")" != "$expected" ]; then
+                    echo "differs: $OUT/$build $stack $mode $program"
+                    differ=$((differ + 1))
+                fi
+            done
+        done
+
+        # bytecode only exists for programs that lex
+        rm -f "$OUT/program.pvbc"
+        "$OUT/$build" -o "$OUT/program.pvbc" "$program" >/dev/null 2>&1
+        if [ -f "$OUT/program.pvbc" ]; then
+            compared=$((compared + 1))
+            cp "$program" "$OUT/program.pvb" # same name in the output as the source run
+            if [ "$(cd "$OUT" && run "./$build" program.pvbc)" != \
+                "$(cd "$OUT" && run ./pvb --no-jit --no-fuse program.pvb)" ]; then
+                echo "differs: $OUT/$build on bytecode of $program"
+                differ=$((differ + 1))
+            fi
+        fi
+    done
+}
+
+for program in bench/corpus/*.pvb; do
+    check "$program"
+done
+
+for seed in $(seq 1 "$FUZZ"); do
+    python3 bench/gen-fuzz.py "$seed" >"$OUT/fuzz$seed.pvb"
+    check "$OUT/fuzz$seed.pvb"
+    rm -f "$OUT/fuzz$seed.pvb"
+done
+
+# the summary line has the time it took
+batch() {
+    (timeout 60 "$@" </dev/null 2>&1 | grep -v " jobs on "; echo "exit ${PIPESTATUS[0]}") | md5sum
+}
+
+for jobs in bench/corpus/*.jobs; do
+    [ -f "$jobs" ] || continue
+    expected=$(batch "$OUT/pvb" --no-jit -j 1 --batch "$jobs")
+
+    for build in $BUILDS; do
+        for threads in 1 4; do
+            compared=$((compared + 1))
+            if [ "$(batch "$OUT/$build" -j $threads --batch "$jobs")" != "$expected" ]; then
+                echo "differs: $OUT/$build -j $threads --batch $jobs"
+                differ=$((differ + 1))
+            fi
+        done
+    done
+done
+
+echo "$compared runs compared, $differ differ"
+exit $differ
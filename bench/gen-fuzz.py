@@ -0,0 +1,91 @@
+# Generates a random .pvb program for differential testing, see bench/check.sh.
+#
+# Each program has up to three loops made of register arithmetic, compares
+# and the stack sequences the fuser turns into superinstructions. They are
+# called twice, once with integers in every register and once after one of
+# them was made a float, so quickened handlers deoptimize and jit guards
+# fail. Loops run long enough for the jit to compile them. Division by zero
+# and stack errors are expected, every build has to report them the same.
+#
+# Usage: python3 bench/gen-fuzz.py <seed>
+
+import random
+import sys
+
+REGS = ["rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13",
+        "r14"]
+
+
+def immediate():
+    r = random.random()
+    if r < 0.7:
+        return "$%d" % random.randint(-50, 50)
+    if r < 0.85:
+        return "$%d" % random.randint(-2**40, 2**40)  # too wide for the instruction
+    if r < 0.9:
+        return "$%d.5" % random.randint(-5, 5)
+    return "$%d" % random.randint(1, 9)
+
+
+def operation(regs):
+    r = random.random()
+    dest = random.choice(regs)
+    reg = random.choice(regs)
+    src = reg if random.random() < 0.5 else immediate()
+
+    if r < 0.35:
+        return ["%s %s, %s" % (random.choice(["add", "sub", "mul", "mov"]), src, dest)]
+    if r < 0.45:
+        return ["%s %s, %s" % (random.choice(["div", "mod"]), src, dest)]
+    if r < 0.55:
+        return ["cmp %s, %s" % (src, dest)]
+    if r < 0.65:
+        pushed = [random.choice([reg, immediate()[1:]]) for _ in range(2)]
+        return ["push %s" % pushed[0], "push %s" % pushed[1],
+                random.choice(["AND", "OR", "XOR"]), "pop %s" % dest]
+    if r < 0.72:
+        return ["push %s" % reg, "shl %d" % random.randint(0, 5), "pop %s" % dest]
+    if r < 0.78:
+        return ["push %s" % reg, random.choice(["neg", "NOT", "dup", "size", "swap"]),
+                "pop %s" % dest]
+    if r < 0.82:
+        return ["push %d" % random.randint(0, 9), "shr %d" % random.randint(0, 3), "pop %s" % dest]
+    if r < 0.86:
+        return ["push %s" % reg, "pop"]
+    if r < 0.9:
+        return ["mod $1000003, %s" % dest]  # keeps products from growing without bound
+    return ["nop"]
+
+
+def main():
+    random.seed(int(sys.argv[1]))
+
+    regs = REGS
+    if random.random() < 0.5:
+        regs = REGS[:random.randint(2, len(REGS))]
+
+    lines = []
+    loops = "abc"[:random.randint(1, 3)]
+    for loop in loops:
+        lines.append("_body%s:" % loop)
+        for _ in range(random.randint(1, 12)):
+            lines += ["    " + line for line in operation(regs)]
+        lines += ["    sub $1, r15", "    cmp $0, r15",
+                  "    j%s _body%s" % (random.choice(["ne", "g"]), loop), "    ret"]
+
+    lines.append("_start:")
+    for reg in regs:
+        lines.append("    mov $%d, %s" % (random.randint(-20, 20), reg))
+    for _ in range(2):
+        for loop in loops:
+            lines.append("    mov $%d, r15" % random.randint(1, 300))
+            lines.append("    call _body%s" % loop)
+        lines.append("    mov $%s, %s" % (random.choice(["1.5", "7"]), random.choice(regs)))
+
+    # SYS_CYCLES, instructions run must match too
+    lines += ["    mov $8, r14", "    push r14", "    pop rax", "    syscall"]
+    print("\n".join(lines))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+# Generates a large .pvb file for measuring lexer throughput.
+#
+# The program is never meant to be run, only lexed. It mixes every
+# instruction form the lexer understands: immediates, registers, floats,
+# strings, labels, jumps, comments and blank lines.
+#
+# Usage: python3 bench/gen-lex.py <out.pvb> [instructions]
+
+import random
+import sys
+
+REGS = ["rax", "rdi", "rsi", "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13",
+        "r14", "r15"]
+ARITH = ["add", "sub", "mul", "div", "mod", "mov", "cmp"]
+JUMPS = ["jmp", "je", "jne", "jg", "jge", "jl", "jle", "call"]
+NULLARY = ["AND", "OR", "XOR", "NOT", "neg", "dup", "swap", "size", "clear", "nop", "ret"]
+
+
+def label_name(n):
+    name = ""
+    n += 1
+    while n > 0:
+        n, r = divmod(n - 1, 26)
+        name = chr(ord("a") + r) + name
+    return "l" + name
+
+
+def instruction(rng, labels):
+    kind = rng.randrange(10)
+    if kind < 3:
+        op = rng.choice(ARITH)
+        if rng.randrange(2):
+            return f"{op} ${rng.randrange(-100000, 100000)}, {rng.choice(REGS)}"
+        return f"{op} {rng.choice(REGS)}, {rng.choice(REGS)}"
+    if kind == 3:
+        return f"mov ${rng.randrange(1000)}.{rng.randrange(1000)}, {rng.choice(REGS)}"
+    if kind == 4:
+        return f"push {rng.randrange(-5000, 5000)}"
+    if kind == 5:
+        return f"push {rng.choice(REGS)}" if rng.randrange(2) else f"pop {rng.choice(REGS)}"
+    if kind == 6 and labels:
+        return f"{rng.choice(JUMPS)} _{rng.choice(labels)}"
+    if kind == 7:
+        return f'push "value {rng.randrange(100)}\\n"'
+    if kind == 8:
+        return f"{rng.choice(['shl', 'shr'])} {rng.randrange(32)}"
+    return rng.choice(NULLARY)
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(f"usage: {sys.argv[0]} <out.pvb> [instructions]")
+        exit(1)
+
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else 2000
+    rng = random.Random(1)
+    labels = []
+    lines = ["; generated by bench/gen-lex.py, only meant to be lexed", ""]
+
+    for i in range(count):
+        if i % 40 == 0:
+            lines.append("")
+            if i + 40 >= count:
+                lines.append("_start:")
+            else:
+                labels.append(label_name(len(labels)))
+                lines.append(f"_{labels[-1]}:")
+        line = "    " + instruction(rng, labels)
+        if rng.randrange(8) == 0:
+            line += " ; comment after an instruction"
+        lines.append(line)
+
+    with open(sys.argv[1], "w") as file:
+        file.write("\n".join(lines) + "\n")
+
+
+main()
@@ -6,10 +6,36 @@ OUT_DIR="./out"
 
 OUT="$OUT_DIR/main"
 SRC=$(find $SRC_DIR $API_DIR -name "*.c")
+CFLAGS=""
+
+# ./build.sh profile builds with --profile, see VM_PROFILE in src/macros.h
+if [ "$1" = "profile" ]; then
+    CFLAGS="$CFLAGS -O2 -DVM_PROFILE"
+fi
+
+# ./build.sh bench [--json] [runs] runs the benchmark suite in bench/bench.c
+if [ "$1" = "bench" ]; then
+    mkdir -p "$OUT_DIR"
+    python3 bench/gen-lex.py "$OUT_DIR/lex.pvb" 200000 >/dev/null
+    gcc -O2 $(find $SRC_DIR -name "*.c" ! -name main.c) bench/bench.c -pthread -o "$OUT_DIR/bench"
+    JSON=""
+    if [ "$2" = "--json" ]; then
+        JSON="--json"
+        shift
+    fi
+    "$OUT_DIR/bench" --suite $JSON "$OUT_DIR/lex.pvb" $2
+    exit $?
+fi
+
+# ./build.sh check [fuzzed programs] runs the differential tests in bench/check.sh
+if [ "$1" = "check" ]; then
+    bench/check.sh $2
+    exit $?
+fi
 
 clear
 rm -f "$OUT"
 find . -name "*.c" -o -name "*.h" | xargs clang-format -i
-gcc $SRC -o "$OUT"
+gcc $CFLAGS $SRC -pthread -o "$OUT"
 chmod +x "$OUT"
 ./"$OUT" ./custom.pvb
\ No newline at end of file
@@ -2,13 +2,34 @@
 ///
 /// The goal is to make my language run on an arduino, using
 /// specialized instructions to control the hardware.
+///
+/// The vm is used through libpvb so a bad program prints its
+/// error instead of halting the board. The IDE only builds the
+/// src folder, so copy api/pvb.c into it next to the vm sources.
 
 /// Headers
 extern "C" {
-    #include "src/lexer.h" // Instruction, DATA_USING.., Machine
+    #include "api/pvb.h" // PvbVm, Instruction, DATA_USING.., Machine
     #include <stdlib.h> // malloc
 };
 
+/// The vm every function below runs its instructions on
+PvbVm* vm = NULL;
+
+/// @brief Run instructions on the vm, printing why if they fail
+/// @param insts - instructions to run
+/// @param size - number of instructions
+/// @return - TRUE if they ran to the end
+BOOL run(Instruction* insts, uint32_t size) {
+    PvbLoadInstructions(vm, insts, size);
+    if (PvbRun(vm, 0) != PVB_OK) {
+        Serial.println(vm->error.message);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /// @brief Read the state of a pin using Instruction set 
 /// @param led 
 /// @return 
@@ -17,25 +38,21 @@ int low_level_read(int led) {
     
     //  this is the pin to read
     insts[0].operation = OP_PUSH;
-    insts[0].data.value = DATA_USING_I64(led);
+    insts[0].kind = OPND_I64;
+    insts[0].imm = led;
 
     // push 1 to the stack, this is the file descriptor
     insts[1].operation = OP_PUSH;
-    insts[1].data.value = DATA_USING_I64(FILE_INOPIN);
+    insts[1].kind = OPND_I64;
+    insts[1].imm = FILE_INOPIN;
 
     // write to the pin
     insts[2].operation = OP_READ;
 
-    Machine machine = {0};
-    machine.labels[0] = Label{"start", 5, 0};
-    machine.rp = -1;
-    machine.numLabels = 1;
-    machine.program = insts;
-    machine.programSize = sizeof(insts) / sizeof(Instruction);
+    if (run(insts, sizeof(insts) / sizeof(Instruction)) == FALSE)
+        return -1;
 
-    RunInstructions(&machine);
-
-    return Pop(&machine);
+    return Pop(&vm->machine);
 }
 
 /// Call the high level 'OP_WRITE' instruction 
@@ -43,26 +60,24 @@ int low_level_read(int led) {
 /// instead of doing it manually
 /// @param led - pin number to write to
 /// @param on - boolean, high or low state
-/// @param machine - machine context
-void high_level_write(int led, BOOL on, Machine* machine) {
+void high_level_write(int led, BOOL on) {
     // Simulator instructions from the lexer
     Instruction insts[4];
 
     //  this is the pin to read
     insts[0].operation = OP_PUSH;
-    insts[0].data.value = DATA_USING_I64(led);
+    insts[0].kind = OPND_I64;
+    insts[0].imm = led;
 
     // push 1 to the stack, this is the file descriptor
     insts[1].operation = OP_PUSH;
-    insts[1].data.value = DATA_USING_I64(FILE_INOPIN);
+    insts[1].kind = OPND_I64;
+    insts[1].imm = FILE_INOPIN;
 
     // write to the pin
     insts[2].operation = OP_WRITE;
 
-    machine->program = insts;
-    machine->programSize = sizeof(insts) / sizeof(Instruction);
-
-    RunInstructions(machine);
+    run(insts, sizeof(insts) / sizeof(Instruction));
 }
 
 /// do the computations for digital write with
@@ -70,8 +85,7 @@ void high_level_write(int led, BOOL on, Machine* machine) {
 /// use instructions like bit shift left, or
 /// @param led - pin number to write to
 /// @param on - boolean, high or low state
-/// @param machine - machine context
-void low_level_write(int led, BOOL on, Machine* machine) {
+void low_level_write(int led, BOOL on) {
     unsigned short dd = 0x0;
     unsigned short port = 0x0;
     volatile unsigned char* ddptr = NULL;
@@ -97,78 +111,81 @@ void low_level_write(int led, BOOL on, Machine* machine) {
     // Set DDRB |= (1 << pb) (configure pin as output)
     // push 36 to the stack (DDRB register value)
     insts[0].operation = OP_PUSH;
-    insts[0].data.value = DATA_USING_I64(dd);
+    insts[0].kind = OPND_I64;
+    insts[0].imm = dd;
 
     // push 1 to the stack (bit shift operand)
     insts[1].operation = OP_PUSH;
-    insts[1].data.value = DATA_USING_I64(1);
+    insts[1].kind = OPND_I64;
+    insts[1].imm = 1;
 
     // perform left shift 1 << 3 (bit position pb)
     insts[2].operation = OP_SHL;
-    insts[2].data.value = DATA_USING_I64(PinBit(led));
+    insts[2].kind = OPND_I64;
+    insts[2].imm = PinBit(led);
 
     // OR DDRB with (1 << pb)
     insts[3].operation = OP_ORB;
 
     // pop result into DDRB
     insts[4].operation = OP_POP;
-    insts[4].data.registers.dest = REG_R11;
+    insts[4].kind = OPND_REG;
+    insts[4].dest = REG_R11;
 
     // Write state to pin (DRPORTB |= (state << pb))
     // push 37 to the stack (DRPORTB register value)
     insts[5].operation = OP_PUSH;
-    insts[5].data.value = DATA_USING_I64(port);
+    insts[5].kind = OPND_I64;
+    insts[5].imm = port;
 
     // push state (1 for HIGH) to the stack
     insts[6].operation = OP_PUSH;
-    insts[6].data.value = DATA_USING_I64(on);
+    insts[6].kind = OPND_I64;
+    insts[6].imm = on;
 
     // perform left shift state << pb
     insts[7].operation = OP_SHL;
-    insts[7].data.value = DATA_USING_I64(PinBit(led));
+    insts[7].kind = OPND_I64;
+    insts[7].imm = PinBit(led);
 
     // OR DRPORTB with (state << pb)
     insts[8].operation = OP_ORB;
     
     // pop result into DRPORTB
     insts[9].operation = OP_POP;
-    insts[9].data.registers.dest = REG_R10;
-
-    machine->program = insts;
-    machine->programSize = sizeof(insts) / sizeof(Instruction);
+    insts[9].kind = OPND_REG;
+    insts[9].dest = REG_R10;
 
-    RunInstructions(machine);
+    if (run(insts, sizeof(insts) / sizeof(Instruction)) == FALSE)
+        return;
 
-    *ddptr |= machine->memory[REG_R11].data.i64;
-    *pptr |= machine->memory[REG_R10].data.i64;
+    *ddptr |= vm->machine.registers[REG_R11].i64;
+    *pptr |= vm->machine.registers[REG_R10].i64;
 }
 
 void low_level_analog_write(int led, int value) {
     Instruction insts[3];
 
     insts[0].operation = OP_PUSH;
-    insts[0].data.value = DATA_USING_I64(value);
+    insts[0].kind = OPND_I64;
+    insts[0].imm = value;
 
     insts[1].operation = OP_PUSH;
-    insts[1].data.value = DATA_USING_I64(led);
+    insts[1].kind = OPND_I64;
+    insts[1].imm = led;
 
     insts[2].operation = OP_ANWRITE;
 
-    Machine machine = {0};
-    machine.labels[0] = Label{"start", 5, 0};
-    machine.rp = -1;
-    machine.numLabels = 1;
-    machine.program = insts;
-    machine.programSize = sizeof(insts) / sizeof(Instruction);
-
-    RunInstructions(&machine);
+    run(insts, sizeof(insts) / sizeof(Instruction));
 }
 
 void setup() {
     Serial.begin(9600);
 
-    // low_level_write(11, TRUE, machine);
-    // high_level_write(11, TRUE, machine);
+    vm = PvbCreate(0);
+
+    // low_level_write(11, TRUE);
+    // high_level_write(11, TRUE);
 }
 
 void loop() {
@@ -0,0 +1,79 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void* ArenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaBlock* block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = (arena->blockSize != 0) ? arena->blockSize : ARENA_BLOCK_SIZE;
+        if (blockSize < size)
+            blockSize = size;
+
+        block = malloc(sizeof(ArenaBlock) + blockSize);
+        if (block == NULL) {
+            fprintf(stderr, "Buffer allocation error for lexer arena.\n");
+            exit(1);
+        }
+
+        block->next = arena->head;
+        block->size = blockSize;
+        block->used = 0;
+        arena->head = block;
+        arena->blocks++;
+    }
+
+    void* memory = block->data + block->used;
+    block->used += size;
+    arena->allocations++;
+    arena->bytes += size;
+
+    return memory;
+}
+
+char* ArenaCopy(Arena* arena, const char* text, size_t length) {
+    char* copy = ArenaAlloc(arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+
+    return copy;
+}
+
+void ArenaAdopt(Arena* arena, Arena* from) {
+    if (from->head == NULL)
+        return;
+
+    // keep allocating from the current head, adopted blocks go behind it
+    ArenaBlock* tail = from->head;
+    while (tail->next != NULL)
+        tail = tail->next;
+
+    if (arena->head == NULL) {
+        arena->head = from->head;
+    } else {
+        tail->next = arena->head->next;
+        arena->head->next = from->head;
+    }
+
+    arena->blocks += from->blocks;
+    arena->allocations += from->allocations;
+    arena->bytes += from->bytes;
+
+    size_t blockSize = from->blockSize;
+    memset(from, 0, sizeof(Arena));
+    from->blockSize = blockSize;
+}
+
+void ArenaFree(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    memset(arena, 0, sizeof(Arena));
+}
\ No newline at end of file
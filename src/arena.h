@@ -0,0 +1,69 @@
+/// Bump pointer arena allocator
+///
+/// Hands out memory from large blocks by moving a pointer forward.
+/// Nothing is freed on its own, every allocation is released at once
+/// when the arena is freed. Used by the lexer, which makes many small
+/// allocations that all live exactly as long as the lexer does.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "macros.h" // for ARENA_BLOCK_SIZE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 8
+
+/// @brief One malloc'd chunk of an arena
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+/// @brief Bump pointer arena
+///
+/// @param head: block allocations are currently taken from
+/// @param blockSize: size of the next block, ARENA_BLOCK_SIZE if zero
+/// @param blocks: number of blocks malloc'd
+/// @param allocations: number of allocations made from the arena
+/// @param bytes: bytes handed out, including alignment padding
+typedef struct {
+    ArenaBlock* head;
+    size_t blockSize;
+    uint32_t blocks;
+    uint32_t allocations;
+    size_t bytes;
+} Arena;
+
+/// @brief Allocate memory from an arena, aligned to ARENA_ALIGN
+///
+/// Exits if malloc fails
+/// @param arena - arena to allocate from
+/// @param size - bytes to allocate
+/// @return - memory valid until ArenaFree
+void* ArenaAlloc(Arena* arena, size_t size);
+
+/// @brief Copy text into an arena and null terminate it
+/// @param arena - arena to allocate from
+/// @param text - characters to copy, does not need to be terminated
+/// @param length - number of characters to copy
+/// @return - the copy
+char* ArenaCopy(Arena* arena, const char* text, size_t length);
+
+/// @brief Move every block of one arena into another
+///
+/// Memory allocated from 'from' stays valid and is freed with 'arena'
+/// @param arena - arena taking the blocks
+/// @param from - arena giving up its blocks, left empty
+void ArenaAdopt(Arena* arena, Arena* from);
+
+/// @brief Release every block of an arena
+///
+/// The arena is left empty and can be allocated from again
+/// @param arena - arena to free
+void ArenaFree(Arena* arena);
+
+#endif
\ No newline at end of file
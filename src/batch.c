@@ -0,0 +1,425 @@
+#include "batch.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "optimize.h"
+
+#ifdef VM_BATCH
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// @brief A program used by one or more jobs, loaded once
+typedef struct {
+    const char* path;
+    BOOL mapped; // loaded from a .pvbc file into bytecode, otherwise lexed into lexer
+    char* error; // why the program could not be loaded, printed by each of its jobs
+    Lexer lexer;
+    Bytecode bytecode;
+} BatchProgram;
+
+/// @brief One program run with one input
+///
+/// output and errors hold what the job wrote to stdout and stderr
+/// until every job before it has been printed
+typedef struct {
+    uint32_t program;  // index in Batch.programs
+    const char* input; // file read instructions take input from, NULL for none
+    char* output;
+    size_t outputSize;
+    char* errors;
+    size_t errorsSize;
+    long exitCode;
+    BOOL done;
+} BatchJob;
+
+struct Batch;
+
+/// @brief A thread of the pool and the jobs it has left
+///
+/// range packs the next job to run in the low 32 bits and the end of the
+/// jobs in the high 32 bits, so the owner taking from the front and a thief
+/// taking from the back agree through a single compare and swap.
+/// Each worker is on its own cache line so taking a job does not slow the others
+typedef struct {
+    _Alignas(64) uint64_t range;
+    pthread_t thread;
+    BOOL started;
+    struct Batch* batch;
+} BatchWorker;
+
+typedef struct Batch {
+    BatchProgram* programs;
+    uint32_t numPrograms;
+    uint32_t programsCapacity;
+
+    BatchJob* jobs;
+    uint32_t numJobs;
+    uint32_t jobsCapacity;
+
+    BatchWorker* workers;
+    uint32_t numWorkers;
+    BOOL jit;
+    uint32_t stackCapacity;
+    BOOL guardStack;
+    BOOL checkMemory;
+
+    pthread_mutex_t lock; // guards printed and the done flag of every job
+    uint32_t printed;     // jobs before this one have been printed
+} Batch;
+
+#define RANGE(next, end) (((uint64_t)(end) << 32) | (uint32_t)(next))
+#define RANGE_NEXT(range) ((uint32_t)(range))
+#define RANGE_END(range) ((uint32_t)((range) >> 32))
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* Grow(void* array, uint32_t* capacity, uint32_t needed, size_t size) {
+    if (needed <= *capacity)
+        return array;
+
+    uint32_t grown = (*capacity == 0) ? 16 : *capacity * 2;
+    array = realloc(array, (size_t)grown * size);
+    if (array == NULL) {
+        fprintf(stderr, "Buffer allocation error for batch jobs.\n");
+        exit(1);
+    }
+
+    memset((char*)array + (size_t)*capacity * size, 0, (size_t)(grown - *capacity) * size);
+    *capacity = grown;
+    return array;
+}
+
+// find a program already loaded for another job, or load it.
+// a program that fails to load only fails the jobs that run it
+static uint32_t LoadBatchProgram(Batch* batch, char* path, BOOL fuse) {
+    for (uint32_t i = 0; i < batch->numPrograms; i++) {
+        if (strcmp(batch->programs[i].path, path) == 0)
+            return i;
+    }
+
+    batch->programs = Grow(batch->programs, &batch->programsCapacity, batch->numPrograms + 1,
+                           sizeof(BatchProgram));
+    BatchProgram* program = &batch->programs[batch->numPrograms];
+    program->path = path;
+
+    char error[512];
+    long length = 0;
+    char* text = NULL;
+    jmp_buf trap;
+
+    if (IsBytecodeFile(path)) {
+        if (MapBytecode(&program->bytecode, path, error, sizeof(error)) == FALSE)
+            program->error = strdup(error);
+        else
+            program->mapped = TRUE;
+    } else if ((text = ReadTextFile(path, &length)) == NULL) {
+        snprintf(error, sizeof(error), "Error opening file. Path: %s\n", path);
+        program->error = strdup(error);
+    } else if (setjmp(trap) != 0) {
+        program->error = strdup(program->lexer.error);
+        FreeLexer(&program->lexer);
+    } else {
+        LexSource(&program->lexer, path, text, length, 1, &trap);
+        program->lexer.trap = NULL;
+
+        if (fuse == TRUE)
+            FuseInstructions(program->lexer.program, program->lexer.numTokens);
+    }
+
+    return batch->numPrograms++;
+}
+
+// split the job list into jobs, terminating each path in place
+static void ParseJobs(Batch* batch, char* text, BOOL fuse) {
+    char* line = text;
+    while (line != NULL && *line != '\0') {
+        char* next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        char* words[2] = {NULL, NULL};
+        int numWords = 0;
+        for (char* word = strtok(line, " \t\r"); word != NULL && numWords < 2;
+             word = strtok(NULL, " \t\r"))
+            words[numWords++] = word;
+
+        line = next;
+        if (numWords == 0 || words[0][0] == LXR_COMMENT)
+            continue;
+
+        uint32_t program = LoadBatchProgram(batch, words[0], fuse);
+        batch->jobs = Grow(batch->jobs, &batch->jobsCapacity, batch->numJobs + 1, sizeof(BatchJob));
+        batch->jobs[batch->numJobs].program = program;
+        batch->jobs[batch->numJobs++].input = words[1];
+    }
+}
+
+// take the next job from the front of a worker's own range
+static BOOL TakeJob(BatchWorker* worker, uint32_t* job) {
+    uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+    while (RANGE_NEXT(range) < RANGE_END(range)) {
+        uint64_t taken = RANGE(RANGE_NEXT(range) + 1, RANGE_END(range));
+        if (__atomic_compare_exchange_n(&worker->range, &range, taken, TRUE, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            *job = RANGE_NEXT(range);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// move the back half of another worker's jobs into the empty range of 'thief'
+static BOOL StealJobs(Batch* batch, BatchWorker* thief) {
+    uint32_t self = thief - batch->workers;
+
+    for (uint32_t i = 1; i < batch->numWorkers; i++) {
+        BatchWorker* victim = &batch->workers[(self + i) % batch->numWorkers];
+        uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+        while (RANGE_NEXT(range) < RANGE_END(range)) {
+            uint32_t end = RANGE_END(range);
+            uint32_t half = (end - RANGE_NEXT(range) + 1) / 2;
+            uint64_t left = RANGE(RANGE_NEXT(range), end - half);
+
+            if (__atomic_compare_exchange_n(&victim->range, &range, left, TRUE, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&thief->range, RANGE(end - half, end), __ATOMIC_RELEASE);
+                return TRUE;
+            }
+        }
+    }
+
+    // jobs stolen by a worker that has not published them yet are run by that worker
+    return FALSE;
+}
+
+// run a job on 'machine', keeping its output in the job
+static void RunJob(Batch* batch, BatchJob* job, Machine* machine, Instruction** program,
+                   uint32_t* capacity) {
+    BatchProgram* source = &batch->programs[job->program];
+
+    // the stack is the worker's, kept from job to job
+    Value* stack = machine->stack;
+    uint32_t stackCapacity = machine->stackCapacity;
+    BOOL stackGuarded = machine->stackGuarded;
+#ifdef VM_NANBOX
+    Data* stackWide = machine->stackWide;
+#endif
+    memset(machine, 0, sizeof(Machine));
+    machine->stack = stack;
+    machine->stackCapacity = stackCapacity;
+    machine->stackGuarded = stackGuarded;
+#ifdef VM_NANBOX
+    machine->stackWide = stackWide;
+#endif
+    machine->checkMemory = batch->checkMemory;
+
+    machine->output = open_memstream(&job->output, &job->outputSize);
+    machine->errors = open_memstream(&job->errors, &job->errorsSize);
+    if (machine->output == NULL || machine->errors == NULL) {
+        fprintf(stderr, "Error creating output buffers for batch job.\n");
+        exit(1);
+    }
+
+    if (source->error != NULL) {
+        fputs(source->error, machine->errors);
+        job->exitCode = 1;
+        goto done;
+    }
+
+    if (source->mapped == TRUE)
+        LoadBytecode(machine, &source->bytecode);
+    else
+        LoadProgram(machine, &source->lexer);
+
+    // quickening rewrites instructions, so every machine runs its own copy
+    if (machine->programSize > *capacity) {
+        *capacity = machine->programSize;
+        *program = realloc(*program, (size_t)*capacity * sizeof(Instruction));
+        if (*program == NULL) {
+            fprintf(stderr, "Buffer allocation error for batch program.\n");
+            exit(1);
+        }
+    }
+
+    memcpy(*program, machine->program, (size_t)machine->programSize * sizeof(Instruction));
+    machine->program = *program;
+
+    // a job without input reads nothing rather than racing the others for stdin
+    machine->input = fopen(job->input != NULL ? job->input : "/dev/null", "rb");
+    if (machine->input == NULL) {
+        fprintf(machine->errors, "Error opening file. Path: %s\n", job->input);
+        job->exitCode = 1;
+        goto done;
+    }
+
+#ifdef VM_JIT
+    if (batch->jit == TRUE)
+        machine->jit = JitCreate(machine);
+#endif
+
+    // a runtime error ends the job, not the batch
+    jmp_buf trap;
+    machine->trap = &trap;
+    if (setjmp(trap) == 0) {
+        RunInstructions(machine);
+        if (machine->exited == FALSE)
+            PrintRegisterContents(machine);
+
+        job->exitCode = machine->exitCode;
+    } else {
+        fprintf(machine->errors, "runtime error. %s\n", machine->error);
+        job->exitCode = 1;
+    }
+    machine->trap = NULL;
+
+#ifdef VM_JIT
+    if (machine->jit != NULL)
+        JitDestroy(machine->jit);
+#endif
+    // the next job clears the machine, memory the program didn't free goes with it
+    FreeMemory(machine);
+    fclose(machine->input);
+
+done:
+    fclose(machine->output);
+    fclose(machine->errors);
+}
+
+// mark a job done and print every finished job that no earlier job is still running before
+static void FinishJob(Batch* batch, BatchJob* job) {
+    pthread_mutex_lock(&batch->lock);
+    job->done = TRUE;
+
+    while (batch->printed < batch->numJobs && batch->jobs[batch->printed].done == TRUE) {
+        BatchJob* finished = &batch->jobs[batch->printed++];
+
+        fwrite(finished->output, 1, finished->outputSize, stdout);
+        fwrite(finished->errors, 1, finished->errorsSize, stderr);
+
+        free(finished->output);
+        free(finished->errors);
+        finished->output = finished->errors = NULL;
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void* RunWorker(void* arg) {
+    BatchWorker* worker = arg;
+    Batch* batch = worker->batch;
+
+    // one machine per thread, cleared for every job
+    Machine* machine = malloc(sizeof(Machine));
+    Instruction* program = NULL;
+    uint32_t capacity = 0;
+    if (machine == NULL) {
+        fprintf(stderr, "Buffer allocation error for batch machine.\n");
+        exit(1);
+    }
+    CreateStack(machine, batch->stackCapacity, batch->guardStack);
+
+    for (;;) {
+        uint32_t job;
+        if (TakeJob(worker, &job) == FALSE) {
+            if (StealJobs(batch, worker) == FALSE)
+                break;
+            continue;
+        }
+
+        RunJob(batch, &batch->jobs[job], machine, &program, &capacity);
+        FinishJob(batch, &batch->jobs[job]);
+    }
+
+    free(program);
+    DestroyStack(machine);
+    free(machine);
+    return NULL;
+}
+
+int RunBatch(const char* path, unsigned int threads, BOOL fuse, BOOL jit, uint32_t stackCapacity,
+             BOOL guardStack, BOOL checkMemory) {
+    int length = 0;
+    char* text = ReadFromFile((char*)path, &length);
+
+    Batch batch = {0};
+    batch.jit = jit;
+    batch.stackCapacity = stackCapacity;
+    batch.guardStack = guardStack;
+    batch.checkMemory = checkMemory;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    ParseJobs(&batch, text, fuse);
+
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > batch.numJobs)
+        threads = batch.numJobs;
+    if (threads == 0)
+        threads = 1;
+
+    batch.numWorkers = threads;
+    batch.workers = aligned_alloc(_Alignof(BatchWorker), threads * sizeof(BatchWorker));
+    if (batch.workers == NULL) {
+        fprintf(stderr, "Buffer allocation error for batch workers.\n");
+        exit(1);
+    }
+
+    // each worker starts with a contiguous share of the jobs
+    for (uint32_t i = 0; i < threads; i++) {
+        memset(&batch.workers[i], 0, sizeof(BatchWorker));
+        batch.workers[i].batch = &batch;
+        batch.workers[i].range = RANGE((uint64_t)batch.numJobs * i / threads,
+                                       (uint64_t)batch.numJobs * (i + 1) / threads);
+    }
+
+    double start = Now();
+
+    // the calling thread is worker 0. jobs of a thread that could not be made are stolen
+    for (uint32_t i = 1; i < threads; i++)
+        batch.workers[i].started =
+            pthread_create(&batch.workers[i].thread, NULL, RunWorker, &batch.workers[i]) == 0;
+
+    RunWorker(&batch.workers[0]);
+    for (uint32_t i = 1; i < threads; i++) {
+        if (batch.workers[i].started == TRUE)
+            pthread_join(batch.workers[i].thread, NULL);
+    }
+
+    double elapsed = Now() - start;
+
+    int failed = 0;
+    for (uint32_t i = 0; i < batch.numJobs; i++)
+        failed += batch.jobs[i].exitCode != 0;
+
+    fprintf(stderr, "%u jobs on %u threads in %.3f s, %.0f jobs/s, %d failed\n", batch.numJobs,
+            threads, elapsed, batch.numJobs / (elapsed > 0 ? elapsed : 1e-9), failed);
+
+    for (uint32_t i = 0; i < batch.numPrograms; i++) {
+        free(batch.programs[i].error);
+        if (batch.programs[i].mapped == TRUE)
+            UnmapBytecode(&batch.programs[i].bytecode);
+        else
+            FreeLexer(&batch.programs[i].lexer);
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.workers);
+    free(batch.programs);
+    free(batch.jobs);
+    free(text);
+
+    return failed;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+/// Batch runner
+///
+/// Runs many small jobs in one process instead of one process per job.
+/// A job is a program, lexed and fused once no matter how many jobs use
+/// it, and optionally a file its read instructions take input from.
+///
+/// Every job runs on its own Machine with a private copy of the program,
+/// since quickening rewrites instructions while they run. Jobs are split
+/// between a pool of threads that steal from each other when they run out.
+/// Output of each job is kept in memory and printed in job order, so the
+/// output of a batch does not depend on how many threads ran it.
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "lexer.h"
+
+#ifdef VM_BATCH
+
+/// @brief Run every job listed in a file
+///
+/// Each line of the file is a program path (.pvb or .pvbc), optionally
+/// followed by an input file. Empty lines and lines starting with
+/// LXR_COMMENT are skipped. Jobs without an input file read nothing.
+/// A summary with the jobs per second is printed to stderr
+/// @param path - file listing the jobs
+/// @param threads - threads to run jobs on, 0 for one per core
+/// @param fuse - run FuseInstructions on each program
+/// @param jit - give each machine a jit
+/// @param stackCapacity - values each machine's stack holds
+/// @param guardStack - put each machine's stack between guard pages, see CreateStack
+/// @param checkMemory - keep loads and stores inside SYS_ALLOC memory, see CheckMemory
+/// @return - number of jobs that exited with a non zero code, or -1 if the
+///           list could not be read
+int RunBatch(const char* path, unsigned int threads, BOOL fuse, BOOL jit, uint32_t stackCapacity,
+             BOOL guardStack, BOOL checkMemory);
+
+#endif
+
+#endif
@@ -0,0 +1,401 @@
+#include "bytecode.h"
+#include "vector.h"
+
+#ifndef USING_ARDUINO
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define PVBC_ALIGN(offset) (((offset) + 15) & ~(uint64_t)15)
+
+BOOL IsBytecodeFile(const char* path) {
+    size_t length = strlen(path);
+    size_t extension = strlen(PVBC_EXTENSION);
+
+    return length > extension && strcmp(path + length - extension, PVBC_EXTENSION) == 0;
+}
+
+// print an error, or keep it in 'error' if the caller gave a buffer
+static void Report(char* error, size_t errorSize, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (error != NULL)
+        vsnprintf(error, errorSize, format, args);
+    else
+        vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static BOOL WriteSection(FILE* file, uint64_t offset, const void* data, size_t size) {
+    static const char padding[16] = {0};
+
+    long position = ftell(file);
+    if (position < 0 || (uint64_t)position > offset)
+        return FALSE;
+
+    if (fwrite(padding, 1, offset - position, file) != offset - position)
+        return FALSE;
+
+    return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+BOOL WriteBytecode(const char* path, Lexer* lexer, const Instruction* program, uint32_t flags,
+                   char* error, size_t errorSize) {
+    BytecodeHeader header = {
+        .magic = PVBC_MAGIC,
+        .version = PVBC_VERSION,
+        .headerSize = sizeof(BytecodeHeader),
+        .flags = flags,
+        .entry = PVBC_NO_ENTRY,
+        .numInstructions = lexer->numTokens,
+        .numConstants = lexer->numConstants,
+        .numLabels = lexer->numLabels,
+        .labelSize = sizeof(BytecodeLabel),
+        .stringsSize = lexer->stringsSize,
+    };
+
+    // label names go after the string pool
+    BytecodeLabel* labels = calloc(lexer->numLabels + 1, sizeof(BytecodeLabel));
+    if (labels == NULL) {
+        Report(error, errorSize, "Buffer allocation error for labels.\n");
+        return FALSE;
+    }
+
+    if (lexer->entry != -1)
+        header.entry = lexer->entry;
+
+    for (unsigned int i = 0; i < lexer->numLabels; i++) {
+        labels[i].name = header.stringsSize;
+        labels[i].nameLen = lexer->labels[i].nameLen;
+        labels[i].index = lexer->labels[i].index;
+        header.stringsSize += lexer->labels[i].nameLen + 1;
+    }
+
+    header.instructionsOffset = PVBC_ALIGN(sizeof(BytecodeHeader));
+    header.constantsOffset =
+        PVBC_ALIGN(header.instructionsOffset + header.numInstructions * sizeof(Instruction));
+    header.labelsOffset =
+        PVBC_ALIGN(header.constantsOffset + header.numConstants * sizeof(DataCell));
+    header.stringsOffset =
+        PVBC_ALIGN(header.labelsOffset + header.numLabels * sizeof(BytecodeLabel));
+    header.fileSize = header.stringsOffset + header.stringsSize;
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        Report(error, errorSize, "Error opening file. Path: %s\n", path);
+        free(labels);
+        return FALSE;
+    }
+
+    BOOL written =
+        WriteSection(file, 0, &header, sizeof(header)) &&
+        WriteSection(file, header.instructionsOffset, program,
+                     header.numInstructions * sizeof(Instruction)) &&
+        WriteSection(file, header.constantsOffset, lexer->constants,
+                     header.numConstants * sizeof(DataCell)) &&
+        WriteSection(file, header.labelsOffset, labels,
+                     header.numLabels * sizeof(BytecodeLabel)) &&
+        WriteSection(file, header.stringsOffset, lexer->strings, lexer->stringsSize);
+
+    uint64_t offset = header.stringsOffset + lexer->stringsSize;
+    for (unsigned int i = 0; i < lexer->numLabels && written == TRUE; i++) {
+        written = WriteSection(file, offset, lexer->labels[i].name, labels[i].nameLen + 1);
+        offset += labels[i].nameLen + 1;
+    }
+
+    free(labels);
+
+    if (fclose(file) != 0 || written == FALSE) {
+        Report(error, errorSize, "Error writing bytecode file. Path: %s\n", path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// true if a section of 'count' items of 'size' bytes at 'offset' is inside the file
+static BOOL SectionFits(const Bytecode* bytecode, uint64_t offset, uint64_t count, uint64_t size) {
+    return offset % 8 == 0 && offset <= bytecode->size &&
+           count <= (bytecode->size - offset) / (size ? size : 1);
+}
+
+static const char* CheckHeader(const Bytecode* bytecode) {
+    const BytecodeHeader* header = bytecode->header;
+
+    if (bytecode->size < sizeof(BytecodeHeader) || header->magic != PVBC_MAGIC)
+        return "not a .pvbc file";
+    if (header->version != PVBC_VERSION || header->headerSize != sizeof(BytecodeHeader))
+        return "unsupported .pvbc version";
+    if (header->labelSize != sizeof(BytecodeLabel))
+        return "labels were written by an incompatible build";
+    if (header->fileSize != bytecode->size)
+        return "file is truncated";
+    if (!SectionFits(bytecode, header->instructionsOffset, header->numInstructions,
+                     sizeof(Instruction)) ||
+        !SectionFits(bytecode, header->constantsOffset, header->numConstants, sizeof(DataCell)) ||
+        !SectionFits(bytecode, header->labelsOffset, header->numLabels, sizeof(BytecodeLabel)) ||
+        !SectionFits(bytecode, header->stringsOffset, header->stringsSize, 1))
+        return "section out of bounds";
+    if (header->stringsSize > 0 &&
+        ((const char*)bytecode->base)[header->stringsOffset + header->stringsSize - 1] != '\0')
+        return "string pool is not terminated";
+    if (header->entry != PVBC_NO_ENTRY && header->entry > header->numInstructions)
+        return "entry point out of bounds";
+
+    const BytecodeLabel* labels =
+        (const BytecodeLabel*)((const char*)bytecode->base + header->labelsOffset);
+    const char* strings = (const char*)bytecode->base + header->stringsOffset;
+    for (uint32_t i = 0; i < header->numLabels; i++) {
+        if ((uint64_t)labels[i].name + labels[i].nameLen >= header->stringsSize ||
+            strings[labels[i].name + labels[i].nameLen] != '\0')
+            return "label name out of bounds";
+        if (labels[i].index > header->numInstructions)
+            return "label out of bounds";
+    }
+
+    return NULL;
+}
+
+// true if a string operand points at the bytes of a string in the pool, see STRING_LENGTH
+static BOOL StringFits(const BytecodeHeader* header, const char* strings, uint32_t offset) {
+    if (offset < sizeof(uint32_t) || offset % sizeof(uint32_t) != 0 ||
+        offset >= header->stringsSize)
+        return FALSE;
+
+    uint32_t length;
+    memcpy(&length, strings + offset - sizeof(uint32_t), sizeof(length));
+    return length < header->stringsSize - offset && strings[offset + length] == '\0';
+}
+
+// TRUE if an opcode reads its operand with OPERAND_VALUE, which takes any
+// kind it doesn't know for a constant
+static BOOL ReadsOperandValue(uint8_t operation) {
+    switch (operation) {
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_CMP:
+    case OP_CMPJE:
+    case OP_CMPJNE:
+    case OP_CMPJG:
+    case OP_CMPJGE:
+    case OP_CMPJL:
+    case OP_CMPJLE:
+    case OP_PUSH:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+// the lexer only writes operands that are in bounds, a file can hold anything.
+// every register, constant, string and jump target an instruction names has
+// to be inside the machine or the file before it runs
+static const char* CheckInstructions(const Bytecode* bytecode) {
+    const BytecodeHeader* header = bytecode->header;
+    const Instruction* program =
+        (const Instruction*)((const char*)bytecode->base + header->instructionsOffset);
+    const char* strings = (const char*)bytecode->base + header->stringsOffset;
+
+    for (uint32_t ip = 0; ip < header->numInstructions; ip++) {
+        Instruction inst = program[ip];
+        uint8_t op = inst.operation;
+
+        // quickened opcodes are only ever made while running
+        if (op >= OP_ADD_I64_RI)
+            return "unknown opcode";
+
+        // vector instructions name vector registers, apart from their scalar
+        // operands. the src of a fused shift is the shift amount
+        uint32_t destRegs = (IS_VECTOR_OPCODE(op) && !IsScalarVectorOperand(op, 1))
+                                ? NUM_VECTOR_REGISTERS
+                                : NUM_REGISTERS;
+        uint32_t srcRegs = (IS_VECTOR_OPCODE(op) && !IsScalarVectorOperand(op, 0))
+                               ? NUM_VECTOR_REGISTERS
+                           : (op == OP_SHLI || op == OP_SHRI) ? 64
+                                                              : NUM_REGISTERS;
+        if (inst.dest >= destRegs || inst.src >= srcRegs)
+            return "register out of bounds";
+        if ((op == OP_ORR || op == OP_ANDR || op == OP_XORR) &&
+            (uint32_t)inst.imm >= NUM_REGISTERS)
+            return "register out of bounds";
+
+        switch (inst.kind) {
+        case OPND_NONE:
+        case OPND_REG:
+        case OPND_I64:
+        case OPND_MEM:
+            break;
+        case OPND_WIDE:
+        case OPND_F64:
+            if (inst.index >= header->numConstants)
+                return "constant out of bounds";
+            break;
+        case OPND_STR:
+            if (StringFits(header, strings, inst.index) == FALSE)
+                return "string out of bounds";
+            break;
+        case OPND_LABEL:
+            if (inst.index > header->numInstructions)
+                return "jump target out of bounds";
+            break;
+        case OPND_MEM_INDEX:
+            if (MEM_INDEX_REG(inst) >= NUM_REGISTERS || MEM_INDEX_SHIFT(inst) > 3)
+                return "register out of bounds";
+            break;
+        default:
+            return "unknown operand kind";
+        }
+
+        if (ReadsOperandValue(op) == TRUE && inst.kind != OPND_REG && inst.kind != OPND_I64 &&
+            inst.kind != OPND_WIDE && inst.kind != OPND_F64 &&
+            (op != OP_PUSH || inst.kind != OPND_STR))
+            return "operand of the wrong kind";
+        if (IsJumpOpcode(op) == TRUE && inst.kind != OPND_LABEL)
+            return "operand of the wrong kind";
+        if (op >= OP_LOAD && op <= OP_STOREF && inst.kind != OPND_MEM &&
+            inst.kind != OPND_MEM_INDEX)
+            return "operand of the wrong kind";
+
+        // a fused compare takes its target from the jump left after it
+        if (op >= OP_CMPJE && op <= OP_CMPJLE &&
+            (ip + 1 >= header->numInstructions || program[ip + 1].kind != OPND_LABEL))
+            return "fused compare without its jump";
+    }
+
+    return NULL;
+}
+
+BOOL MapBytecode(Bytecode* bytecode, const char* path, char* error, size_t errorSize) {
+    memset(bytecode, 0, sizeof(Bytecode));
+
+#ifdef _WIN32
+    // no mmap, read the whole file instead. the layout still needs no fixups
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        Report(error, errorSize, "Error opening file. Path: %s\n", path);
+        return FALSE;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    bytecode->base = malloc(length > 0 ? length : 1);
+    if (bytecode->base == NULL || fread(bytecode->base, 1, length, file) != (size_t)length) {
+        Report(error, errorSize, "Error reading file. Path: %s\n", path);
+        fclose(file);
+        free(bytecode->base);
+        bytecode->base = NULL;
+        return FALSE;
+    }
+    fclose(file);
+    bytecode->size = length;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        Report(error, errorSize, "Error opening file. Path: %s\n", path);
+        return FALSE;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(BytecodeHeader)) {
+        Report(error, errorSize, "Error loading bytecode. Path: %s: not a .pvbc file\n", path);
+        close(fd);
+        return FALSE;
+    }
+
+    // private and writable so quickening can rewrite opcodes without touching the file
+    void* base = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        Report(error, errorSize, "Error mapping file. Path: %s\n", path);
+        return FALSE;
+    }
+
+    bytecode->base = base;
+    bytecode->size = info.st_size;
+#endif
+
+    bytecode->header = bytecode->base;
+
+    const char* problem = CheckHeader(bytecode);
+    if (problem == NULL)
+        problem = CheckInstructions(bytecode);
+    if (problem != NULL) {
+        Report(error, errorSize, "Error loading bytecode. Path: %s: %s\n", path, problem);
+        UnmapBytecode(bytecode);
+        return FALSE;
+    }
+
+    const BytecodeHeader* header = bytecode->header;
+    const BytecodeLabel* labels =
+        (const BytecodeLabel*)((char*)bytecode->base + header->labelsOffset);
+    const char* strings = (char*)bytecode->base + header->stringsOffset;
+
+    bytecode->labels = calloc(header->numLabels + 1, sizeof(Label));
+    if (bytecode->labels == NULL) {
+        Report(error, errorSize, "Buffer allocation error for labels.\n");
+        UnmapBytecode(bytecode);
+        return FALSE;
+    }
+
+    for (uint32_t i = 0; i < header->numLabels; i++) {
+        bytecode->labels[i].name = strings + labels[i].name;
+        bytecode->labels[i].nameLen = labels[i].nameLen;
+        bytecode->labels[i].index = labels[i].index;
+    }
+
+    return TRUE;
+}
+
+void LoadBytecode(Machine* machine, const Bytecode* bytecode) {
+    const BytecodeHeader* header = bytecode->header;
+    char* base = bytecode->base;
+
+    machine->program = (Instruction*)(base + header->instructionsOffset);
+    machine->programSize = header->numInstructions;
+    machine->constants = (DataCell*)(base + header->constantsOffset);
+    machine->strings = base + header->stringsOffset;
+
+    machine->labels = bytecode->labels;
+    machine->numLabels = header->numLabels;
+
+    machine->rp = -1;
+    if (header->entry != PVBC_NO_ENTRY) {
+        machine->ip = header->entry;
+        machine->started = TRUE;
+    }
+}
+
+void UnmapBytecode(Bytecode* bytecode) {
+    if (bytecode->base == NULL)
+        return;
+
+    free(bytecode->labels);
+
+#ifdef _WIN32
+    free(bytecode->base);
+#else
+    munmap(bytecode->base, bytecode->size);
+#endif
+
+    memset(bytecode, 0, sizeof(Bytecode));
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+/// Compiled bytecode files (.pvbc)
+///
+/// A .pvbc file holds everything a machine needs to run a program
+/// without lexing it. Every section is stored exactly as the machine
+/// uses it in memory and none of them hold pointers, so a file is loaded
+/// with a single mmap and the machine points straight into the mapping.
+///
+/// Layout, every section starts on a 16 byte boundary:
+///     BytecodeHeader
+///     Instruction[numInstructions]
+///     DataCell[numConstants]   constant pool
+///     BytecodeLabel[numLabels]
+///     char[stringsSize]        string pool (see STRING_LENGTH), then the label names
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "lexer.h" // for Lexer, Machine and Instruction
+
+#include <stddef.h>
+
+#define PVBC_MAGIC 0x43425650 // "PVBC" in a little endian file
+#define PVBC_VERSION 6
+#define PVBC_EXTENSION ".pvbc"
+#define PVBC_NO_ENTRY UINT32_MAX // the program has no _start label
+
+typedef enum {
+    PVBC_FUSED = 1 << 0, // FuseInstructions already ran on the instructions
+} BytecodeFlags;
+
+/// @brief First bytes of a .pvbc file
+///
+/// Offsets are from the start of the file. stringsSize covers the string
+/// pool and the label names stored after it
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t flags;
+    uint32_t entry; // instruction index of _start or PVBC_NO_ENTRY
+    uint32_t numInstructions;
+    uint32_t numConstants;
+    uint32_t numLabels;
+    uint32_t labelSize;
+    uint32_t stringsSize;
+    uint32_t reserved;
+    uint64_t instructionsOffset;
+    uint64_t constantsOffset;
+    uint64_t labelsOffset;
+    uint64_t stringsOffset;
+    uint64_t fileSize;
+} BytecodeHeader;
+
+_Static_assert(sizeof(BytecodeHeader) == 80, "BytecodeHeader is part of the file format");
+
+/// @brief A label as stored in a .pvbc file
+///
+/// Label holds a pointer to its name, so the file stores
+/// where the name is in the string section instead
+typedef struct {
+    uint32_t name; // byte offset of the null terminated name in the string section
+    uint32_t nameLen;
+    uint32_t index;
+} BytecodeLabel;
+
+_Static_assert(sizeof(BytecodeLabel) == 12, "BytecodeLabel is part of the file format");
+
+/// @brief A .pvbc file mapped into memory
+///
+/// labels is built from the file's BytecodeLabels when it is mapped,
+/// with names pointing into the mapping
+typedef struct {
+    void* base;
+    size_t size;
+    const BytecodeHeader* header;
+    Label* labels;
+} Bytecode;
+
+/// @brief Check if a path names a compiled bytecode file
+/// @param path - path to check
+/// @return - TRUE if path ends in PVBC_EXTENSION
+BOOL IsBytecodeFile(const char* path);
+
+/// @brief Write a lexed program to a .pvbc file
+/// @param path - file to create
+/// @param lexer - lexer holding the constant pool, string pool and labels
+/// @param program - instructions to write, possibly fused
+/// @param flags - BytecodeFlags describing program
+/// @param error - buffer for why the file could not be written, NULL to print it instead
+/// @param errorSize - size of error
+/// @return - TRUE on success, FALSE if the file could not be written
+BOOL WriteBytecode(const char* path, Lexer* lexer, const Instruction* program, uint32_t flags,
+                   char* error, size_t errorSize);
+
+/// @brief Map a .pvbc file and check its header and instructions
+///
+/// Every register, constant, string and jump target the instructions name
+/// is checked to be in bounds, a file from disk is not trusted the way
+/// lexer output is. The mapping is private and writable so instructions
+/// can still be quickened in place without touching the file
+/// @param bytecode - out, the mapped file
+/// @param path - file to map
+/// @param error - buffer for why the file is not usable, NULL to print it instead
+/// @param errorSize - size of error
+/// @return - TRUE on success, FALSE if the file is not usable
+BOOL MapBytecode(Bytecode* bytecode, const char* path, char* error, size_t errorSize);
+
+/// @brief Point a machine at the sections of a mapped file
+///
+/// Nothing is copied, the machine points into the mapping and the
+/// label table built by MapBytecode. The mapping must outlive the machine
+/// @param machine - machine to load the program into
+/// @param bytecode - mapped file
+void LoadBytecode(Machine* machine, const Bytecode* bytecode);
+
+/// @brief Unmap a file mapped by MapBytecode and free its label table
+/// @param bytecode - mapped file
+void UnmapBytecode(Bytecode* bytecode);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,152 @@
+# Generates keywords.h, perfect hash tables for opcode keywords, register names
+# and vector register names.
+#
+# Every keyword hashes to its own slot, so the lexer recognises a word
+# with one hash, one length check and one memcmp instead of comparing it
+# against every keyword. Run again after adding an opcode or a register:
+#
+#     python3 src/gen-keywords.py > src/keywords.h
+
+import sys
+
+OPCODES = [
+    ("nop", "OP_NOP"), ("push", "OP_PUSH"), ("pop", "OP_POP"), ("mov", "OP_MOV"),
+    ("swap", "OP_SWAP"), ("jmp", "OP_JMP"), ("ret", "OP_RET"), ("jne", "OP_JNE"),
+    ("je", "OP_JE"), ("jg", "OP_JG"), ("call", "OP_CALL"), ("jge", "OP_JGE"),
+    ("jl", "OP_JL"), ("jle", "OP_JLE"), ("add", "OP_ADD"), ("sub", "OP_SUB"),
+    ("cmp", "OP_CMP"), ("mul", "OP_MUL"), ("div", "OP_DIV"), ("mod", "OP_MOD"),
+    ("neg", "OP_NEG"), ("AND", "OP_ANDB"), ("OR", "OP_ORB"), ("NOT", "OP_NOTB"),
+    ("XOR", "OP_XORB"), ("shl", "OP_SHL"), ("shr", "OP_SHR"), ("dup", "OP_DUP"),
+    ("clear", "OP_CLR"), ("size", "OP_SIZE"), ("print", "OP_PRNT"), ("exit", "OP_EXIT"),
+    ("write", "OP_WRITE"), ("read", "OP_READ"), ("syscall", "OP_SYSCALL"), ("flush", "OP_FLUSH"),
+    ("movb", "OP_LOADB"), ("movf", "OP_LOADF"),
+]
+
+# left out of the tables on arduino, see USING_ARDUINO in macros.h
+VECTOR_OPCODES = [
+    ("vload", "OP_VLOAD"), ("vstore", "OP_VSTORE"), ("vsplat", "OP_VSPLAT"), ("vadd", "OP_VADD"),
+    ("vsub", "OP_VSUB"), ("vmul", "OP_VMUL"), ("vmin", "OP_VMIN"), ("vmax", "OP_VMAX"),
+    ("vcmpeq", "OP_VCMPEQ"), ("vcmpgt", "OP_VCMPGT"), ("vsum", "OP_VSUM"), ("vfadd", "OP_VFADD"),
+    ("vfsub", "OP_VFSUB"), ("vfmul", "OP_VFMUL"), ("vfmin", "OP_VFMIN"), ("vfmax", "OP_VFMAX"),
+    ("vfcmpeq", "OP_VFCMPEQ"), ("vfcmpgt", "OP_VFCMPGT"), ("vfsum", "OP_VFSUM"),
+]
+
+REGISTERS = [
+    ("rax", "REG_RAX"), ("rdi", "REG_RDI"), ("rsi", "REG_RSI"), ("rbx", "REG_RBX"),
+    ("rcx", "REG_RCX"), ("rdx", "REG_RDX"), ("r8", "REG_R8"), ("r9", "REG_R9"),
+    ("r10", "REG_R10"), ("r11", "REG_R11"), ("r12", "REG_R12"), ("r13", "REG_R13"),
+    ("r14", "REG_R14"), ("r15", "REG_R15"), ("ep", "REG_EP"), ("cp", "REG_CP"),
+]
+
+VECTOR_REGISTERS = [(f"v{i}", f"VREG_V{i}") for i in range(16)]
+
+HASH_BITS = 7     # 128 slots per table
+MAX_NAME_LEN = 8  # longest keyword plus its terminator
+
+
+def keyword_hash(word, seed):
+    # must match KeywordHash in the generated header
+    second = ord(word[1]) if len(word) > 1 else 0
+    key = ord(word[0]) | second << 8 | ord(word[-1]) << 16 | len(word) << 24
+    return ((key * seed) & 0xFFFFFFFF) >> (32 - HASH_BITS)
+
+
+def find_seed(words):
+    for seed in range(0x9E3779B1, 0x9E3779B1 + (1 << 24), 2):
+        if len({keyword_hash(word, seed) for word in words}) == len(words):
+            return seed
+    sys.exit("no perfect hash seed found, raise HASH_BITS")
+
+
+def emit_slots(slots):
+    for index, slot in enumerate(slots):
+        if slot is not None:
+            print(f'    [{index}] = {{"{slot[0]}", {len(slot[0])}, {slot[1]}}},')
+
+
+# 'desktop' entries are only compiled in without USING_ARDUINO. they still
+# get slots of their own, so both builds share one seed
+def emit_table(name, seed_name, entries, desktop=[]):
+    seed = find_seed([word for word, _ in entries + desktop])
+    slots = [None] * (1 << HASH_BITS)
+    desktopSlots = [None] * (1 << HASH_BITS)
+    for table, words in ((slots, entries), (desktopSlots, desktop)):
+        for word, value in words:
+            assert len(word) < MAX_NAME_LEN
+            table[keyword_hash(word, seed)] = (word, value)
+
+    print(f"#define {seed_name} 0x{seed:08X}u\n")
+    print(f"static const Keyword {name}[KEYWORD_SLOTS] = {{")
+    emit_slots(slots)
+    if desktop:
+        print("#ifndef USING_ARDUINO")
+        emit_slots(desktopSlots)
+        print("#endif")
+    print("};\n")
+
+
+def main():
+    print("""/// Perfect hash tables for keywords
+///
+/// GENERATED by src/gen-keywords.py, do not edit by hand.
+///
+/// Each table gives every keyword a slot of its own, so looking a word up
+/// costs one hash and one comparison. Unused slots have a length of zero.
+
+#ifndef KEYWORDS_H
+#define KEYWORDS_H
+
+#include "inst.h" // for Opcode, Register and VectorRegister
+
+#include <stddef.h>
+#include <string.h>
+""")
+    print(f"#define KEYWORD_HASH_BITS {HASH_BITS}")
+    print(f"#define KEYWORD_SLOTS (1 << KEYWORD_HASH_BITS)")
+    print(f"#define KEYWORD_MAX_LEN {MAX_NAME_LEN}\n")
+    print("""typedef struct {
+    char name[KEYWORD_MAX_LEN];
+    uint8_t length;
+    uint8_t value;
+} Keyword;
+
+/// @brief Hash a word using its length, first two and last characters
+/// @param word - start of the word, does not need to be terminated
+/// @param length - characters in the word, at least one
+/// @param seed - seed of the table being searched
+/// @return - slot of the word in the table
+static inline uint32_t KeywordHash(const char* word, size_t length, uint32_t seed) {
+    uint32_t second = (length > 1) ? (uint8_t)word[1] : 0;
+    uint32_t key = (uint8_t)word[0] | second << 8 | (uint32_t)(uint8_t)word[length - 1] << 16 |
+                   (uint32_t)length << 24;
+
+    return (key * seed) >> (32 - KEYWORD_HASH_BITS);
+}
+
+/// @brief Find a word in a table generated by gen-keywords.py
+/// @param table - table to search
+/// @param seed - seed the table was generated with
+/// @param word - start of the word, does not need to be terminated
+/// @param length - characters in the word
+/// @return - the keyword, or NULL if word is not in the table
+static inline const Keyword* KeywordLookup(const Keyword* table, uint32_t seed, const char* word,
+                                           size_t length) {
+    if (length == 0 || length >= KEYWORD_MAX_LEN)
+        return NULL;
+
+    const Keyword* keyword = &table[KeywordHash(word, length, seed)];
+    if (keyword->length != length || memcmp(keyword->name, word, length) != 0)
+        return NULL;
+
+    return keyword;
+}
+""")
+    emit_table("opcodeKeywords", "OPCODE_KEYWORD_SEED", OPCODES, VECTOR_OPCODES)
+    emit_table("registerKeywords", "REGISTER_KEYWORD_SEED", REGISTERS)
+    print("#ifndef USING_ARDUINO\n")
+    emit_table("vectorKeywords", "VECTOR_KEYWORD_SEED", VECTOR_REGISTERS)
+    print("#endif\n")
+    print("#endif", end="")
+
+
+main()
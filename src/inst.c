@@ -1,5 +1,11 @@
 #include "inst.h"
+#include "jit.h"
+#include "keywords.h"
 #include "macros.h"
+#include "profile.h"
+#include "trace.h"
+#include "vector.h"
+#include "verify.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +18,20 @@
 #include <unistd.h>
 #endif
 
+#ifdef VM_GUARD_STACK
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#ifdef VM_WRITEV
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// a stream a machine was given, or the process stream it falls back to
+#define MACHINE_STREAM(stream, fallback) ((stream) != NULL ? (stream) : (fallback))
+
 static const RegisterMap registerMap[] = {
     {"rax", REG_RAX}, {"rdi", REG_RDI},     {"rsi", REG_RSI}, {"rbx", REG_RBX}, {"rcx", REG_RCX},
     {"rdx", REG_RDX}, {"r8", REG_R8},       {"r9", REG_R9},   {"r10", REG_R10}, {"r11", REG_R11},
@@ -31,6 +51,105 @@ BOOL ValidSyscall(unsigned int ssn) {
     return FALSE;
 }
 
+static const char* opcodeNames[NUM_OPCODES] = {
+    [OP_NOP] = "nop",
+    [OP_PUSH] = "push",
+    [OP_POP] = "pop",
+    [OP_MOV] = "mov",
+    [OP_SWAP] = "swap",
+    [OP_CALL] = "call",
+    [OP_RET] = "ret",
+    [OP_CMP] = "cmp",
+    [OP_JMP] = "jmp",
+    [OP_JNE] = "jne",
+    [OP_JE] = "je",
+    [OP_JG] = "jg",
+    [OP_JGE] = "jge",
+    [OP_JL] = "jl",
+    [OP_JLE] = "jle",
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_MOD] = "mod",
+    [OP_NEG] = "neg",
+    [OP_ANDB] = "AND",
+    [OP_ORB] = "OR",
+    [OP_OREB] = "OREB",
+    [OP_NOTB] = "NOT",
+    [OP_XORB] = "XOR",
+    [OP_SHL] = "shl",
+    [OP_SHR] = "shr",
+    [OP_DUP] = "dup",
+    [OP_CLR] = "clear",
+    [OP_SIZE] = "size",
+    [OP_PRNT] = "print",
+    [OP_WRITE] = "write",
+    [OP_READ] = "read",
+    [OP_ANWRITE] = "anwrite",
+    [OP_FLUSH] = "flush",
+    [OP_SYSCALL] = "syscall",
+    [OP_EXIT] = "exit",
+    [OP_LOAD] = "load",
+    [OP_LOADB] = "load i8",
+    [OP_LOADF] = "load f64",
+    [OP_STORE] = "store",
+    [OP_STOREB] = "store i8",
+    [OP_STOREF] = "store f64",
+#ifndef USING_ARDUINO
+    [OP_VLOAD] = "vload",
+    [OP_VSTORE] = "vstore",
+    [OP_VSPLAT] = "vsplat",
+    [OP_VADD] = "vadd",
+    [OP_VSUB] = "vsub",
+    [OP_VMUL] = "vmul",
+    [OP_VMIN] = "vmin",
+    [OP_VMAX] = "vmax",
+    [OP_VCMPEQ] = "vcmpeq",
+    [OP_VCMPGT] = "vcmpgt",
+    [OP_VSUM] = "vsum",
+    [OP_VFADD] = "vfadd",
+    [OP_VFSUB] = "vfsub",
+    [OP_VFMUL] = "vfmul",
+    [OP_VFMIN] = "vfmin",
+    [OP_VFMAX] = "vfmax",
+    [OP_VFCMPEQ] = "vfcmpeq",
+    [OP_VFCMPGT] = "vfcmpgt",
+    [OP_VFSUM] = "vfsum",
+#endif
+    [OP_SHLI] = "shl imm",
+    [OP_SHRI] = "shr imm",
+    [OP_ORR] = "OR reg",
+    [OP_ANDR] = "AND reg",
+    [OP_XORR] = "XOR reg",
+    [OP_CMPJE] = "cmp je",
+    [OP_CMPJNE] = "cmp jne",
+    [OP_CMPJG] = "cmp jg",
+    [OP_CMPJGE] = "cmp jge",
+    [OP_CMPJL] = "cmp jl",
+    [OP_CMPJLE] = "cmp jle",
+    [OP_ADD_I64_RI] = "add i64 ri",
+    [OP_ADD_I64_RR] = "add i64 rr",
+    [OP_ADD_F64_RI] = "add f64 ri",
+    [OP_ADD_F64_RR] = "add f64 rr",
+    [OP_SUB_I64_RI] = "sub i64 ri",
+    [OP_SUB_I64_RR] = "sub i64 rr",
+    [OP_SUB_F64_RI] = "sub f64 ri",
+    [OP_SUB_F64_RR] = "sub f64 rr",
+    [OP_MUL_I64_RI] = "mul i64 ri",
+    [OP_MUL_I64_RR] = "mul i64 rr",
+    [OP_MUL_F64_RI] = "mul f64 ri",
+    [OP_MUL_F64_RR] = "mul f64 rr",
+    [OP_DIV_I64_RI] = "div i64 ri",
+    [OP_DIV_I64_RR] = "div i64 rr",
+    [OP_DIV_F64_RI] = "div f64 ri",
+    [OP_DIV_F64_RR] = "div f64 rr",
+    [OP_MOD_I64_RI] = "mod i64 ri",
+    [OP_MOD_I64_RR] = "mod i64 rr",
+    [OP_MOD_F64_RI] = "mod f64 ri",
+    [OP_MOD_F64_RR] = "mod f64 rr",
+};
+
 const char* GetRegisterName(Register reg) {
     for (int i = 0; registerMap[i].reg != REG_UNKNOWN; i++)
         if (registerMap[i].reg == reg)
@@ -39,13 +158,35 @@ const char* GetRegisterName(Register reg) {
     return "unknown";
 }
 
+const char* GetOpcodeName(uint8_t operation) {
+    const char* name = (operation < NUM_OPCODES) ? opcodeNames[operation] : NULL;
+    return (name != NULL) ? name : "?";
+}
+
 Register GetRegisterFromName(const char* name) {
-    for (int i = 0; registerMap[i].reg != REG_UNKNOWN; i++)
-        if (strcmp(registerMap[i].name, name) == 0)
-            return registerMap[i].reg;
+    const Keyword* keyword =
+        KeywordLookup(registerKeywords, REGISTER_KEYWORD_SEED, name, strlen(name));
+
+    return (keyword != NULL) ? keyword->value : REG_UNKNOWN;
+}
+
+#ifndef USING_ARDUINO
+static const char* vectorNames[NUM_VECTOR_REGISTERS] = {
+    "v0", "v1", "v2",  "v3",  "v4",  "v5",  "v6",  "v7",
+    "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15",
+};
+
+const char* GetVectorRegisterName(VectorRegister reg) {
+    return (reg >= VREG_V0 && reg < NUM_VECTOR_REGISTERS) ? vectorNames[reg] : "unknown";
+}
 
-    return REG_UNKNOWN;
+VectorRegister GetVectorRegisterFromName(const char* name) {
+    const Keyword* keyword =
+        KeywordLookup(vectorKeywords, VECTOR_KEYWORD_SEED, name, strlen(name));
+
+    return (keyword != NULL) ? keyword->value : VREG_UNKNOWN;
 }
+#endif
 
 Data DATA_USING_F64(double val) {
     Data d = {.data.f64 = val, .type = TY_F64};
@@ -58,7 +199,6 @@ Data DATA_USING_PTR(void* ptr) {
 }
 
 Data DATA_USING_I64(long val) {
-    printf("val %d\n", val);
     Data d = {.data.i64 = val, .type = TY_I64};
     return d;
 }
@@ -100,50 +240,171 @@ BOOL IsFloat(const char* s) {
 }
 
 void Move(Machine* machine, Operand data, int dest) {
-    const char* regDest = GetRegisterName(dest);
-    if (strcmp(regDest, "unknown") == 0) {
-        fprintf(stderr, "Invalid destination register. Aborted.\n");
-        exit(1);
+    if (dest <= REG_NONE || dest >= NUM_REGISTERS) {
+        RuntimeError(machine, "invalid destination register");
+        return;
+    }
+
+    SET_REGISTER(machine, dest, data);
+}
+
+#ifdef VM_GUARD_STACK
+static size_t pageSize;
+static pthread_once_t faultHandlerOnce = PTHREAD_ONCE_INIT;
+static struct sigaction previousFaultHandler; // faults that aren't a guard page go here
+
+// machine running on this thread, the fault handler looks for its guard pages
+static __thread Machine* runningMachine;
+
+// turn a fault in a guard page of the running machine's stack into a
+// runtime error. the stack handlers fault on a plain load or store, never
+// inside libc, so leaving through RuntimeError is safe here
+static void StackFault(int signal, siginfo_t* info, void* context) {
+    Machine* machine = runningMachine;
+    if (machine != NULL && machine->stackGuarded == TRUE) {
+        char* address = info->si_addr;
+        char* base = (char*)machine->stack;
+        char* end = base + (size_t)machine->stackCapacity * sizeof(Value);
+
+        if (address >= base - pageSize && address < base) {
+            machine->stackSize = 0;
+            RuntimeError(machine, "stack underflow when trying to pop from stack");
+        }
+        if (address >= end && address < end + pageSize) {
+            machine->stackSize = machine->stackCapacity;
+            RuntimeError(machine, "stack overflow when trying to push value to stack");
+        }
     }
 
-    if (strcmp(GetRegisterName(data.data.i64), "unknown") == 0) {
-        RemoveChar((char*)data.data.ptr, LXR_CONSTANT_PREFIX);
-        if (IsFloat((char*)data.data.ptr) == TRUE) {
-            char* endptr;
-            double f = strtod((char*)data.data.ptr, &endptr);
-            machine->memory[dest] = DATA_USING_F64(f);
-        } else
-            machine->memory[dest] = DATA_USING_I64(atol((char*)data.data.ptr));
+    // not ours. a handler the host installed gets it, otherwise put the old
+    // handler back and let the instruction fault again
+    if ((previousFaultHandler.sa_flags & SA_SIGINFO) != 0)
+        previousFaultHandler.sa_sigaction(signal, info, context);
+    else if (previousFaultHandler.sa_handler != SIG_DFL &&
+             previousFaultHandler.sa_handler != SIG_IGN)
+        previousFaultHandler.sa_handler(signal);
+    else
+        sigaction(SIGSEGV, &previousFaultHandler, NULL);
+}
+
+static void InstallFaultHandler(void) {
+    pageSize = sysconf(_SC_PAGESIZE);
+
+    // runtime errors longjmp out of the handler, SA_NODEFER keeps SIGSEGV
+    // unblocked afterwards so the next guard page fault is caught too
+    struct sigaction action = {0};
+    action.sa_sigaction = StackFault;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previousFaultHandler);
+}
+#endif
+
+void CreateStack(Machine* machine, uint32_t capacity, BOOL guarded) {
+    machine->stackSize = 0;
+    machine->stackGuarded = FALSE;
+#ifdef VM_NANBOX
+    machine->stackWide = NULL;
+#endif
+
+#ifdef VM_GUARD_STACK
+    if (guarded == TRUE)
+        pthread_once(&faultHandlerOnce, InstallFaultHandler);
+
+    // the guard pages have to touch both ends of the stack, so only a stack
+    // of whole pages can have them. any other keeps its bounds checks and
+    // overflows at the same depth it would without guard pages
+    size_t bytes = (size_t)capacity * sizeof(Value);
+    if (guarded == TRUE && bytes % pageSize == 0) {
+        char* region =
+            mmap(NULL, bytes + 2 * pageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED ||
+            mprotect(region + pageSize, bytes, PROT_READ | PROT_WRITE) != 0) {
+            fprintf(stderr, "Buffer allocation error for stack.\n");
+            exit(1);
+        }
 
+        machine->stack = (Value*)(region + pageSize);
+        machine->stackCapacity = capacity;
+        machine->stackGuarded = TRUE;
         return;
     }
+#endif
+
+    machine->stack = malloc((size_t)capacity * sizeof(Value));
+    if (machine->stack == NULL) {
+        fprintf(stderr, "Buffer allocation error for stack.\n");
+        exit(1);
+    }
+    machine->stackCapacity = capacity;
+}
+
+void DestroyStack(Machine* machine) {
+    if (machine->stack == NULL)
+        return;
+
+#ifdef VM_GUARD_STACK
+    if (runningMachine == machine)
+        runningMachine = NULL;
 
-    machine->memory[dest] = machine->memory[data.data.i64];
+    if (machine->stackGuarded == TRUE)
+        munmap((char*)machine->stack - pageSize,
+               (size_t)machine->stackCapacity * sizeof(Value) + 2 * pageSize);
+    else
+#endif
+        free(machine->stack);
+
+#ifdef VM_NANBOX
+    free(machine->stackWide);
+    machine->stackWide = NULL;
+#endif
+
+    machine->stack = NULL;
+    machine->stackCapacity = 0;
+    machine->stackSize = 0;
+    machine->stackGuarded = FALSE;
 }
 
+#ifdef VM_NANBOX
+void StackStoreWide(Machine* machine, int32_t slot, Data data) {
+    // the slot is written first, so a guarded stack faults before stackWide
+    // is touched out of bounds
+    machine->stack[slot] = NANBOX_BOXED(NANBOX_WIDE);
+
+    if (machine->stackWide == NULL) {
+        machine->stackWide = malloc((size_t)machine->stackCapacity * sizeof(Data));
+        if (machine->stackWide == NULL) {
+            fprintf(stderr, "Buffer allocation error for stack.\n");
+            exit(1);
+        }
+    }
+    machine->stackWide[slot] = data;
+}
+#endif
+
 void Push(Machine* machine, Data value) {
-    if (machine->stackSize >= STACK_CAPACITY) {
-        fprintf(stderr, "Stack overflow when trying to push value to stack. Aborted.\n");
-        exit(1);
+    if (machine->stackSize >= machine->stackCapacity) {
+        RuntimeError(machine, "stack overflow when trying to push value to stack");
+        return;
     }
-    machine->stack[machine->stackSize++] = value;
+    StackStore(machine, machine->stackSize++, value);
 }
 
 Data PopData(Machine* machine) {
     if (machine->stackSize <= 0) {
-        fprintf(stderr, "Stack underflow when trying to pop from stack. Aborted.\n");
-        exit(1);
+        RuntimeError(machine, "stack underflow when trying to pop from stack");
+        return DATA_USING_I64(0);
     }
 
-    return machine->stack[--machine->stackSize];
+    return StackLoad(machine, --machine->stackSize);
 }
 
-int Pop(Machine* machine) {
+long Pop(Machine* machine) {
     if (machine->stackSize <= 0) {
-        fprintf(stderr, "Stack underflow when trying to pop from stack. Aborted.\n");
-        exit(1);
+        RuntimeError(machine, "stack underflow when trying to pop from stack");
+        return 0;
     }
-    return machine->stack[--machine->stackSize].data.i64;
+    return StackLoad(machine, --machine->stackSize).data.i64;
 }
 
 void ClearStack(Machine* machine) {
@@ -158,102 +419,172 @@ void ClearStack(Machine* machine) {
 }
 
 void PrintStack(Machine* machine) {
-    printf("--- Stack Start ---\n");
+    FILE* stream = MACHINE_STREAM(machine->output, stdout);
+    FlushOutput(machine);
+
+    fprintf(stream, "--- Stack Start ---\n");
     for (int i = machine->stackSize - 1; i >= 0; i--) {
-        Data x = machine->stack[i];
+        Data x = StackLoad(machine, i);
         if (x.type == TY_STR)
-            printf("%s\n", (char*)x.data.ptr);
+            fprintf(stream, "\"%s\"\n", (char*)x.data.ptr);
         else if (x.type == TY_I64 || x.type == TY_U64)
-            printf("%ld\n", machine->stack[i].data.i64);
+            fprintf(stream, "%ld\n", x.data.i64);
         else if (x.type == TY_F64) {
-            printf("%f\n", machine->stack[i].data.f64);
+            fprintf(stream, "%f\n", x.data.f64);
         }
     }
-    printf("--- Stack End   ---\n");
+    fprintf(stream, "--- Stack End   ---\n");
+}
+
+void Compare(Machine* machine, long a, long b) {
+    machine->EFLAGS = 0;
+
+    long result = (long)((unsigned long)b - (unsigned long)a);
+
+    // zero flag
+    if (result == 0)
+        machine->EFLAGS |= FLAG_ZF;
+    else
+        machine->EFLAGS &= ~FLAG_ZF;
+
+    // sign flag
+    if (result < 0)
+        machine->EFLAGS |= FLAG_SF;
+    else
+        machine->EFLAGS &= ~FLAG_SF;
+
+    // overflow flag
+    if (((b ^ a) & (b ^ result)) < 0)
+        machine->EFLAGS |= FLAG_OF;
+    else
+        machine->EFLAGS &= ~FLAG_OF;
 }
 
 void JumpTo(Machine* machine, int dest) {
     if (dest > machine->programSize || dest < 0)
-        RuntimeError("Jumping out of bounds. Aborted.");
+        RuntimeError(machine, "Jumping out of bounds. Aborted.");
 
     machine->ip = dest;
 }
 
 void Call(Machine* machine, int dest) {
     if (dest > machine->programSize || dest < 0)
-        RuntimeError("Calling out of bounds. Aborted.");
+        RuntimeError(machine, "Calling out of bounds. Aborted.");
 
     machine->rp = machine->ip;
     machine->ip = dest;
 }
 
-void DumpProgramToFile(Machine* machine, char* filePath) {
-    FILE* file = fopen(filePath, "wb");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file. Path: %s\n", filePath);
-        exit(1);
-    }
-
-    fwrite(machine->program, sizeof(Instruction), machine->programSize, file);
-    fclose(file);
-}
-
 void PrintRegisterContents(Machine* machine) {
+    FILE* stream = MACHINE_STREAM(machine->output, stdout);
+
     for (int i = REG_RAX; i < REG_R15 + 1; i++) {
-        Data data = machine->memory[i];
-        printf("%-4s: ", GetRegisterName(i));
+        Data data = REGISTER(machine, i);
+        fprintf(stream, "%-4s: ", GetRegisterName(i));
 
         switch (data.type) {
         case TY_F64:
-            printf("%f (f64)", data.data.f64);
+            fprintf(stream, "%f (f64)", data.data.f64);
             break;
         case TY_STR:
-            printf("\"%2s\"", (char*)data.data.ptr);
+            fprintf(stream, "\"%s\"", (char*)data.data.ptr);
             break;
         case TY_I64:
-            printf("%5ld (i64)", data.data.i64);
+            fprintf(stream, "%5ld (i64)", data.data.i64);
             break;
         case TY_U64:
-            printf("%5ld (u64)", data.data.u64);
+            fprintf(stream, "%5ld (u64)", data.data.u64);
             break;
         default:
-            printf("empty");
+            fprintf(stream, "empty");
             break;
         }
 
-        printf("\n");
+        fprintf(stream, "\n");
     }
 }
 
-Instruction* ReadProgramFromFile(Machine* machine, char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file. Path: %s\n", path);
-        exit(1);
+void RuntimeError(Machine* machine, const char* msg) {
+    FlushOutput(machine);
+
+    if (machine->trap != NULL) {
+        machine->error = msg;
+        longjmp(*machine->trap, 1);
     }
 
-    fseek(file, 0, SEEK_END);
-    long length = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    fprintf(stderr, "runtime error. %s\n", msg);
+    exit(1);
+}
 
-    Instruction* insts = malloc(length);
-    if (insts == NULL) {
-        fprintf(stderr, "Buffer allocation error for file contents.\n");
-        exit(1);
+void CheckMemory(Machine* machine, uintptr_t address, size_t size) {
+    for (uint32_t i = 0; i < machine->numRegions; i++) {
+        uintptr_t base = machine->regions[i].base;
+        if (address >= base && size <= machine->regions[i].size &&
+            address - base <= machine->regions[i].size - size)
+            return;
+    }
+
+    RuntimeError(machine, "load or store outside of memory from SYS_ALLOC");
+}
+
+// keep track of memory SYS_ALLOC handed out, for CheckMemory and FreeMemory
+static void RememberMemory(Machine* machine, uintptr_t base, size_t size) {
+    if (machine->numRegions == machine->regionsCapacity) {
+        uint32_t grown = (machine->regionsCapacity > 0) ? machine->regionsCapacity * 2
+                                                        : VM_MEMORY_REGIONS;
+        MemoryRegion* regions = realloc(machine->regions, (size_t)grown * sizeof(MemoryRegion));
+        if (regions == NULL) {
+            fprintf(stderr, "Buffer allocation error for memory regions.\n");
+            exit(1);
+        }
+
+        machine->regions = regions;
+        machine->regionsCapacity = grown;
     }
 
-    fread(insts, sizeof(Instruction), length / sizeof(Instruction), file);
-    fclose(file);
+    machine->regions[machine->numRegions].base = base;
+    machine->regions[machine->numRegions].size = size;
+    machine->numRegions++;
+}
 
-    machine->program = insts;
-    machine->programSize = length / sizeof(Instruction);
+// forget [base, base + size) of the memory SYS_ALLOC handed out, keeping
+// whatever is left of a region on either side of it. a size of 0 forgets
+// the whole region at base, like VirtualFree with MEM_RELEASE
+static void ForgetMemory(Machine* machine, uintptr_t base, size_t size) {
+    uint32_t i = 0;
+    while (i < machine->numRegions) {
+        MemoryRegion region = machine->regions[i];
+        uintptr_t regionEnd = region.base + region.size;
+        uintptr_t end = (size == 0) ? regionEnd : base + size;
+
+        BOOL freed = (size == 0) ? region.base == base : base < regionEnd && end > region.base;
+        if (freed == FALSE) {
+            i++;
+            continue;
+        }
 
-    return insts;
+        // the pieces go on the end, past anything still to be looked at
+        machine->regions[i] = machine->regions[--machine->numRegions];
+        if (region.base < base)
+            RememberMemory(machine, region.base, base - region.base);
+        if (end < regionEnd)
+            RememberMemory(machine, end, regionEnd - end);
+    }
 }
 
-void RuntimeError(char* msg) {
-    fprintf(stderr, "runtime error. %s\n", msg);
-    exit(1);
+void FreeMemory(Machine* machine) {
+    for (uint32_t i = 0; i < machine->numRegions; i++) {
+#ifdef _WIN32
+        VirtualFree((void*)machine->regions[i].base, 0, MEM_RELEASE);
+#elif defined(__linux__)
+        munmap((void*)machine->regions[i].base, machine->regions[i].size);
+#endif
+    }
+
+    free(machine->regions);
+    machine->regions = NULL;
+    machine->numRegions = 0;
+    machine->regionsCapacity = 0;
 }
 
 int GetEntryPoint(Machine* machine) {
@@ -262,11 +593,9 @@ int GetEntryPoint(Machine* machine) {
             return machine->labels[i].index;
     }
 
-    RuntimeError("no entry point"); // no entry point
+    RuntimeError(machine, "no entry point"); // no entry point
 }
 
-void Zero(Data* memory, Register reg) { memory[reg] = DATA_USING_I64(0); }
-
 #ifdef USING_ARDUINO
 /// @brief Get the port for a pin
 ArduinoPort PinPort(int pin) {
@@ -320,469 +649,1144 @@ int PinBit(int pin) {
 }
 #endif
 
-void OutputString(char* string, FileDescriptor fd) {
-    if (string[0] != LXR_STR_CHAR || string[strlen(string) - 1] != LXR_STR_CHAR)
-        RuntimeError("invalid string");
-
-    // remnove first quote
-    for (size_t i = 0; i < strlen(string); i++)
-        string[i] = string[i + 1];
-
-    if (fd != FILE_STDOUT && fd != FILE_STDERR)
-        RuntimeError("invalid file descriptor");
-
-    FILE* stream = (fd == FILE_STDOUT) ? stdout : stderr;
-
-    // remove last quote
-    string[strlen(string) - 1] = '\0';
-
-    for (size_t i = 0; i < strlen(string); i++) {
-        char c = string[i];
-
-        if (c == '\\' && i + 1 < strlen(string)) {
-            i++;
-            c = string[i];
-            switch (c) {
-            case 'n':
-                fprintf(stream, "\n");
-                break;
-            case '\\':
-                fprintf(stream, "\\");
-                break;
-            case '\'':
-                fprintf(stream, "\'");
-                break;
-            case '\"':
-                fprintf(stream, "\"");
-                break;
-            case 't':
-                fprintf(stream, "\t");
-                break;
-            case 'r':
-                fprintf(stream, "\r");
-                break;
-            case 'b':
-                fprintf(stream, "\b");
-                break;
-            case 'f':
-                fprintf(stream, "\f");
-                break;
-            case 'a':
-                fprintf(stream, "\a");
-                break;
-            case 'v':
-                fprintf(stream, "\v");
-                break;
-            default:
-                fprintf(stream, "\\%c", c);
+// pass the buffered output and 'length' more bytes on to the machine's stdout. a stream
+// with a file descriptor gets both in one writev, anything else goes through stdio
+static void WriteThrough(Machine* machine, const char* bytes, size_t length) {
+    FILE* stream = MACHINE_STREAM(machine->output, stdout);
+
+#ifdef VM_WRITEV
+    int descriptor = fileno(stream);
+    if (descriptor >= 0 && fflush(stream) == 0) {
+        struct iovec parts[2] = {
+            {machine->outputBuffer, machine->outputUsed},
+            {(void*)bytes, length},
+        };
+        struct iovec* part = parts;
+        int count = 2;
+
+        while (count > 0) {
+            ssize_t written = writev(descriptor, part, count);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                break; // e.g a closed pipe, dropped like a failed fprintf
+
+            // skip what was written, resuming a part that was only partly written
+            while (count > 0 && (size_t)written >= part->iov_len) {
+                written -= part->iov_len;
+                part++;
+                count--;
+            }
+            if (count > 0) {
+                part->iov_base = (char*)part->iov_base + written;
+                part->iov_len -= written;
             }
-
-            continue;
         }
 
-        fprintf(stream, "%c", c);
+        machine->outputUsed = 0;
+        return;
     }
+#endif
+
+    fwrite(machine->outputBuffer, 1, machine->outputUsed, stream);
+    fwrite(bytes, 1, length, stream);
+    machine->outputUsed = 0;
 }
 
-void RunInstructions(Machine* machine) {
-    machine->cycles++;
+void FlushOutput(Machine* machine) {
+    if (machine->outputUsed > 0)
+        WriteThrough(machine, NULL, 0);
+}
 
-    if (machine->ip == 0 && machine->started == FALSE) {
-        machine->ip = GetEntryPoint(machine);
-        machine->started = TRUE;
+void OutputString(Machine* machine, const char* string, FileDescriptor fd) {
+    if (fd != FILE_STDOUT && fd != FILE_STDERR)
+        RuntimeError(machine, "invalid file descriptor");
+
+    uint32_t length = STRING_LENGTH(string);
+
+    if (fd == FILE_STDERR) {
+        FlushOutput(machine);
+        fwrite(string, 1, length, MACHINE_STREAM(machine->errors, stderr));
+        return;
     }
 
-    if (machine->ip >= machine->programSize)
+    if (length <= VM_OUTPUT_SIZE - machine->outputUsed) {
+        memcpy(machine->outputBuffer + machine->outputUsed, string, length);
+        machine->outputUsed += length;
         return;
+    }
 
-    int jump = FALSE; // if inst.operation is a successful jump
-    Instruction inst = ((Instruction*)machine->program)[machine->ip];
+    WriteThrough(machine, string, length);
+}
 
+uint8_t QuickenArithmetic(Machine* machine, Instruction inst) {
+    uint8_t first;
     switch (inst.operation) {
-    case OP_RET:
-        machine->ip = machine->rp;
+    case OP_ADD:
+        first = OP_ADD_I64_RI;
         break;
-    case OP_CALL:
-        jump = TRUE;
-        Call(machine, inst.data.value.data.i64);
+    case OP_SUB:
+        first = OP_SUB_I64_RI;
         break;
-    case OP_READ: {
-        unsigned int fd = Pop(machine);
-        if (fd == FILE_INOPIN) {
-#ifdef USING_ARDUINO
-            int pin = Pop(machine);
-            int pb = PinBit(pin);
-            ArduinoPort port = PinPort(pin);
-            if (port == PORT_B) {
-                DDRB &= ~(1 << pb); // set port b as output
-                Push(machine, DATA_USING_I64((INPB & (1 << pb)) >> pb));
-            } else if (port == PORT_C) {
-                DDRC &= ~(1 << pb); // set port c as output
-                Push(machine, DATA_USING_I64((INPC & (1 << pb)) >> pb));
-            } else if (port == PORT_D) {
-                DDRD &= ~(1 << pb); // set port d as output
-                Push(machine, DATA_USING_I64((INPD & (1 << pb)) >> pb));
-            } else
-                RuntimeError("invalid pin");
+    case OP_MUL:
+        first = OP_MUL_I64_RI;
+        break;
+    case OP_DIV:
+        first = OP_DIV_I64_RI;
+        break;
+    case OP_MOD:
+        first = OP_MOD_I64_RI;
+        break;
+    default:
+        return inst.operation;
+    }
+
+    DataType dest = machine->registerTypes[inst.dest];
+    DataType src = inst.kind == OPND_REG ? machine->registerTypes[inst.src] : TY_EMPTY;
+
+    if (dest == TY_I64 && inst.kind == OPND_I64)
+        return first;
+    if (dest == TY_I64 && src == TY_I64)
+        return first + 1;
+    if (dest == TY_F64 && inst.kind == OPND_F64)
+        return first + 2;
+    if (dest == TY_F64 && src == TY_F64)
+        return first + 3;
+
+    // mixed types, an empty register or a wide immediate. stay generic
+    return inst.operation;
+}
+
+uint8_t GenericOpcode(uint8_t operation) {
+    static const uint8_t generic[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD};
+
+    if (operation >= OP_ADD_I64_RI && operation <= OP_MOD_F64_RR)
+        return generic[(operation - OP_ADD_I64_RI) / 4];
+
+    return operation;
+}
+
+#ifdef VM_PROFILE
+#define VM_PROFILE_TICK()                                                                          \
+    if (machine->profile != NULL)                                                                  \
+    ProfileTick(machine->profile, machine->ip, inst.operation)
+#else
+#define VM_PROFILE_TICK()
 #endif
-        } else if (fd == FILE_STDIN) {
-            // read input from stdin
-            char buffer[MAX_STRING_LEN] = {0};
-            buffer[0] = LXR_STR_CHAR;
-            if (fgets(buffer + 1, MAX_STRING_LEN, stdin) == NULL)
-                break;
 
-            RemoveChar(buffer, '\n');
-            buffer[strlen(buffer)] = LXR_STR_CHAR;
+#define VM_FETCH()                                                                                 \
+    if (machine->ip >= machine->programSize)                                                       \
+        return;                                                                                    \
+    machine->cycles++;                                                                             \
+    inst = machine->program[machine->ip];                                                          \
+    VM_PROFILE_TICK()
+
+// record the instruction just fetched at the top of the dispatch loop. with
+// computed goto the handlers dispatch through traceTable instead, so a
+// machine that isn't traced never tests for it
+#ifdef VM_TRACE
+#define VM_TRACE_STEP()                                                                            \
+    if (trace != NULL)                                                                             \
+    TraceStep(trace, machine, inst)
+#else
+#define VM_TRACE_STEP()
+#endif
 
-            Push(machine, DATA_USING_STR(buffer));
-        }
+// Dispatch macros for RunInstructions
+//
+// With computed goto every handler jumps straight to the next handler through
+// table, dispatchTable or traceTable, instead of going back through the
+// switch. Each handler has its own copy of the indirect jump so the branch
+// predictor can learn per opcode.
+// Otherwise fall back to a plain loop around the switch.
+#ifdef VM_COMPUTED_GOTO
+#define VM_CASE(op)                                                                                \
+    case op:                                                                                       \
+    L_##op:
+#define VM_UNCHECKED(op) L_##op##_UNCHECKED:
+#define VM_DEFAULT                                                                                 \
+    default:                                                                                       \
+    L_OP_UNKNOWN:
+#define VM_DISPATCH()                                                                              \
+    {                                                                                              \
+        VM_FETCH();                                                                                \
+        if (inst.operation >= NUM_OPCODES)                                                         \
+            goto L_OP_UNKNOWN;                                                                     \
+        goto* table[inst.operation];                                                               \
+    }
+#else
+#define VM_CASE(op) case op:
+#define VM_DEFAULT default:
+#define VM_DISPATCH() continue
+#endif
 
-        break;
+// go to the next instruction in the program
+#define VM_NEXT()                                                                                  \
+    {                                                                                              \
+        machine->ip++;                                                                             \
+        VM_DISPATCH();                                                                             \
+    }
+
+// ip was already set by a jump or call, run the instruction it points to
+#define VM_JUMP() VM_DISPATCH()
+
+// a jump or call was taken. stop here if the cycle budget is spent, every
+// loop goes through a jump. otherwise give the jit a chance to count the
+// label and run native code for it before interpreting from machine->ip
+#ifdef VM_JIT
+#define VM_BRANCH()                                                                                \
+    {                                                                                              \
+        if (machine->cycles >= cycleLimit)                                                         \
+            return;                                                                                \
+        if (machine->jit != NULL && JitWanted(machine))                                            \
+            JitEnter(machine);                                                                     \
+        VM_JUMP();                                                                                 \
+    }
+#else
+#define VM_BRANCH()                                                                                \
+    {                                                                                              \
+        if (machine->cycles >= cycleLimit)                                                         \
+            return;                                                                                \
+        VM_JUMP();                                                                                 \
     }
-    case OP_WRITE: {
-        unsigned int fd = Pop(machine);
-        int toWrite = Pop(machine);
-        if (fd == FILE_STDOUT || fd == FILE_STDERR) {
-            char* asString = (char*)toWrite; // purposly seg fault if not a string
-            OutputString(asString, fd);
-        } else if (fd == FILE_INOPIN) {
-#ifdef USING_ARDUINO
-            int state = Pop(machine);
-            if (state != 0 && state != 1)
-                RuntimeError("invalid state for pin");
-
-            int pb = PinBit(toWrite);
-            ArduinoPort port = PinPort(toWrite);
-            if (port == PORT_B) {
-                DDRB |= (1 << pb); // set port b as output
-                DRPORTB |= (state << pb);
-            } else if (port == PORT_C) {
-                DDRC |= (1 << pb); // set port c as output
-                DRPORTC |= (state << pb);
-            } else if (port == PORT_D) {
-                DDRD |= (1 << pb); // set port d as output
-                DRPORTD |= (state << pb);
-            } else
-                RuntimeError("invalid pin");
 #endif
-        }
-        break;
+
+// a superinstruction finished, step over the 'n' instructions it replaced.
+// they still count as ran so SYS_CYCLES is the same with or without fusion
+#define VM_SKIP(n)                                                                                 \
+    {                                                                                              \
+        machine->cycles += (n) - 1;                                                                \
+        machine->ip += (n);                                                                        \
+        VM_DISPATCH();                                                                             \
     }
-#ifdef USING_ARDUINO
-    case OP_ANWRITE: {
-        unsigned int pin = Pop(machine);
-        unsigned int value = Pop(machine);
-        unsigned int pb = PinBit(pin);
-        ArduinoPort port = PinPort(pin);
-
-        // First, set the Data direction register for the pin to output
-        if (port == PORT_B)
-            DDRB |= (1 << pb);
-        else if (port == PORT_C)
-            DDRC |= (1 << pb);
-        else if (port == PORT_D)
-            DDRD |= (1 << pb);
-        else
-            RuntimeError("invalid pin port");
-
-        // Set the timer/counter control register to fast pwm and non inverting mode
-        // Set part b of the timer/counter prescaler to 8
-        // finally, set the output compare register to the value to set the pin
-        if (pin == 3) {
-            TCCR2A |= (1 << COM2B1) | (1 << WGM20) | (1 << WGM21);
-            TCCR2B |= (1 << CS21);
-            OCR2B = value;
-        } else if (pin == 5) {
-            TCCR0A |= (1 << COM0B1) | (1 << WGM00) | (1 << WGM01);
-            TCCR0B |= (1 << CS01);
-            OCR0B = value;
-        } else if (pin == 6) {
-            TCCR0A |= (1 << COM0A1) | (1 << WGM00) | (1 << WGM01);
-            TCCR0B |= (1 << CS01);
-            OCR0A = value;
-        } else if (pin == 9) {
-            TCCR1A |= (1 << COM1A1) | (1 << WGM10) | (1 << WGM11);
-            TCCR1B |= (1 << WGM12) | (1 << CS11);
-            OCR1A = value;
-        } else if (pin == 10) {
-            TCCR1A |= (1 << COM1B1) | (1 << WGM10) | (1 << WGM11);
-            TCCR1B |= (1 << WGM12) | (1 << CS11);
-            OCR1B = value;
-        } else if (pin == 11) {
-            TCCR2A |= (1 << COM2A1) | (1 << WGM20) | (1 << WGM21);
-            TCCR2B |= (1 << CS21);
-            OCR2A = value;
-        } else
-            RuntimeError("invalid pin");
 
-        break;
+// cmp followed by a conditional jump. the jump is left in the next slot
+// and still holds the target
+#define CMP_AND_BRANCH(cond)                                                                       \
+    {                                                                                              \
+        Data src = OPERAND_VALUE(inst, machine);                                                   \
+        Compare(machine, (src.type == TY_F64) ? (long)src.data.f64 : src.data.i64,                 \
+                machine->registers[inst.dest].i64);                                                \
+        if (cond(machine->EFLAGS)) {                                                               \
+            machine->cycles++;                                                                     \
+            JumpTo(machine, machine->program[machine->ip + 1].index);                              \
+            VM_BRANCH();                                                                           \
+        }                                                                                          \
+        VM_SKIP(2);                                                                                \
     }
+
+// rewrite a generic arithmetic instruction into the variant for the types
+// it is about to run with
+#ifdef VM_QUICKENING
+#define VM_QUICKEN()                                                                               \
+    machine->program[machine->ip].operation = QuickenArithmetic(machine, inst)
+#else
+#define VM_QUICKEN()
 #endif
-    case OP_PUSH:
-        if (inst.data.value.type == TY_STR &&
-            GetRegisterFromName((char*)inst.data.value.data.ptr) != REG_UNKNOWN) {
-            // push from memory
-            Push(machine, machine->memory[GetRegisterFromName((char*)inst.data.value.data.ptr)]);
-            break;
-        }
-        Push(machine, inst.data.value);
-        break;
-    case OP_POP: {
-        Data val = PopData(machine);
 
-        // pop to memory
-        if (inst.data.registers.dest == REG_NONE)
-            break;
+// a quickened instruction saw types it was not specialized for. turn it back
+// into the generic opcode and run it again from the top, without counting it twice
+#define VM_DEOPT(generic)                                                                          \
+    {                                                                                              \
+        machine->program[machine->ip].operation = (generic);                                       \
+        machine->cycles--;                                                                         \
+        VM_JUMP();                                                                                 \
+    }
+
+// quickened 'dest = dest operator src' for each pair of operand types.
+// division by zero deoptimizes so the generic handler reports it, see DIV_I64 for -1
+#define ARITHMETIC_I64_RI(operator, generic)                                                       \
+    {                                                                                              \
+        long* dest = &machine->registers[inst.dest].i64;                                           \
+        if (machine->registerTypes[inst.dest] != TY_I64 || ((generic) == OP_DIV && inst.imm == 0)) \
+            VM_DEOPT(generic);                                                                     \
+        *dest = ((generic) == OP_DIV) ? DIV_I64(*dest, inst.imm) : *dest operator inst.imm;        \
+        VM_NEXT();                                                                                 \
+    }
 
-        machine->memory[inst.data.registers.dest] =
-            (val.type == TY_F64) ? DATA_USING_F64(val.data.f64) : DATA_USING_I64(val.data.i64);
+#define ARITHMETIC_I64_RR(operator, generic)                                                       \
+    {                                                                                              \
+        long* dest = &machine->registers[inst.dest].i64;                                           \
+        long src = machine->registers[inst.src].i64;                                               \
+        if (machine->registerTypes[inst.dest] != TY_I64 ||                                         \
+            machine->registerTypes[inst.src] != TY_I64 || ((generic) == OP_DIV && src == 0))       \
+            VM_DEOPT(generic);                                                                     \
+        *dest = ((generic) == OP_DIV) ? DIV_I64(*dest, src) : *dest operator src;                  \
+        VM_NEXT();                                                                                 \
+    }
 
-        break;
+#define ARITHMETIC_F64_RI(operator, generic)                                                       \
+    {                                                                                              \
+        double* dest = &machine->registers[inst.dest].f64;                                         \
+        double src = machine->constants[inst.index].f64;                                           \
+        if (machine->registerTypes[inst.dest] != TY_F64 || ((generic) == OP_DIV && src == 0))      \
+            VM_DEOPT(generic);                                                                     \
+        *dest = *dest operator src;                                                                \
+        VM_NEXT();                                                                                 \
     }
-    case OP_SHL: {
-        int val = Pop(machine);
 
-        Push(machine, DATA_USING_I64(val << inst.data.value.data.i64));
-        break;
+#define ARITHMETIC_F64_RR(operator, generic)                                                       \
+    {                                                                                              \
+        double* dest = &machine->registers[inst.dest].f64;                                         \
+        double src = machine->registers[inst.src].f64;                                             \
+        if (machine->registerTypes[inst.dest] != TY_F64 ||                                         \
+            machine->registerTypes[inst.src] != TY_F64 || ((generic) == OP_DIV && src == 0))       \
+            VM_DEOPT(generic);                                                                     \
+        *dest = *dest operator src;                                                                \
+        VM_NEXT();                                                                                 \
     }
-    case OP_ORB: {
-        int b = Pop(machine);
-        int a = Pop(machine);
-        Push(machine, DATA_USING_I64(a | b));
-        break;
+
+// Stack handlers are written once and run either checked, or unchecked for
+// programs VerifyStackDepth proved can't over or underflow the stack and on
+// guarded stacks, where going past either end faults. 'check' is
+// STACK_CHECKED or STACK_UNCHECKED, given how many values the instruction
+// pops and how many it pushes. Each works on the stack in place so stackSize
+// is read and written once. Indexes below the top are signed so popping an
+// empty guarded stack lands in the guard page under it. 'pops' is a
+// constant and the underflow test is only there when it is above 0, the
+// 1 it is never compared against keeps -Wtype-limits quiet about 'size < 0'
+#define STACK_CHECKED(pops, pushes)                                                                \
+    if ((pops) > 0 && machine->stackSize < ((pops) > 0 ? (pops) : 1))                              \
+        RuntimeError(machine, "stack underflow when trying to pop from stack");                    \
+    if (machine->stackSize - (pops) + (pushes) > machine->stackCapacity)                           \
+        RuntimeError(machine, "stack overflow when trying to push value to stack");
+#define STACK_UNCHECKED(pops, pushes)
+
+// superinstructions leave the stack alone but fail like the 'pushes' pushes
+// they replaced. unchecked, the slot the last push would have written is
+// read instead, which faults on a full guarded stack. a verified program
+// always has room for it
+#define FUSED_CHECKED(pushes) STACK_CHECKED(0, pushes)
+#define FUSED_UNCHECKED(pushes)                                                                    \
+    (void)*(volatile Value*)&machine->stack[machine->stackSize + (pushes) - 1];
+
+// push imm, shl or shr src, pop dest
+#define FUSED_SHIFT(operator, check)                                                               \
+    {                                                                                              \
+        check(1);                                                                                  \
+        SET_REGISTER(machine, inst.dest, DATA_USING_I64((long)inst.imm operator inst.src));        \
+        VM_SKIP(3);                                                                                \
     }
-    case OP_PRNT:
-        PrintStack(machine);
-        break;
-    case OP_EXIT:
-        printf("exiting with code %ld.\n", machine->memory[REG_RAX].data.i64);
-        exit(machine->memory[REG_RAX].data.i64); // exit code saved in RAX register
-    case OP_JLE:
-        if (machine->EFLAGS & FLAG_ZF ||
-            (machine->EFLAGS & FLAG_SF) != (machine->EFLAGS & FLAG_OF)) {
-            jump = TRUE;
-            JumpTo(machine, inst.data.value.data.i64);
+
+// push src, push imm, AND, OR or XOR, pop dest
+#define FUSED_BITWISE(operator, check)                                                             \
+    {                                                                                              \
+        check(2);                                                                                  \
+        long left = machine->registers[inst.src].i64;                                              \
+        long right = machine->registers[inst.imm].i64;                                             \
+        SET_REGISTER(machine, inst.dest, DATA_USING_I64(left operator right));                     \
+        VM_SKIP(4);                                                                                \
+    }
+
+#define STACK_PUSH(check)                                                                          \
+    {                                                                                              \
+        Data value;                                                                                \
+        switch (inst.kind) {                                                                       \
+        case OPND_REG: /* push from memory */                                                      \
+            value = REGISTER(machine, inst.src);                                                   \
+            break;                                                                                 \
+        case OPND_STR:                                                                             \
+            value = DATA_USING_STR((char*)machine->strings + inst.index);                          \
+            break;                                                                                 \
+        default:                                                                                   \
+            value = OPERAND_VALUE(inst, machine);                                                  \
+            break;                                                                                 \
+        }                                                                                          \
+                                                                                                   \
+        check(0, 1);                                                                               \
+        StackStore(machine, machine->stackSize++, value);                                          \
+        VM_NEXT();                                                                                 \
+    }
+
+#define STACK_POP(check)                                                                           \
+    {                                                                                              \
+        check(1, 0);                                                                               \
+        int32_t size = machine->stackSize - 1;                                                     \
+        Data val = StackLoad(machine, size);                                                       \
+        machine->stackSize = size;                                                                 \
+                                                                                                   \
+        /* pop to memory */                                                                        \
+        if (inst.kind != OPND_REG)                                                                 \
+            VM_NEXT();                                                                             \
+                                                                                                   \
+        machine->registers[inst.dest] = val.data;                                                  \
+        machine->registerTypes[inst.dest] = (val.type == TY_F64) ? TY_F64 : TY_I64;                \
+        VM_NEXT();                                                                                 \
+    }
+
+// replace the top of the stack with 'result', computed from it as val
+#define STACK_UNARY(result, check)                                                                 \
+    {                                                                                              \
+        check(1, 1);                                                                               \
+        int32_t top = machine->stackSize - 1;                                                      \
+        long val = StackLoad(machine, top).data.i64;                                               \
+        StackStore(machine, top, DATA_USING_I64(result));                                          \
+        VM_NEXT();                                                                                 \
+    }
+
+// replace the two values on top of the stack with 'second operator top'
+#define STACK_BINARY(operator, check)                                                              \
+    {                                                                                              \
+        check(2, 1);                                                                               \
+        int32_t size = machine->stackSize - 1;                                                     \
+        long second = StackLoad(machine, size - 1).data.i64;                                       \
+        StackStore(machine, size - 1,                                                              \
+                   DATA_USING_I64(second operator StackLoad(machine, size).data.i64));             \
+        machine->stackSize = size;                                                                 \
+        VM_NEXT();                                                                                 \
+    }
+
+// swap pops two values and pushes them back in the order they were, as i64
+#define STACK_SWAP(check)                                                                          \
+    {                                                                                              \
+        check(2, 2);                                                                               \
+        int32_t top = machine->stackSize - 1;                                                      \
+        StackStore(machine, top, DATA_USING_I64(StackLoad(machine, top).data.i64));                \
+        StackStore(machine, top - 1, DATA_USING_I64(StackLoad(machine, top - 1).data.i64));        \
+        VM_NEXT();                                                                                 \
+    }
+
+#define STACK_DUP(check)                                                                           \
+    {                                                                                              \
+        check(1, 2);                                                                               \
+        int32_t size = machine->stackSize;                                                         \
+        StackCopy(machine, size, size - 1);                                                        \
+        machine->stackSize = size + 1;                                                             \
+        VM_NEXT();                                                                                 \
+    }
+
+#define STACK_SIZE(check)                                                                          \
+    {                                                                                              \
+        check(0, 1);                                                                               \
+        uint32_t size = machine->stackSize;                                                        \
+        StackStore(machine, size, DATA_USING_I64(size));                                           \
+        machine->stackSize = size + 1;                                                             \
+        VM_NEXT();                                                                                 \
+    }
+
+// same as the generic mod, x - y * trunc(x / y) for floats
+#define FMOD_TRUNC(x, y) ((x) - (y) * (long)((x) / (y)))
+
+static void Run(Machine* machine) {
+    if (machine->ip == 0 && machine->started == FALSE) {
+        machine->ip = GetEntryPoint(machine);
+        machine->started = TRUE;
+    }
+
+    // once, before the first instruction. the loaders already set started
+    // when they found the entry point, so that can't tell
+    if (machine->cycles == 0)
+        machine->stackVerified =
+            VerifyStackDepth(machine->program, machine->programSize, machine->ip,
+                             machine->stackSize, machine->stackCapacity);
+
+    uint64_t cycleLimit = (machine->cycleLimit != 0) ? machine->cycleLimit : UINT64_MAX;
+#ifdef VM_JIT
+    machine->jitCycleLimit = cycleLimit;
+#endif
+#ifdef VM_TRACE
+    Trace* trace = machine->trace;
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+    // one entry per opcode. anything not handled by this build
+    // (e.g OP_ANWRITE without arduino) lands on the unknown handler
+    static const void* dispatchTable[NUM_OPCODES] = {
+        [0 ... NUM_OPCODES - 1] = &&L_OP_UNKNOWN,
+        [OP_NOP] = &&L_OP_NOP,
+        [OP_PUSH] = &&L_OP_PUSH,
+        [OP_POP] = &&L_OP_POP,
+        [OP_MOV] = &&L_OP_MOV,
+        [OP_SWAP] = &&L_OP_SWAP,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_RET] = &&L_OP_RET,
+        [OP_CMP] = &&L_OP_CMP,
+        [OP_JMP] = &&L_OP_JMP,
+        [OP_JNE] = &&L_OP_JNE,
+        [OP_JE] = &&L_OP_JE,
+        [OP_JG] = &&L_OP_JG,
+        [OP_JGE] = &&L_OP_JGE,
+        [OP_JL] = &&L_OP_JL,
+        [OP_JLE] = &&L_OP_JLE,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_MOD] = &&L_OP_MOD,
+        [OP_NEG] = &&L_OP_NEG,
+        [OP_ANDB] = &&L_OP_ANDB,
+        [OP_ORB] = &&L_OP_ORB,
+        [OP_NOTB] = &&L_OP_NOTB,
+        [OP_XORB] = &&L_OP_XORB,
+        [OP_SHL] = &&L_OP_SHL,
+        [OP_SHR] = &&L_OP_SHR,
+        [OP_DUP] = &&L_OP_DUP,
+        [OP_CLR] = &&L_OP_CLR,
+        [OP_SIZE] = &&L_OP_SIZE,
+        [OP_PRNT] = &&L_OP_PRNT,
+        [OP_WRITE] = &&L_OP_WRITE,
+        [OP_READ] = &&L_OP_READ,
+        [OP_FLUSH] = &&L_OP_FLUSH,
+#ifdef USING_ARDUINO
+        [OP_ANWRITE] = &&L_OP_ANWRITE,
+#endif
+        [OP_SYSCALL] = &&L_OP_SYSCALL,
+        [OP_EXIT] = &&L_OP_EXIT,
+        [OP_LOAD] = &&L_OP_LOAD,
+        [OP_LOADB] = &&L_OP_LOADB,
+        [OP_LOADF] = &&L_OP_LOADF,
+        [OP_STORE] = &&L_OP_STORE,
+        [OP_STOREB] = &&L_OP_STOREB,
+        [OP_STOREF] = &&L_OP_STOREF,
+#ifndef USING_ARDUINO
+        [OP_VLOAD] = &&L_OP_VLOAD,
+        [OP_VSTORE] = &&L_OP_VSTORE,
+        [OP_VSPLAT] = &&L_OP_VSPLAT,
+        [OP_VADD] = &&L_OP_VADD,
+        [OP_VSUB] = &&L_OP_VSUB,
+        [OP_VMUL] = &&L_OP_VMUL,
+        [OP_VMIN] = &&L_OP_VMIN,
+        [OP_VMAX] = &&L_OP_VMAX,
+        [OP_VCMPEQ] = &&L_OP_VCMPEQ,
+        [OP_VCMPGT] = &&L_OP_VCMPGT,
+        [OP_VSUM] = &&L_OP_VSUM,
+        [OP_VFADD] = &&L_OP_VFADD,
+        [OP_VFSUB] = &&L_OP_VFSUB,
+        [OP_VFMUL] = &&L_OP_VFMUL,
+        [OP_VFMIN] = &&L_OP_VFMIN,
+        [OP_VFMAX] = &&L_OP_VFMAX,
+        [OP_VFCMPEQ] = &&L_OP_VFCMPEQ,
+        [OP_VFCMPGT] = &&L_OP_VFCMPGT,
+        [OP_VFSUM] = &&L_OP_VFSUM,
+#endif
+        [OP_SHLI] = &&L_OP_SHLI,
+        [OP_SHRI] = &&L_OP_SHRI,
+        [OP_ORR] = &&L_OP_ORR,
+        [OP_ANDR] = &&L_OP_ANDR,
+        [OP_XORR] = &&L_OP_XORR,
+        [OP_CMPJE] = &&L_OP_CMPJE,
+        [OP_CMPJNE] = &&L_OP_CMPJNE,
+        [OP_CMPJG] = &&L_OP_CMPJG,
+        [OP_CMPJGE] = &&L_OP_CMPJGE,
+        [OP_CMPJL] = &&L_OP_CMPJL,
+        [OP_CMPJLE] = &&L_OP_CMPJLE,
+        [OP_ADD_I64_RI] = &&L_OP_ADD_I64_RI,
+        [OP_ADD_I64_RR] = &&L_OP_ADD_I64_RR,
+        [OP_ADD_F64_RI] = &&L_OP_ADD_F64_RI,
+        [OP_ADD_F64_RR] = &&L_OP_ADD_F64_RR,
+        [OP_SUB_I64_RI] = &&L_OP_SUB_I64_RI,
+        [OP_SUB_I64_RR] = &&L_OP_SUB_I64_RR,
+        [OP_SUB_F64_RI] = &&L_OP_SUB_F64_RI,
+        [OP_SUB_F64_RR] = &&L_OP_SUB_F64_RR,
+        [OP_MUL_I64_RI] = &&L_OP_MUL_I64_RI,
+        [OP_MUL_I64_RR] = &&L_OP_MUL_I64_RR,
+        [OP_MUL_F64_RI] = &&L_OP_MUL_F64_RI,
+        [OP_MUL_F64_RR] = &&L_OP_MUL_F64_RR,
+        [OP_DIV_I64_RI] = &&L_OP_DIV_I64_RI,
+        [OP_DIV_I64_RR] = &&L_OP_DIV_I64_RR,
+        [OP_DIV_F64_RI] = &&L_OP_DIV_F64_RI,
+        [OP_DIV_F64_RR] = &&L_OP_DIV_F64_RR,
+        [OP_MOD_I64_RI] = &&L_OP_MOD_I64_RI,
+        [OP_MOD_I64_RR] = &&L_OP_MOD_I64_RR,
+        [OP_MOD_F64_RI] = &&L_OP_MOD_F64_RI,
+        [OP_MOD_F64_RR] = &&L_OP_MOD_F64_RR,
+    };
+
+    // handlers run an instruction, table is where every handler finds the next one
+    const void* const* handlers = dispatchTable;
+
+    // a program VerifyStackDepth proved, or one on a guarded stack, runs the
+    // stack instructions without bounds checks
+    const void* uncheckedTable[NUM_OPCODES];
+    if (machine->stackVerified == TRUE || machine->stackGuarded == TRUE) {
+        memcpy(uncheckedTable, dispatchTable, sizeof(uncheckedTable));
+        uncheckedTable[OP_PUSH] = &&L_OP_PUSH_UNCHECKED;
+        uncheckedTable[OP_POP] = &&L_OP_POP_UNCHECKED;
+        uncheckedTable[OP_DUP] = &&L_OP_DUP_UNCHECKED;
+        uncheckedTable[OP_SWAP] = &&L_OP_SWAP_UNCHECKED;
+        uncheckedTable[OP_SIZE] = &&L_OP_SIZE_UNCHECKED;
+        uncheckedTable[OP_SHL] = &&L_OP_SHL_UNCHECKED;
+        uncheckedTable[OP_SHR] = &&L_OP_SHR_UNCHECKED;
+        uncheckedTable[OP_ORB] = &&L_OP_ORB_UNCHECKED;
+        uncheckedTable[OP_ANDB] = &&L_OP_ANDB_UNCHECKED;
+        uncheckedTable[OP_XORB] = &&L_OP_XORB_UNCHECKED;
+        uncheckedTable[OP_NOTB] = &&L_OP_NOTB_UNCHECKED;
+        uncheckedTable[OP_NEG] = &&L_OP_NEG_UNCHECKED;
+        uncheckedTable[OP_SHLI] = &&L_OP_SHLI_UNCHECKED;
+        uncheckedTable[OP_SHRI] = &&L_OP_SHRI_UNCHECKED;
+        uncheckedTable[OP_ORR] = &&L_OP_ORR_UNCHECKED;
+        uncheckedTable[OP_ANDR] = &&L_OP_ANDR_UNCHECKED;
+        uncheckedTable[OP_XORR] = &&L_OP_XORR_UNCHECKED;
+        handlers = uncheckedTable;
+    }
+
+    const void* const* table = handlers;
+
+#ifdef VM_TRACE
+    // a traced machine goes through L_TRACE_STEP before every instruction
+    static const void* traceTable[NUM_OPCODES] = {[0 ... NUM_OPCODES - 1] = &&L_TRACE_STEP};
+    if (trace != NULL)
+        table = traceTable;
+#endif
+#endif
+
+    Instruction inst;
+
+    for (;;) {
+        VM_FETCH();
+        VM_TRACE_STEP();
+
+        switch (inst.operation) {
+        VM_CASE(OP_RET)
+            machine->ip = machine->rp;
+            VM_NEXT();
+        VM_CASE(OP_CALL)
+            Call(machine, inst.index);
+            VM_BRANCH();
+        VM_CASE(OP_READ) {
+            unsigned int fd = Pop(machine);
+            if (fd == FILE_INOPIN) {
+#ifdef USING_ARDUINO
+                int pin = Pop(machine);
+                int pb = PinBit(pin);
+                ArduinoPort port = PinPort(pin);
+                if (port == PORT_B) {
+                    DDRB &= ~(1 << pb); // set port b as output
+                    Push(machine, DATA_USING_I64((INPB & (1 << pb)) >> pb));
+                } else if (port == PORT_C) {
+                    DDRC &= ~(1 << pb); // set port c as output
+                    Push(machine, DATA_USING_I64((INPC & (1 << pb)) >> pb));
+                } else if (port == PORT_D) {
+                    DDRD &= ~(1 << pb); // set port d as output
+                    Push(machine, DATA_USING_I64((INPD & (1 << pb)) >> pb));
+                } else
+                    RuntimeError(machine, "invalid pin");
+#endif
+            } else if (fd == FILE_STDIN) {
+                // a prompt written before the read has to be seen first
+                FlushOutput(machine);
+
+                FILE* input = MACHINE_STREAM(machine->input, stdin);
+                if (fgets(machine->line.text, sizeof(machine->line.text), input) == NULL)
+                    VM_NEXT();
+
+                RemoveChar(machine->line.text, '\n');
+                machine->line.length = strlen(machine->line.text);
+
+                Push(machine, DATA_USING_STR(machine->line.text));
+            }
+
+            VM_NEXT();
         }
-        break;
-    case OP_JL:
-        if ((machine->EFLAGS & FLAG_SF) != (machine->EFLAGS & FLAG_OF)) {
-            jump = TRUE;
-            JumpTo(machine, inst.data.value.data.i64);
+        VM_CASE(OP_WRITE) {
+            unsigned int fd = Pop(machine);
+            Data toWrite = PopData(machine);
+            if (fd == FILE_STDOUT || fd == FILE_STDERR) {
+                if (toWrite.type != TY_STR)
+                    RuntimeError(machine, "write expects a string");
+
+                OutputString(machine, (char*)toWrite.data.ptr, fd);
+            } else if (fd == FILE_INOPIN) {
+#ifdef USING_ARDUINO
+                int state = Pop(machine);
+                if (state != 0 && state != 1)
+                    RuntimeError(machine, "invalid state for pin");
+
+                int pb = PinBit(toWrite.data.i64);
+                ArduinoPort port = PinPort(toWrite.data.i64);
+                if (port == PORT_B) {
+                    DDRB |= (1 << pb); // set port b as output
+                    DRPORTB |= (state << pb);
+                } else if (port == PORT_C) {
+                    DDRC |= (1 << pb); // set port c as output
+                    DRPORTC |= (state << pb);
+                } else if (port == PORT_D) {
+                    DDRD |= (1 << pb); // set port d as output
+                    DRPORTD |= (state << pb);
+                } else
+                    RuntimeError(machine, "invalid pin");
+#endif
+            }
+            VM_NEXT();
         }
-        break;
-    case OP_JGE:
-        if (machine->EFLAGS & FLAG_ZF ||
-            (machine->EFLAGS & FLAG_SF) == (machine->EFLAGS & FLAG_OF)) {
-            jump = TRUE;
-            JumpTo(machine, inst.data.value.data.i64);
+#ifdef USING_ARDUINO
+        VM_CASE(OP_ANWRITE) {
+            unsigned int pin = Pop(machine);
+            unsigned int value = Pop(machine);
+            unsigned int pb = PinBit(pin);
+            ArduinoPort port = PinPort(pin);
+
+            // First, set the Data direction register for the pin to output
+            if (port == PORT_B)
+                DDRB |= (1 << pb);
+            else if (port == PORT_C)
+                DDRC |= (1 << pb);
+            else if (port == PORT_D)
+                DDRD |= (1 << pb);
+            else
+                RuntimeError(machine, "invalid pin port");
+
+            // Set the timer/counter control register to fast pwm and non inverting mode
+            // Set part b of the timer/counter prescaler to 8
+            // finally, set the output compare register to the value to set the pin
+            if (pin == 3) {
+                TCCR2A |= (1 << COM2B1) | (1 << WGM20) | (1 << WGM21);
+                TCCR2B |= (1 << CS21);
+                OCR2B = value;
+            } else if (pin == 5) {
+                TCCR0A |= (1 << COM0B1) | (1 << WGM00) | (1 << WGM01);
+                TCCR0B |= (1 << CS01);
+                OCR0B = value;
+            } else if (pin == 6) {
+                TCCR0A |= (1 << COM0A1) | (1 << WGM00) | (1 << WGM01);
+                TCCR0B |= (1 << CS01);
+                OCR0A = value;
+            } else if (pin == 9) {
+                TCCR1A |= (1 << COM1A1) | (1 << WGM10) | (1 << WGM11);
+                TCCR1B |= (1 << WGM12) | (1 << CS11);
+                OCR1A = value;
+            } else if (pin == 10) {
+                TCCR1A |= (1 << COM1B1) | (1 << WGM10) | (1 << WGM11);
+                TCCR1B |= (1 << WGM12) | (1 << CS11);
+                OCR1B = value;
+            } else if (pin == 11) {
+                TCCR2A |= (1 << COM2A1) | (1 << WGM20) | (1 << WGM21);
+                TCCR2B |= (1 << CS21);
+                OCR2A = value;
+            } else
+                RuntimeError(machine, "invalid pin");
+
+            VM_NEXT();
         }
-        break;
-    case OP_JG:
-        if (!(machine->EFLAGS & FLAG_ZF) &&
-            (machine->EFLAGS & FLAG_SF) == (machine->EFLAGS & FLAG_OF)) {
-            jump = TRUE;
-            JumpTo(machine, inst.data.value.data.i64);
+#endif
+        VM_CASE(OP_PUSH)
+            STACK_PUSH(STACK_CHECKED);
+        VM_CASE(OP_POP)
+            STACK_POP(STACK_CHECKED);
+        VM_CASE(OP_SHL)
+            STACK_UNARY(val << inst.imm, STACK_CHECKED);
+        VM_CASE(OP_ORB)
+            STACK_BINARY(|, STACK_CHECKED);
+        VM_CASE(OP_PRNT)
+            PrintStack(machine);
+            VM_NEXT();
+        VM_CASE(OP_FLUSH)
+            FlushOutput(machine);
+            VM_NEXT();
+        VM_CASE(OP_EXIT)
+            // exit code saved in RAX register. the caller decides whether the process ends
+            machine->exitCode = machine->registers[REG_RAX].i64;
+            machine->exited = TRUE;
+            FlushOutput(machine);
+            fprintf(MACHINE_STREAM(machine->output, stdout), "exiting with code %ld.\n",
+                    machine->exitCode);
+            return;
+        VM_CASE(OP_LOAD) {
+            long value;
+            memcpy(&value, MemoryAddress(machine, inst, sizeof(value)), sizeof(value));
+            SET_REGISTER(machine, inst.dest, DATA_USING_I64(value));
+            VM_NEXT();
         }
-        break;
-    case OP_JE:
-        if (machine->EFLAGS & FLAG_ZF) {
-            jump = TRUE;
-            JumpTo(machine, inst.data.value.data.i64);
+        VM_CASE(OP_LOADB)
+            SET_REGISTER(machine, inst.dest,
+                         DATA_USING_I64(*(signed char*)MemoryAddress(machine, inst, 1)));
+            VM_NEXT();
+        VM_CASE(OP_LOADF) {
+            double value;
+            memcpy(&value, MemoryAddress(machine, inst, sizeof(value)), sizeof(value));
+            SET_REGISTER(machine, inst.dest, DATA_USING_F64(value));
+            VM_NEXT();
         }
-        break;
-    case OP_JNE:
-        if (!(machine->EFLAGS & FLAG_ZF)) {
-            jump = TRUE;
-            JumpTo(machine, inst.data.value.data.i64);
+        VM_CASE(OP_STORE) {
+            Data value = REGISTER(machine, inst.dest);
+            long stored = (value.type == TY_F64) ? (long)value.data.f64 : value.data.i64;
+            memcpy(MemoryAddress(machine, inst, sizeof(stored)), &stored, sizeof(stored));
+            VM_NEXT();
         }
-        break;
-    case OP_JMP:
-        jump = TRUE;
-        JumpTo(machine, inst.data.value.data.i64);
-        break;
-    case OP_NOP:
-        break;
-    case OP_SHR: {
-        int val = Pop(machine);
-        Push(machine, DATA_USING_I64(val >> inst.data.value.data.i64));
-    } break;
-    case OP_SWAP: {
-        int first = Pop(machine);
-        int second = Pop(machine);
-        Push(machine, DATA_USING_I64(second));
-        Push(machine, DATA_USING_I64(first));
-    } break;
-    case OP_SYSCALL: {
-        // rax holds the ssn
-        Data ssn = machine->memory[REG_RAX];
-        if (ssn.type != TY_I64) {
-            Move(machine, DATA_USING_I64(-1), REG_RAX);
-            break;
+        VM_CASE(OP_STOREB) {
+            Data value = REGISTER(machine, inst.dest);
+            long stored = (value.type == TY_F64) ? (long)value.data.f64 : value.data.i64;
+            *(char*)MemoryAddress(machine, inst, 1) = (char)stored;
+            VM_NEXT();
         }
+        VM_CASE(OP_STOREF) {
+            Data value = REGISTER(machine, inst.dest);
+            double stored = AS_F64(value);
+            memcpy(MemoryAddress(machine, inst, sizeof(stored)), &stored, sizeof(stored));
+            VM_NEXT();
+        }
+#ifndef USING_ARDUINO
+        VM_CASE(OP_VLOAD)
+        VM_CASE(OP_VSTORE)
+        VM_CASE(OP_VSPLAT)
+        VM_CASE(OP_VADD)
+        VM_CASE(OP_VSUB)
+        VM_CASE(OP_VMUL)
+        VM_CASE(OP_VMIN)
+        VM_CASE(OP_VMAX)
+        VM_CASE(OP_VCMPEQ)
+        VM_CASE(OP_VCMPGT)
+        VM_CASE(OP_VSUM)
+        VM_CASE(OP_VFADD)
+        VM_CASE(OP_VFSUB)
+        VM_CASE(OP_VFMUL)
+        VM_CASE(OP_VFMIN)
+        VM_CASE(OP_VFMAX)
+        VM_CASE(OP_VFCMPEQ)
+        VM_CASE(OP_VFCMPGT)
+        VM_CASE(OP_VFSUM)
+            RunVector(machine, inst);
+            VM_NEXT();
+#endif
+        VM_CASE(OP_JLE)
+            if (COND_JLE(machine->EFLAGS)) {
+                JumpTo(machine, inst.index);
+                VM_BRANCH();
+            }
+            VM_NEXT();
+        VM_CASE(OP_JL)
+            if (COND_JL(machine->EFLAGS)) {
+                JumpTo(machine, inst.index);
+                VM_BRANCH();
+            }
+            VM_NEXT();
+        VM_CASE(OP_JGE)
+            if (COND_JGE(machine->EFLAGS)) {
+                JumpTo(machine, inst.index);
+                VM_BRANCH();
+            }
+            VM_NEXT();
+        VM_CASE(OP_JG)
+            if (COND_JG(machine->EFLAGS)) {
+                JumpTo(machine, inst.index);
+                VM_BRANCH();
+            }
+            VM_NEXT();
+        VM_CASE(OP_JE)
+            if (COND_JE(machine->EFLAGS)) {
+                JumpTo(machine, inst.index);
+                VM_BRANCH();
+            }
+            VM_NEXT();
+        VM_CASE(OP_JNE)
+            if (COND_JNE(machine->EFLAGS)) {
+                JumpTo(machine, inst.index);
+                VM_BRANCH();
+            }
+            VM_NEXT();
+        VM_CASE(OP_JMP)
+            JumpTo(machine, inst.index);
+            VM_BRANCH();
+        VM_CASE(OP_NOP)
+            VM_NEXT();
+        VM_CASE(OP_SHR)
+            STACK_UNARY(val >> inst.imm, STACK_CHECKED);
+        VM_CASE(OP_SWAP)
+            STACK_SWAP(STACK_CHECKED);
+        VM_CASE(OP_SYSCALL) {
+            // rax holds the ssn
+            Data ssn = REGISTER(machine, REG_RAX);
+            if (ssn.type != TY_I64) {
+                Move(machine, DATA_USING_I64(-1), REG_RAX);
+                VM_NEXT();
+            }
 
-        // argument 1 for syscall
-        Data arg1 = machine->memory[REG_RDI];
-        Data arg2 = machine->memory[REG_RSI];
-        Data arg3 = machine->memory[REG_RDX];
-        Data arg4 = machine->memory[REG_R10];
-        Data arg5 = machine->memory[REG_R8];
-        Data arg6 = machine->memory[REG_R9];
-
-        switch (ssn.data.i64) {
-        case SYS_ALLOC: {
-            void* baseAddress = NULL;
+            // argument 1 for syscall
+            Data arg1 = REGISTER(machine, REG_RDI);
+            Data arg2 = REGISTER(machine, REG_RSI);
+            Data arg3 = REGISTER(machine, REG_RDX);
+            Data arg4 = REGISTER(machine, REG_R10);
+            Data arg5 = REGISTER(machine, REG_R8);
+            Data arg6 = REGISTER(machine, REG_R9);
+
+            switch (ssn.data.i64) {
+            case SYS_ALLOC: {
+                void* baseAddress = NULL;
 #ifdef _WIN32
-            baseAddress =
-                (arg1.data.i64 == 0)
-                    ? VirtualAlloc(NULL, arg2.data.i64, arg3.data.i64, arg4.data.i64)
-                    : VirtualAlloc(arg1.data.ptr, arg2.data.i64, arg3.data.i64, arg4.data.i64);
+                baseAddress =
+                    (arg1.data.i64 == 0)
+                        ? VirtualAlloc(NULL, arg2.data.i64, arg3.data.i64, arg4.data.i64)
+                        : VirtualAlloc(arg1.data.ptr, arg2.data.i64, arg3.data.i64, arg4.data.i64);
 #elif defined(__linux__)
-            baseAddress = (arg1.data.i64 == 0) ? mmap(NULL, arg2.data.i64, arg3.data.i64,
-                                                      arg4.data.i64, arg5.data.i64, arg6.data.i64)
-                                               : mmap(arg1.data.ptr, arg2.data.i64, arg3.data.i64,
-                                                      arg4.data.i64, arg5.data.i64, arg6.data.i64);
+                baseAddress = (arg1.data.i64 == 0) ? mmap(NULL, arg2.data.i64, arg3.data.i64,
+                                                          arg4.data.i64, arg5.data.i64, arg6.data.i64)
+                                                   : mmap(arg1.data.ptr, arg2.data.i64, arg3.data.i64,
+                                                          arg4.data.i64, arg5.data.i64, arg6.data.i64);
 #endif
-            if (baseAddress == NULL) {
-                printf("Error allocating memory\n");
-                Move(machine, DATA_USING_I64(-1), REG_RAX);
+                // mmap fails with MAP_FAILED, VirtualAlloc with NULL
+                if (baseAddress == NULL || baseAddress == (void*)-1) {
+                    fprintf(MACHINE_STREAM(machine->output, stdout), "Error allocating memory\n");
+                    Move(machine, DATA_USING_I64(-1), REG_RAX);
+                    break;
+                }
+
+                RememberMemory(machine, (uintptr_t)baseAddress, arg2.data.i64);
+
+                // put result in rax register
+                Move(machine, DATA_USING_I64((long)baseAddress), REG_RAX);
+            } break;
+            case SYS_CYCLES:
+                Move(machine, DATA_USING_I64(machine->cycles), REG_RAX);
                 break;
-            }
-
-            // put result in rax register
-            machine->memory[REG_RAX].data.i64 = baseAddress;
-            machine->memory[REG_RAX].type = TY_I64;
-        } break;
-        case SYS_CYCLES:
-            Move(machine, DATA_USING_I64(machine->cycles), REG_RAX);
-            break;
-        case SYS_FREE: {
-            BOOL success = FALSE;
+            case SYS_FREE: {
+                BOOL success = FALSE;
 #ifdef _WIN32
-            success = VirtualFree(arg1.data.i64, arg2.data.i64, arg3.data.i64);
+                success = VirtualFree(arg1.data.i64, arg2.data.i64, arg3.data.i64);
+                // decommitted memory stays reserved until it is released
+                if (success != FALSE && arg3.data.i64 == MEM_RELEASE)
+                    ForgetMemory(machine, arg1.data.i64, 0);
 #elif defined(__linux__)
-            success = munmap(arg1.data.i64, arg2.data.i64);
-            if (success = -1)      // on linux munmap returns -1 for failure
-                success = FALSE;   // set to false to align with standards
-            else if (success == 0) // returns 0 on success, set to TRUE
-                success = TRUE;
-#endif
-            Move(machine, DATA_USING_I64(success), REG_RAX);
-        } break;
-        case SYS_SLEEP:
+                success = munmap(arg1.data.ptr, arg2.data.i64);
+                if (success == 0) {
+                    // munmap frees every page the range touches, part of a region can go
+                    size_t page = sysconf(_SC_PAGESIZE);
+                    ForgetMemory(machine, arg1.data.i64, (arg2.data.i64 + page - 1) / page * page);
+                }
+                if (success == -1)     // on linux munmap returns -1 for failure
+                    success = FALSE;   // set to false to align with standards
+                else if (success == 0) // returns 0 on success, set to TRUE
+                    success = TRUE;
+#endif
+                Move(machine, DATA_USING_I64(success), REG_RAX);
+            } break;
+            case SYS_SLEEP:
 #ifdef _WIN32
-            Sleep(arg1.data.i64);
+                Sleep(arg1.data.i64);
 #elif defined(__linux__)
-            sleep(arg1.data.i64);
+                sleep(arg1.data.i64);
 #endif
-            break;
-        case SYS_PROTECT: {
+                break;
+            case SYS_PROTECT: {
 #ifdef _WIN32
-            PDWORD oldProtect;
-            BOOL success = VirtualProtect(arg1.data.i64, arg2.data.i64, arg3.data.i64, &oldProtect);
-            Move(machine, DATA_USING_I64(success), REG_RAX);
-            if (success == TRUE)
-                Move(machine, DATA_USING_I64(oldProtect), REG_R10);
+                PDWORD oldProtect;
+                BOOL success = VirtualProtect(arg1.data.i64, arg2.data.i64, arg3.data.i64, &oldProtect);
+                Move(machine, DATA_USING_I64(success), REG_RAX);
+                if (success == TRUE)
+                    Move(machine, DATA_USING_I64(oldProtect), REG_R10);
 #elif defined(__linux__)
-            BOOL success = mprotect(arg1.data.i64, arg2.data.i64, arg3.data.i64);
-            if (success == 0)
-                success = TRUE;
-            else if (success == -1)
-                success = FALSE;
-            Move(machine, DATA_USING_I64(success), REG_RAX);
-#endif
-        } break;
-        default: // -1 return value
-            Move(machine, DATA_USING_I64(-1), REG_RAX);
-            break;
+                BOOL success = mprotect(arg1.data.ptr, arg2.data.i64, arg3.data.i64);
+                if (success == 0)
+                    success = TRUE;
+                else if (success == -1)
+                    success = FALSE;
+                Move(machine, DATA_USING_I64(success), REG_RAX);
+#endif
+            } break;
+            default: // -1 return value
+                Move(machine, DATA_USING_I64(-1), REG_RAX);
+                break;
+            }
+            VM_NEXT();
+        }
+        VM_CASE(OP_MUL) {
+            VM_QUICKEN();
+            ARITHMETIC(*, inst, machine, '*')
+            VM_NEXT();
+        }
+        VM_CASE(OP_DUP)
+            STACK_DUP(STACK_CHECKED);
+        VM_CASE(OP_ANDB)
+            STACK_BINARY(&, STACK_CHECKED);
+        VM_CASE(OP_XORB)
+            STACK_BINARY(^, STACK_CHECKED);
+        VM_CASE(OP_NOTB)
+            STACK_UNARY(~val, STACK_CHECKED);
+        VM_CASE(OP_NEG)
+            STACK_UNARY(val * -1, STACK_CHECKED);
+        VM_CASE(OP_CMP) {
+            Data src = OPERAND_VALUE(inst, machine);
+            Compare(machine, (src.type == TY_F64) ? (long)src.data.f64 : src.data.i64,
+                    machine->registers[inst.dest].i64);
+            VM_NEXT();
+        }
+        VM_CASE(OP_ADD) {
+            VM_QUICKEN();
+            ARITHMETIC(+, inst, machine, '+')
+            VM_NEXT();
+        }
+        VM_CASE(OP_DIV) {
+            VM_QUICKEN();
+            ARITHMETIC(/, inst, machine, '/')
+            VM_NEXT();
+        }
+        VM_CASE(OP_MOD) {
+            VM_QUICKEN();
+            Data dest = REGISTER(machine, inst.dest);
+            Data src = OPERAND_VALUE(inst, machine);
+
+            if (src.type == TY_F64 ? src.data.f64 == 0 : src.data.i64 == 0)
+                RuntimeError(machine, "divide by zero error.");
+
+            if (dest.type != TY_F64 && src.type != TY_F64)
+                SET_REGISTER(machine, inst.dest,
+                             DATA_USING_I64(MOD_I64(dest.data.i64, src.data.i64)))
+            else {
+                double x = AS_F64(dest);
+                double y = AS_F64(src);
+                SET_REGISTER(machine, inst.dest, DATA_USING_F64(FMOD_TRUNC(x, y)));
+            }
+            VM_NEXT();
+        }
+        VM_CASE(OP_MOV)
+            Move(machine, OPERAND_VALUE(inst, machine), inst.dest);
+            VM_NEXT();
+        VM_CASE(OP_SUB) {
+            VM_QUICKEN();
+            ARITHMETIC(-, inst, machine, '-')
+            VM_NEXT();
+        }
+        VM_CASE(OP_CLR)
+            ClearStack(machine);
+            VM_NEXT();
+        VM_CASE(OP_SIZE)
+            STACK_SIZE(STACK_CHECKED);
+        VM_CASE(OP_SHLI)
+            FUSED_SHIFT(<<, FUSED_CHECKED);
+        VM_CASE(OP_SHRI)
+            FUSED_SHIFT(>>, FUSED_CHECKED);
+        VM_CASE(OP_ORR)
+            FUSED_BITWISE(|, FUSED_CHECKED);
+        VM_CASE(OP_ANDR)
+            FUSED_BITWISE(&, FUSED_CHECKED);
+        VM_CASE(OP_XORR)
+            FUSED_BITWISE(^, FUSED_CHECKED);
+        VM_CASE(OP_CMPJE)
+            CMP_AND_BRANCH(COND_JE);
+        VM_CASE(OP_CMPJNE)
+            CMP_AND_BRANCH(COND_JNE);
+        VM_CASE(OP_CMPJG)
+            CMP_AND_BRANCH(COND_JG);
+        VM_CASE(OP_CMPJGE)
+            CMP_AND_BRANCH(COND_JGE);
+        VM_CASE(OP_CMPJL)
+            CMP_AND_BRANCH(COND_JL);
+        VM_CASE(OP_CMPJLE)
+            CMP_AND_BRANCH(COND_JLE);
+        VM_CASE(OP_ADD_I64_RI)
+            ARITHMETIC_I64_RI(+, OP_ADD);
+        VM_CASE(OP_ADD_I64_RR)
+            ARITHMETIC_I64_RR(+, OP_ADD);
+        VM_CASE(OP_ADD_F64_RI)
+            ARITHMETIC_F64_RI(+, OP_ADD);
+        VM_CASE(OP_ADD_F64_RR)
+            ARITHMETIC_F64_RR(+, OP_ADD);
+        VM_CASE(OP_SUB_I64_RI)
+            ARITHMETIC_I64_RI(-, OP_SUB);
+        VM_CASE(OP_SUB_I64_RR)
+            ARITHMETIC_I64_RR(-, OP_SUB);
+        VM_CASE(OP_SUB_F64_RI)
+            ARITHMETIC_F64_RI(-, OP_SUB);
+        VM_CASE(OP_SUB_F64_RR)
+            ARITHMETIC_F64_RR(-, OP_SUB);
+        VM_CASE(OP_MUL_I64_RI)
+            ARITHMETIC_I64_RI(*, OP_MUL);
+        VM_CASE(OP_MUL_I64_RR)
+            ARITHMETIC_I64_RR(*, OP_MUL);
+        VM_CASE(OP_MUL_F64_RI)
+            ARITHMETIC_F64_RI(*, OP_MUL);
+        VM_CASE(OP_MUL_F64_RR)
+            ARITHMETIC_F64_RR(*, OP_MUL);
+        VM_CASE(OP_DIV_I64_RI)
+            ARITHMETIC_I64_RI(/, OP_DIV);
+        VM_CASE(OP_DIV_I64_RR)
+            ARITHMETIC_I64_RR(/, OP_DIV);
+        VM_CASE(OP_DIV_F64_RI)
+            ARITHMETIC_F64_RI(/, OP_DIV);
+        VM_CASE(OP_DIV_F64_RR)
+            ARITHMETIC_F64_RR(/, OP_DIV);
+        VM_CASE(OP_MOD_I64_RI) {
+            if (machine->registerTypes[inst.dest] != TY_I64 || inst.imm == 0)
+                VM_DEOPT(OP_MOD);
+            long* dest = &machine->registers[inst.dest].i64;
+            *dest = MOD_I64(*dest, inst.imm);
+            VM_NEXT();
+        }
+        VM_CASE(OP_MOD_I64_RR) {
+            long src = machine->registers[inst.src].i64;
+            if (machine->registerTypes[inst.dest] != TY_I64 ||
+                machine->registerTypes[inst.src] != TY_I64 || src == 0)
+                VM_DEOPT(OP_MOD);
+            long* dest = &machine->registers[inst.dest].i64;
+            *dest = MOD_I64(*dest, src);
+            VM_NEXT();
+        }
+        VM_CASE(OP_MOD_F64_RI) {
+            double* dest = &machine->registers[inst.dest].f64;
+            double src = machine->constants[inst.index].f64;
+            if (machine->registerTypes[inst.dest] != TY_F64 || src == 0)
+                VM_DEOPT(OP_MOD);
+            *dest = FMOD_TRUNC(*dest, src);
+            VM_NEXT();
+        }
+        VM_CASE(OP_MOD_F64_RR) {
+            double* dest = &machine->registers[inst.dest].f64;
+            double src = machine->registers[inst.src].f64;
+            if (machine->registerTypes[inst.dest] != TY_F64 ||
+                machine->registerTypes[inst.src] != TY_F64 || src == 0)
+                VM_DEOPT(OP_MOD);
+            *dest = FMOD_TRUNC(*dest, src);
+            VM_NEXT();
+        }
+#ifdef VM_COMPUTED_GOTO
+        // only reached through uncheckedTable
+        VM_UNCHECKED(OP_PUSH)
+            STACK_PUSH(STACK_UNCHECKED);
+        VM_UNCHECKED(OP_POP)
+            STACK_POP(STACK_UNCHECKED);
+        VM_UNCHECKED(OP_DUP)
+            STACK_DUP(STACK_UNCHECKED);
+        VM_UNCHECKED(OP_SWAP)
+            STACK_SWAP(STACK_UNCHECKED);
+        VM_UNCHECKED(OP_SIZE)
+            STACK_SIZE(STACK_UNCHECKED);
+        VM_UNCHECKED(OP_SHL)
+            STACK_UNARY(val << inst.imm, STACK_UNCHECKED);
+        VM_UNCHECKED(OP_SHR)
+            STACK_UNARY(val >> inst.imm, STACK_UNCHECKED);
+        VM_UNCHECKED(OP_ORB)
+            STACK_BINARY(|, STACK_UNCHECKED);
+        VM_UNCHECKED(OP_ANDB)
+            STACK_BINARY(&, STACK_UNCHECKED);
+        VM_UNCHECKED(OP_XORB)
+            STACK_BINARY(^, STACK_UNCHECKED);
+        VM_UNCHECKED(OP_NOTB)
+            STACK_UNARY(~val, STACK_UNCHECKED);
+        VM_UNCHECKED(OP_NEG)
+            STACK_UNARY(val * -1, STACK_UNCHECKED);
+        VM_UNCHECKED(OP_SHLI)
+            FUSED_SHIFT(<<, FUSED_UNCHECKED);
+        VM_UNCHECKED(OP_SHRI)
+            FUSED_SHIFT(>>, FUSED_UNCHECKED);
+        VM_UNCHECKED(OP_ORR)
+            FUSED_BITWISE(|, FUSED_UNCHECKED);
+        VM_UNCHECKED(OP_ANDR)
+            FUSED_BITWISE(&, FUSED_UNCHECKED);
+        VM_UNCHECKED(OP_XORR)
+            FUSED_BITWISE(^, FUSED_UNCHECKED);
+#endif
+#if defined(VM_COMPUTED_GOTO) && defined(VM_TRACE)
+        L_TRACE_STEP:
+            TraceStep(trace, machine, inst);
+            goto* handlers[inst.operation];
+#endif
+        VM_DEFAULT
+            RuntimeError(machine, "\n\tIn 'RunInstructions()' : unknown instruction");
         }
-    } break;
-    case OP_MUL: {
-        ARITHMETIC(*, inst, machine, '*')
-        break;
-    }
-    case OP_DUP:
-        Push(machine, machine->stack[machine->stackSize - 1]);
-        break;
-    case OP_ANDB: {
-        int b = Pop(machine);
-        int a = Pop(machine);
-        Push(machine, DATA_USING_I64(a & b));
-    } break;
-    case OP_XORB: {
-        int b = Pop(machine);
-        int a = Pop(machine);
-        Push(machine, DATA_USING_I64(a ^ b));
-    } break;
-    case OP_NOTB: {
-        int a = Pop(machine);
-        Push(machine, DATA_USING_I64(~a));
-    } break;
-    case OP_NEG: {
-        int val = Pop(machine);
-        val *= -1;
-        Push(machine, DATA_USING_I64(val));
-    } break;
-    case OP_CMP: {
-        machine->EFLAGS = 0;
-
-        long a = 0;
-        if (strcmp(GetRegisterName(inst.data.value.data.i64), "unknown") == 0) {
-            RemoveChar((char*)inst.data.value.data.ptr, LXR_CONSTANT_PREFIX);
-            a = atol((char*)inst.data.value.data.ptr);
-        } else
-            a = machine->memory[inst.data.value.data.i64].data.i64;
-
-        long b = machine->memory[inst.data.registers.dest].data.i64;
-        long result = b - a;
-
-        // zero flag
-        if (result == 0)
-            machine->EFLAGS |= FLAG_ZF;
-        else
-            machine->EFLAGS &= ~FLAG_ZF;
-
-        // sign flag
-        if (result < 0)
-            machine->EFLAGS |= FLAG_SF;
-        else
-            machine->EFLAGS &= ~FLAG_SF;
-
-        // overflow flag
-        if ((b ^ a) & (b ^ result) < 0)
-            machine->EFLAGS |= FLAG_OF;
-        else
-            machine->EFLAGS &= ~FLAG_OF;
-
-    } break;
-    case OP_ADD: {
-        ARITHMETIC(+, inst, machine, '+')
-    } break;
-    case OP_DIV: {
-        ARITHMETIC(/, inst, machine, '/')
-    } break;
-    case OP_MOD: {
-        ARITHMETIC(/, inst, machine, '%')
-    } break;
-    case OP_MOV:
-        Move(machine, inst.data.value, inst.data.registers.dest);
-        break;
-    case OP_SUB: {
-        ARITHMETIC(-, inst, machine, '-')
-    } break;
-    case OP_CLR:
-        ClearStack(machine);
-        break;
-    case OP_SIZE:
-        Push(machine, DATA_USING_I64(machine->stackSize));
-        break;
-    default:
-        RuntimeError("\n\tIn 'RunInstructions()' : unknown instruction");
     }
+}
 
-    if (jump == FALSE) // was not a jump instruction
-        machine->ip++;
+void RunInstructions(Machine* machine) {
+#ifdef VM_GUARD_STACK
+    runningMachine = machine;
+#endif
+    Run(machine);
+#ifdef VM_GUARD_STACK
+    runningMachine = NULL; // a runtime error leaves it set until DestroyStack
+#endif
+    FlushOutput(machine);
 
-    // run the next instruction in instruction pointer
-    RunInstructions(machine);
+#ifdef VM_PROFILE
+    if (machine->profile != NULL)
+        ProfileStop(machine->profile);
+#endif
 }
\ No newline at end of file
@@ -9,42 +9,47 @@
 
 #include "macros.h"
 
+#include <setjmp.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
+// x / y and x % y for i64 without the trap the host raises for LONG_MIN / -1.
+// dividing by -1 wraps the way the other arithmetic does
+#define DIV_I64(x, y) ((y) == -1 ? (long)(0UL - (unsigned long)(x)) : (x) / (y))
+#define MOD_I64(x, y) ((y) == -1 ? 0 : (x) % (y))
+
+// Perform 'dest = dest operator src' on a register. The source operand is
+// either another register or an immediate that was decoded by DecodeProgram
 #define ARITHMETIC(operator, inst, machine, op)                                                    \
-    long a = -1;                                                                                   \
-    double af = -1;                                                                                \
-    BOOL fp = FALSE;                                                                               \
-                                                                                                   \
-    if (!strcmp(GetRegisterName(inst.data.value.data.i64), "unknown")) {                           \
-        RemoveChar((char*)inst.data.value.data.ptr, LXR_CONSTANT_PREFIX);                          \
-        inst.data.value.type = IsFloat((char*)inst.data.value.data.ptr) ? TY_F64 : TY_I64;         \
+    Data dest = REGISTER(machine, inst.dest);                                                      \
+    Data src = OPERAND_VALUE(inst, machine);                                                       \
                                                                                                    \
-        if (inst.data.value.type == TY_F64)                                                        \
-            fp = TRUE;                                                                             \
-        else                                                                                       \
-            fp = FALSE;                                                                            \
-        if (fp == FALSE)                                                                           \
-            a = atol((char*)inst.data.value.data.ptr);                                             \
-        else                                                                                       \
-            af = strtod((char*)inst.data.value.data.ptr, NULL);                                    \
-        if ((op == '/' || op == '%') && (a == 0 || af == 0))                                       \
-            RuntimeError("divide by zero error.");                                                 \
-    }                                                                                              \
+    if (op == '/' && (src.type == TY_F64 ? src.data.f64 == 0 : src.data.i64 == 0))                 \
+        RuntimeError(machine, "divide by zero error.");                                            \
                                                                                                    \
-    Data* dest = &machine->memory[inst.data.registers.dest];                                       \
-    printf("a: %d af: %f, dest: %d\n", a, af, dest->data.i64);                                     \
-    if (dest->type == TY_I64)                                                                      \
-        *dest = (fp == FALSE) ? DATA_USING_I64(dest->data.i64 operator a)                          \
-                              : DATA_USING_F64(dest->data.i64 operator af);                        \
+    if (dest.type != TY_F64 && src.type != TY_F64)                                                 \
+        SET_REGISTER(machine, inst.dest,                                                           \
+                     DATA_USING_I64(op == '/' ? DIV_I64(dest.data.i64, src.data.i64)               \
+                                              : dest.data.i64 operator src.data.i64))              \
     else                                                                                           \
-        *dest = DATA_USING_F64((fp == FALSE) ? (dest->data.f64 operator a)                         \
-                                             : (dest->data.f64 operator af));
+        SET_REGISTER(machine, inst.dest, DATA_USING_F64(AS_F64(dest) operator AS_F64(src)))
+
+// Value of the source operand of an instruction, either a register, an inline
+// immediate or an immediate in the constant pool
+#define OPERAND_VALUE(inst, machine)                                                               \
+    ((inst).kind == OPND_REG   ? REGISTER(machine, (inst).src)                                     \
+     : (inst).kind == OPND_I64 ? DATA_USING_I64((inst).imm)                                        \
+     : (inst).kind == OPND_F64 ? DATA_USING_F64((machine)->constants[(inst).index].f64)            \
+                               : DATA_USING_I64((machine)->constants[(inst).index].i64))
+
+// Read a numeric Data as a double regardless of whether it holds an i64 or f64
+#define AS_F64(d) ((d).type == TY_F64 ? (d).data.f64 : (double)(d).data.i64)
 
 typedef enum { PORT_B, PORT_C, PORT_D } ArduinoPort;
 
 // General purpose register indexes
-// for accessing memory in a Machine
+// into the register block of a Machine
 typedef enum {
     REG_UNKNOWN = -1,
     REG_NONE = 0x0,
@@ -62,8 +67,9 @@ typedef enum {
     REG_R13,
     REG_R14,
     REG_R15,
-    REG_EP = 0xBB,
-    REG_CP = 0x83, // ptr where a jmp was called to resume instructions afterwards
+    REG_EP,
+    REG_CP,        // ptr where a jmp was called to resume instructions afterwards
+    NUM_REGISTERS, // size of the register block in a Machine, slot REG_NONE is never used
 } Register;
 
 typedef struct {
@@ -71,6 +77,30 @@ typedef struct {
     Register reg;
 } RegisterMap;
 
+#ifndef USING_ARDUINO
+// Vector register indexes into the vector block of a Machine
+typedef enum {
+    VREG_UNKNOWN = -1,
+    VREG_V0 = 0x0,
+    VREG_V1,
+    VREG_V2,
+    VREG_V3,
+    VREG_V4,
+    VREG_V5,
+    VREG_V6,
+    VREG_V7,
+    VREG_V8,
+    VREG_V9,
+    VREG_V10,
+    VREG_V11,
+    VREG_V12,
+    VREG_V13,
+    VREG_V14,
+    VREG_V15,
+    NUM_VECTOR_REGISTERS,
+} VectorRegister;
+#endif
+
 /// @brief Enum represnting assembly instructions
 ///
 /// Depending on an opcode, perform different functions
@@ -119,10 +149,97 @@ typedef enum {
     OP_WRITE,   // write to stdout or stderr or write pin for arduino
     OP_READ,    // stdin or read pin for arduino
     OP_ANWRITE, // arduino only analog write
+    OP_FLUSH,   // write out everything buffered for stdout
 
     OP_SYSCALL,
 
     OP_EXIT,
+
+    /// Loads and stores
+    ///
+    /// A mov, movb or movf with a memory operand. dest is the register
+    /// loaded or stored, src and the operand kind give the address, see
+    /// OPND_MEM. Stores are in the same order as loads
+    OP_LOAD,   // i64
+    OP_LOADB,  // i8, sign extended to an i64
+    OP_LOADF,  // f64
+    OP_STORE,  // i64, an f64 register is truncated like cmp does
+    OP_STOREB, // low 8 bits of the i64 a store would write
+    OP_STOREF, // f64, an i64 register is converted
+
+#ifndef USING_ARDUINO
+    /// Vector instructions
+    ///
+    /// Work on the vector registers, see Vector. Kept together so
+    /// IS_VECTOR_OPCODE is one range check. Each is 'dest = dest op src'
+    /// lane by lane, except where noted. Left out on arduino, which has no
+    /// room for the registers and a 32 bit long
+    OP_VLOAD,   // load 32 bytes at the address in scalar register src into dest
+    OP_VSTORE,  // store src at the address in scalar register dest
+    OP_VSPLAT,  // copy scalar register src into every lane of dest
+    OP_VADD,    // i64 lanes, wrapping
+    OP_VSUB,
+    OP_VMUL,
+    OP_VMIN,
+    OP_VMAX,
+    OP_VCMPEQ,  // lanes become -1 where true, 0 where false
+    OP_VCMPGT,
+    OP_VSUM,    // sum of the lanes of src into scalar register dest
+    OP_VFADD,   // f64 lanes
+    OP_VFSUB,
+    OP_VFMUL,
+    OP_VFMIN,   // dest < src ? dest : src, like minpd
+    OP_VFMAX,   // dest > src ? dest : src, like maxpd
+    OP_VFCMPEQ, // i64 lane masks like vcmpeq, false for NaN
+    OP_VFCMPGT,
+    OP_VFSUM,
+#endif
+
+    /// Superinstructions
+    ///
+    /// Never written by hand or produced by the lexer. FuseInstructions
+    /// rewrites the first instruction of a common sequence into one of
+    /// these and leaves the rest of the sequence in place behind it
+    OP_SHLI,   // push imm, shl src, pop dest
+    OP_SHRI,   // push imm, shr src, pop dest
+    OP_ORR,    // push src, push imm, OR, pop dest
+    OP_ANDR,   // push src, push imm, AND, pop dest
+    OP_XORR,   // push src, push imm, XOR, pop dest
+    OP_CMPJE,  // cmp, je
+    OP_CMPJNE, // cmp, jne
+    OP_CMPJG,  // cmp, jg
+    OP_CMPJGE, // cmp, jge
+    OP_CMPJL,  // cmp, jl
+    OP_CMPJLE, // cmp, jle
+
+    /// Quickened arithmetic
+    ///
+    /// Also never produced by the lexer. The first time add, sub, mul, div or
+    /// mod runs it rewrites itself into the variant for the types it saw, and a
+    /// variant rewrites itself back if its guard fails. Each opcode has four
+    /// variants in this exact order, QuickenArithmetic relies on it
+    OP_ADD_I64_RI, // i64 register, inline immediate
+    OP_ADD_I64_RR, // i64 register, i64 register
+    OP_ADD_F64_RI, // f64 register, f64 immediate from the constant pool
+    OP_ADD_F64_RR, // f64 register, f64 register
+    OP_SUB_I64_RI,
+    OP_SUB_I64_RR,
+    OP_SUB_F64_RI,
+    OP_SUB_F64_RR,
+    OP_MUL_I64_RI,
+    OP_MUL_I64_RR,
+    OP_MUL_F64_RI,
+    OP_MUL_F64_RR,
+    OP_DIV_I64_RI,
+    OP_DIV_I64_RR,
+    OP_DIV_F64_RI,
+    OP_DIV_F64_RR,
+    OP_MOD_I64_RI,
+    OP_MOD_I64_RR,
+    OP_MOD_F64_RI,
+    OP_MOD_F64_RR,
+
+    NUM_OPCODES,
 } Opcode;
 
 typedef enum {
@@ -170,55 +287,295 @@ typedef struct {
 
 typedef Data Operand;
 
+#ifndef USING_ARDUINO
+#define VECTOR_LANES 4
+
+/// A 256 bit vector register, four i64 or four f64 lanes. Lanes have no
+/// type of their own, the opcode decides how they are read
+typedef union {
+    long i64[VECTOR_LANES];
+    double f64[VECTOR_LANES];
+} Vector;
+
+#define IS_VECTOR_OPCODE(op) ((op) >= OP_VLOAD && (op) <= OP_VFSUM)
+#endif
+
+/// A value on the stack. Normally a Data, with VM_NANBOX a NaN boxed 8 bytes:
+/// - a double is stored as itself, with any NaN made the quiet NaN of its sign
+/// - anything else is a negative quiet NaN with its DataType + 1 in the four
+///   bits under the exponent and a 47 bit payload below that. An i64 payload
+///   is sign extended, any other is zero extended, so pointers fit as well
+/// - a value whose payload doesn't fit is tagged NANBOX_WIDE and kept whole
+///   in the machine's stackWide, at the same slot
+/// Read and write stack slots with StackLoad, StackStore and StackCopy
+#ifdef VM_NANBOX
+typedef uint64_t Value;
+
+#define NANBOX_TAG_SHIFT 47
+#define NANBOX_PAYLOAD ((1UL << NANBOX_TAG_SHIFT) - 1)
+#define NANBOX_NAN 0x7FF8000000000000UL // quiet NaN, the sign is added when negative
+#define NANBOX_BOXED(tag) (0xFFF8000000000000UL | ((uint64_t)(tag) << NANBOX_TAG_SHIFT))
+#define NANBOX_FIRST NANBOX_BOXED(1) // boxed values are this or above, doubles below
+#define NANBOX_WIDE 0xF              // tag of a value kept in stackWide
+#define NANBOX_SIGN_EXTEND(bits)                                                                   \
+    ((long)((uint64_t)(bits) << (64 - NANBOX_TAG_SHIFT)) >> (64 - NANBOX_TAG_SHIFT))
+#else
+typedef Data Value;
+#endif
+
+/// @brief What the operand of an instruction refers to
+///
+/// Set by the lexer so the interpreter never has to look at
+/// strings or register tables to work out what an operand is
+typedef enum {
+    OPND_NONE = 0,
+    OPND_REG,       // register index in src (or dest for pop)
+    OPND_I64,       // 32 bit integer immediate in imm
+    OPND_WIDE,      // integer immediate too big for imm, index into the constant pool
+    OPND_F64,       // floating point immediate, index into the constant pool
+    OPND_STR,       // byte offset of the string in the string pool
+    OPND_LABEL,     // instruction index of a label
+    OPND_MEM,       // memory at register src plus imm
+    OPND_MEM_INDEX, // memory at register src plus register MEM_INDEX_REG << MEM_INDEX_SHIFT
+} OperandKind;
+
+// index of an OPND_MEM_INDEX operand, the index register and the log2 of its scale
+#define MEM_INDEX(reg, shift) ((uint32_t)(reg) | (uint32_t)(shift) << 8)
+#define MEM_INDEX_REG(inst) ((inst).index & 0xFF)
+#define MEM_INDEX_SHIFT(inst) ((inst).index >> 8)
+
 /// @brief A struct that represents an assembly instructions
 ///
+/// Encoded into 8 naturally aligned bytes so eight instructions share a cache line.
+/// Values that do not fit in 32 bits live in the constant pool of the program
+///
 /// @param operation: opcode representing an assembly operation
-/// @param data: union containing either a value or a source and destination
-/// register to use
+/// @param kind: OperandKind describing the operand
+/// @param dest: destination register
+/// @param src: source register
+/// @param imm: OPND_I64 immediate
+/// @param index: constant pool index, string pool index, or instruction index to jump to
 typedef struct {
-    Opcode operation;
-    struct {
-        Operand value;
-        struct {
-            unsigned int src;
-            unsigned int dest;
-        } registers;
-    } data;
-} __attribute__((packed)) Instruction;
+    uint8_t operation;
+    uint8_t kind;
+    uint8_t dest;
+    uint8_t src;
+    union {
+        int32_t imm;
+        uint32_t index;
+    };
+} Instruction;
+
+_Static_assert(sizeof(Instruction) == 8, "Instruction must stay 8 bytes");
 
 /// Represents a label
 /// e.g _start:
 /// always starts with 'LXR_LABEL_
 typedef struct {
-    char name[MAX_LABEL_LEN];
-    unsigned short nameLen;
+    const char* name; // without the label start character, null terminated
+    uint32_t nameLen;
     long index;
 } Label;
 
+/// Strings in the string pool are stored as their length, their bytes with
+/// escapes already resolved and a terminator, padded so the next length
+/// stays aligned. OPND_STR operands and TY_STR data point at the bytes
+#define STRING_LENGTH(string) (((const uint32_t*)(string))[-1])
+#define STRING_POOL_ALIGN(size) (((size) + 3) & ~(uint32_t)3)
+
+struct Jit;
+struct Profile;
+struct Trace;
+
+// memory SYS_ALLOC handed out, 'size' bytes from 'base'
 typedef struct {
-    // Arrays simulating cpu memory and a stack
-    Data stack[STACK_CAPACITY];
-    Data memory[MEMORY_CAPACITY];
-    Label labels[MAX_LABELS]; // labels parsed from the lexer
+    uintptr_t base;
+    size_t size;
+} MemoryRegion;
 
-    // Program
+/// @brief A virtual machine
+///
+/// Laid out by how often the interpreter touches each field. The first 64
+/// bytes hold what nearly every instruction reads or writes, the register
+/// block comes next, then state used on branches and calls, and everything
+/// only touched for I/O, errors or setup goes last. Register values and their
+/// types are kept in separate arrays so the values sit back to back, eight
+/// bytes each, instead of each being padded out to a 16 byte Data
+typedef struct {
+    // hot, fetch, dispatch and the stack
     Instruction* program;
-
-    uint32_t stackSize;
-    uint32_t memorySize;
-    uint32_t numLabels;
+    Value* stack;        // stackCapacity values, see CreateStack
+    DataCell* constants; // constant pool for OPND_WIDE and OPND_F64 operands
+    uint32_t ip;         // instruction
     uint32_t programSize;
-    uint32_t cycles; // instructions ran
-    uint32_t ip;     // instruction
-    uint32_t rp;     // return pointer. index to set ip to after we are finished in a label
-
-    // flags
+    uint32_t stackSize;
+    uint32_t stackCapacity;
+    uint64_t cycles;     // instructions ran
+    uint64_t cycleLimit; // RunInstructions returns at the first jump once cycles reaches it, 0 for none
+    uint32_t rp;         // return pointer. index to set ip to after we are finished in a label
     uint8_t EFLAGS;
 
+    // registers, read with REGISTER and written with SET_REGISTER
+    DataCell registers[NUM_REGISTERS];
+    uint8_t registerTypes[NUM_REGISTERS]; // DataType of each register
+
+    const char* strings; // string pool, OPND_STR operands hold a byte offset into it
+
+#ifdef VM_JIT
+    struct Jit* jit;    // native code for hot labels, NULL to only interpret
+    long jitCompare[2]; // operands of the last cmp ran by native code, EFLAGS is rebuilt from them
+    uint64_t jitCycleLimit; // cycleLimit, or UINT64_MAX without one, checked by native loops
+#endif
+
+    // cold, from here on only touched when starting, stopping, on errors and for I/O
+#ifdef VM_NANBOX
+    Data* stackWide; // values too big to box, by stack slot. NULL until the first one is pushed
+#endif
+
+#ifndef USING_ARDUINO
+    // v0 to v15, only the vector instructions touch them. 512 bytes, so they
+    // sit here instead of between the registers and the jit state
+    Vector vectors[NUM_VECTOR_REGISTERS];
+#endif
+
+    Label* labels; // labels parsed from the lexer
+    uint32_t numLabels;
+
     // has executed the first instruction
     BOOL started;
+
+    // VerifyStackDepth proved the program can't over or underflow the stack, set when it starts
+    BOOL stackVerified;
+
+    // the stack sits between guard pages, over and underflows fault instead of being checked
+    BOOL stackGuarded;
+
+    // memory SYS_ALLOC handed out and not freed yet, grown as needed. with
+    // checkMemory set every load and store has to fall inside one of these,
+    // see CheckMemory. FreeMemory unmaps what is left
+    MemoryRegion* regions;
+    uint32_t numRegions;
+    uint32_t regionsCapacity;
+    BOOL checkMemory;
+
+    // an exit instruction ran. RunInstructions returns instead of ending the process
+    BOOL exited;
+    long exitCode; // rax when exit ran
+
+    // streams read and write instructions use. NULL for stdin, stdout and stderr,
+    // so several machines in one process can each keep their own output
+    FILE* input;
+    FILE* output;
+    FILE* errors;
+
+    // runtime errors jump here with error set instead of ending the process, if not NULL
+    jmp_buf* trap;
+    const char* error;
+
+#ifdef VM_PROFILE
+    struct Profile* profile; // counts and times every instruction fetched, NULL to not profile
+#endif
+
+#ifdef VM_TRACE
+    struct Trace* trace; // records every instruction fetched, NULL to not trace
+#endif
+
+    // last line read from input, laid out like a string in the pool
+    struct {
+        uint32_t length;
+        char text[MAX_STRING_LEN + 1];
+    } line;
+
+    // stdout written by the program that has not reached the stream yet, see FlushOutput
+    uint32_t outputUsed;
+    char outputBuffer[VM_OUTPUT_SIZE];
 } Machine;
 
+_Static_assert(offsetof(Machine, EFLAGS) < 64, "hot Machine fields must stay in 64 bytes");
+
+// A register of a machine as a Data
+#define REGISTER(machine, reg)                                                                     \
+    ((Data){.data = (machine)->registers[(reg)], .type = (DataType)(machine)->registerTypes[(reg)]})
+
+// Store a Data in a register of a machine
+#define SET_REGISTER(machine, reg, value)                                                          \
+    {                                                                                              \
+        Data stored = (value);                                                                     \
+        (machine)->registers[(reg)] = stored.data;                                                 \
+        (machine)->registerTypes[(reg)] = stored.type;                                             \
+    }
+
+#ifdef VM_NANBOX
+/// @brief Store a value that doesn't fit in a NaN box, see Value
+/// @param machine - machine whose stack the value goes on
+/// @param slot - stack slot to store it in
+/// @param data - the value
+void StackStoreWide(Machine* machine, int32_t slot, Data data);
+#endif
+
+/// @brief Read a stack slot as a Data
+VM_INLINE Data StackLoad(const Machine* machine, int32_t slot) {
+#ifdef VM_NANBOX
+    Value value = machine->stack[slot];
+    if (value < NANBOX_FIRST)
+        return (Data){.data.u64 = value, .type = TY_F64};
+
+    uint32_t tag = (value >> NANBOX_TAG_SHIFT) & 0xF;
+    if (tag == NANBOX_WIDE)
+        return machine->stackWide[slot];
+
+    Data data = {.data.u64 = value & NANBOX_PAYLOAD, .type = (DataType)(tag - 1)};
+    if (data.type == TY_I64)
+        data.data.i64 = NANBOX_SIGN_EXTEND(value);
+    return data;
+#else
+    return machine->stack[slot];
+#endif
+}
+
+#ifdef VM_NANBOX
+/// @brief NaN box a Data
+/// @param data - value to box
+/// @param value - set to the boxed value
+/// @return - FALSE if the value doesn't fit and has to be kept in stackWide
+VM_INLINE BOOL NanBox(Data data, Value* value) {
+    uint64_t bits = data.data.u64;
+    if (data.type == TY_F64) {
+        if (data.data.f64 != data.data.f64)
+            bits = NANBOX_NAN | (bits & (1UL << 63));
+        *value = bits;
+        return TRUE;
+    }
+
+    // an i64 fits if sign extending its payload gives it back
+    uint64_t payload = bits & NANBOX_PAYLOAD;
+    *value = NANBOX_BOXED(data.type + 1) | payload;
+    return (data.type == TY_I64) ? NANBOX_SIGN_EXTEND(bits) == data.data.i64 : bits == payload;
+}
+#endif
+
+/// @brief Write a Data to a stack slot
+VM_INLINE void StackStore(Machine* machine, int32_t slot, Data data) {
+#ifdef VM_NANBOX
+    Value value;
+    if (NanBox(data, &value) == TRUE)
+        machine->stack[slot] = value;
+    else
+        StackStoreWide(machine, slot, data);
+#else
+    machine->stack[slot] = data;
+#endif
+}
+
+/// @brief Copy one stack slot to another
+VM_INLINE void StackCopy(Machine* machine, int32_t to, int32_t from) {
+    machine->stack[to] = machine->stack[from];
+#ifdef VM_NANBOX
+    if (machine->stack[to] >= NANBOX_BOXED(NANBOX_WIDE))
+        machine->stackWide[to] = machine->stackWide[from];
+#endif
+}
+
 // Create Data structures using different available types
 Data DATA_USING_F64(double val);
 Data DATA_USING_I64(long val);
@@ -237,10 +594,32 @@ unsigned char PortPinRegister(int pin);
 unsigned char DataDirPinRegister(int pin);
 #endif
 
-/// @brief Move the value on stack at index 'src' to index 'dest'
+/// @brief Give a machine an empty stack
+///
+/// A guarded stack is mapped with an inaccessible page on either side. Only
+/// a capacity that fills whole pages can be guarded, any other size gets an
+/// ordinary stack so it holds exactly 'capacity' values either way. The
+/// stack instructions skip their bounds checks on a guarded stack and a
+/// value pushed past the end or popped from empty faults into a page, which
+/// is turned back into the usual stack overflow or underflow runtime error. Without VM_GUARD_STACK 'guarded' is ignored.
+/// Running out of memory ends the process
+/// @param machine - machine without a stack, or after DestroyStack
+/// @param capacity - values the stack holds, 1 to STACK_MAX_CAPACITY
+/// @param guarded - put the stack between guard pages
+void CreateStack(Machine* machine, uint32_t capacity, BOOL guarded);
+
+/// @brief Free the stack from CreateStack
+/// @param machine - machine to free the stack of, does nothing without one
+void DestroyStack(Machine* machine);
+
+/// @brief Free the memory SYS_ALLOC handed out that the program never freed
+/// @param machine - machine to free the memory of
+void FreeMemory(Machine* machine);
+
+/// @brief Move a value into the register 'dest'
 /// @param machine - machine to perform move operation on
-/// @param src - index of value to move
-/// @param dest - index to move src
+/// @param data - value to move
+/// @param dest - register to move data into
 void Move(Machine* machine, Operand data, int dest);
 
 /// @brief Push a value 'value' to the machines stack
@@ -251,7 +630,13 @@ void Push(Machine* machine, Data value);
 /// @brief Remove the last element on the stack
 /// @param machine - machine to perform the operation on
 /// @return - the removed element
-int Pop(Machine* machine);
+long Pop(Machine* machine);
+
+/// @brief Compare register value 'b' against 'a' and set EFLAGS
+/// @param machine - machine to set flags on
+/// @param a - value being compared against
+/// @param b - value of the destination register
+void Compare(Machine* machine, long a, long b);
 
 /// @brief Remove all elements from the stack
 /// @param machine - machine to perform the operation on
@@ -261,18 +646,86 @@ void ClearStack(Machine* machine);
 /// @param machine - machine to perform the operation on
 void PrintStack(Machine* machine);
 
-/// @brief Run the instruction located at machine->program[machine->ip]
+/// @brief Write a string from the string pool to stdout or stderr
+///
+/// stdout is held in the machine's buffer and written out when the buffer is
+/// full, when the machine stops or on an explicit flush. stderr is written
+/// straight away, after whatever stdout is buffered
+/// @param machine - machine writing the string
+/// @param string - string with its length in front, see STRING_LENGTH
+/// @param fd - FILE_STDOUT or FILE_STDERR
+void OutputString(Machine* machine, const char* string, FileDescriptor fd);
+
+/// @brief Write out everything buffered for stdout
+/// @param machine - machine to flush
+void FlushOutput(Machine* machine);
+
+/// @brief Pick the type specialized variant of an arithmetic instruction
+/// @param machine - machine whose registers hold the operands
+/// @param inst - add, sub, mul, div or mod instruction about to run
+/// @return - quickened opcode, or inst.operation if no variant fits the types
+uint8_t QuickenArithmetic(Machine* machine, Instruction inst);
+
+/// @brief Get the opcode the lexer produced for a quickened instruction
+/// @param operation - any opcode
+/// @return - OP_ADD for OP_ADD_I64_RI and so on, or operation if it is not quickened
+uint8_t GenericOpcode(uint8_t operation);
+
+/// @brief Report an error in a running program
+///
+/// Jumps to machine->trap with machine->error set to msg. Without a trap
+/// the error is printed and the process ends
+/// @param machine - machine the error happened on
+/// @param msg - description of the error
+void RuntimeError(Machine* machine, const char* msg);
+
+/// @brief Make sure a load or store only touches memory SYS_ALLOC handed out
+///
+/// Raises a runtime error if the 'size' bytes at 'address' are not inside
+/// one allocation. Only called when machine->checkMemory is set
+/// @param machine - machine doing the load or store
+/// @param address - first byte touched
+/// @param size - bytes touched
+void CheckMemory(Machine* machine, uintptr_t address, size_t size);
+
+/// @brief Address of the memory operand of a load or store, see OPND_MEM
+/// @param machine - machine running the instruction
+/// @param inst - load or store
+/// @param size - bytes it touches, checked with CheckMemory when machine->checkMemory is set
+VM_INLINE void* MemoryAddress(Machine* machine, Instruction inst, size_t size) {
+    uintptr_t address = machine->registers[inst.src].u64;
+    if (inst.kind == OPND_MEM)
+        address += (long)inst.imm;
+    else
+        address += machine->registers[MEM_INDEX_REG(inst)].u64 << MEM_INDEX_SHIFT(inst);
+
+    if (machine->checkMemory == TRUE)
+        CheckMemory(machine, address, size);
+    return (void*)address;
+}
+
+/// @brief Run the program starting at machine->program[machine->ip]
+///
+/// Runs in a single loop until the instruction pointer leaves the program
+/// or an exit instruction is reached, which sets machine->exited. With a
+/// cycleLimit it also returns at the first jump taken once the limit is
+/// reached, with ip at the jump target, and can be called again to continue.
+/// Buffered output is flushed before it returns
 /// @param machine - machine to perform the operation on
 void RunInstructions(Machine* machine);
 
-/// @brief Print the contents of each register in machines memory
+/// @brief Print the contents of each register of a machine to its output
 /// @param machine - machine to print register contents
 void PrintRegisterContents(Machine* machine);
 
 const char* GetRegisterName(Register reg);
 Register GetRegisterFromName(const char* name);
+#ifndef USING_ARDUINO
+const char* GetVectorRegisterName(VectorRegister reg);
+VectorRegister GetVectorRegisterFromName(const char* name);
+#endif
 
-Instruction* ReadProgramFromFile(Machine* machine, char* path);
-void DumpProgramToFile(Machine* inst, char* filePath);
+/// @brief Name of an opcode as the profiler and trace decoder print it, "?" if unknown
+const char* GetOpcodeName(uint8_t operation);
 
 #endif
\ No newline at end of file
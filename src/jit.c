@@ -0,0 +1,1071 @@
+#include "jit.h"
+
+#ifdef VM_JIT
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+_Static_assert(sizeof(Data) == 16 && offsetof(Data, type) == 8, "jit relies on the Data layout");
+
+// host registers, numbered the way x86 encodes them
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// condition codes for jcc
+enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF,
+};
+
+// rdi holds the machine, rbp the cycle count and rax, rcx and rdx are
+// scratch. every other register can hold a vm register
+static const uint8_t hostRegs[JIT_MAX_REGS] = {RBX, RSI, R8, R9, R10, R11, R12, R13, R14, R15};
+
+// handed out for labels that could not be compiled so they are not tried again
+static JitRegion uncompiled = {0};
+
+#define MACHINE_OFFSET(field) ((int32_t)offsetof(Machine, field))
+#define REG_OFFSET(reg) (MACHINE_OFFSET(registers) + (int32_t)(reg) * (int32_t)sizeof(DataCell))
+#define STACK_OFFSET(slot) ((slot) * (int32_t)sizeof(Value))
+
+/// @brief A branch in compiled code whose target is resolved after the body
+///
+/// @param patch: offset of the rel32 to patch
+/// @param ip: instruction the branch goes to
+/// @param cycles: instructions ran since cycles was last updated
+/// @param guard: TRUE if this leaves to the interpreter without running ip
+typedef struct {
+    size_t patch;
+    uint32_t ip;
+    uint32_t cycles;
+    BOOL guard;
+} JitBranch;
+
+typedef struct {
+    Machine* machine;
+    JitRegion* region;
+
+    uint8_t* code;
+    size_t size;
+    size_t capacity;
+
+    uint32_t start; // first instruction compiled
+    uint32_t end;   // one past the last instruction compiled
+    int8_t host[256]; // host register of every vm register, -1 if not used
+
+    int32_t* offsets; // code offset of every instruction in the region, -1 if none
+    BOOL* targets;    // instruction is jumped to from inside the region
+
+    JitBranch* branches;
+    uint32_t numBranches;
+
+    uint32_t pending; // instructions ran since rbp was last updated
+    BOOL flagsLive;   // host flags still hold the result of the last cmp
+} Compiler;
+
+static void Emit8(Compiler* c, uint8_t byte) {
+    if (c->size < c->capacity)
+        c->code[c->size] = byte;
+    c->size++;
+}
+
+static void Emit32(Compiler* c, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        Emit8(c, value >> (i * 8));
+}
+
+static void Emit64(Compiler* c, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        Emit8(c, value >> (i * 8));
+}
+
+static void EmitRex(Compiler* c, BOOL wide, int reg, int rm) {
+    uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if (rex != 0x40)
+        Emit8(c, rex);
+}
+
+// op r/m, reg with both operands registers
+static void EmitRegReg(Compiler* c, BOOL wide, uint8_t op, int reg, int rm) {
+    EmitRex(c, wide, reg, rm);
+    Emit8(c, op);
+    Emit8(c, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op [base + disp32], reg. base is never rsp or r12 so no sib byte is needed
+static void EmitMem(Compiler* c, BOOL wide, uint8_t op, int reg, int base, int32_t disp) {
+    EmitRex(c, wide, reg, base);
+    Emit8(c, op);
+    Emit8(c, 0x80 | ((reg & 7) << 3) | (base & 7));
+    Emit32(c, disp);
+}
+
+// op [base + (index << shift) + disp32], reg through a sib byte, which any
+// base works with. index RSP means none, an op above 0xFF is two bytes
+static void EmitSib(Compiler* c, BOOL wide, uint16_t op, int reg, int base, int index, int shift,
+                    int32_t disp) {
+    uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40 || op == 0x88) // a byte store from sil or dil needs the prefix even when empty
+        Emit8(c, rex);
+    if (op > 0xFF)
+        Emit8(c, op >> 8);
+    Emit8(c, op);
+    Emit8(c, 0x84 | ((reg & 7) << 3));
+    Emit8(c, (shift << 6) | ((index & 7) << 3) | (base & 7));
+    Emit32(c, disp);
+}
+
+// op r/m64, imm32 for the 0x81 group. digit picks add, or, and, sub, xor or cmp
+static void EmitAluImm(Compiler* c, int digit, int reg, int32_t imm) {
+    EmitRegReg(c, TRUE, 0x81, digit, reg);
+    Emit32(c, imm);
+}
+
+static BOOL FitsInt32(long value) { return value >= INT32_MIN && value <= INT32_MAX; }
+
+static void EmitMovImm(Compiler* c, int reg, long value) {
+    if (FitsInt32(value)) {
+        EmitRegReg(c, TRUE, 0xC7, 0, reg);
+        Emit32(c, value);
+    } else {
+        EmitRex(c, TRUE, 0, reg);
+        Emit8(c, 0xB8 + (reg & 7));
+        Emit64(c, value);
+    }
+}
+
+static void EmitPush(Compiler* c, int reg) {
+    EmitRex(c, FALSE, 0, reg);
+    Emit8(c, 0x50 + (reg & 7));
+}
+
+static void EmitPop(Compiler* c, int reg) {
+    EmitRex(c, FALSE, 0, reg);
+    Emit8(c, 0x58 + (reg & 7));
+}
+
+// lea rbp, [rbp + n]. unlike add it leaves the flags of a cmp alone
+static void FlushCycles(Compiler* c) {
+    if (c->pending == 0)
+        return;
+    EmitMem(c, TRUE, 0x8D, RBP, RBP, c->pending);
+    c->pending = 0;
+}
+
+static void AddBranch(Compiler* c, uint32_t ip, uint32_t cycles, BOOL guard) {
+    c->branches[c->numBranches++] = (JitBranch){c->size - 4, ip, cycles, guard};
+}
+
+// conditional jump to 'ip'. the caller flushed the cycles
+static void EmitJcc(Compiler* c, int cc, uint32_t ip) {
+    Emit8(c, 0x0F);
+    Emit8(c, 0x80 | cc);
+    Emit32(c, 0);
+    AddBranch(c, ip, 0, FALSE);
+}
+
+static void EmitJmp(Compiler* c, uint32_t ip) {
+    Emit8(c, 0xE9);
+    Emit32(c, 0);
+    AddBranch(c, ip, 0, FALSE);
+}
+
+// leave to the interpreter before running the instruction at 'ip' if 'cc' holds
+static void EmitGuard(Compiler* c, int cc, uint32_t ip) {
+    Emit8(c, 0x0F);
+    Emit8(c, 0x80 | cc);
+    Emit32(c, 0);
+    AddBranch(c, ip, c->pending, TRUE);
+}
+
+static long ImmediateValue(Machine* machine, Instruction inst) {
+    if (inst.kind == OPND_I64)
+        return inst.imm;
+    if (inst.kind == OPND_F64)
+        return (long)machine->constants[inst.index].f64;
+    return machine->constants[inst.index].i64;
+}
+
+// 'op reg, operand' where the operand is a register or an integer immediate.
+// 'op' is the 'op r/m64, r64' opcode and 'digit' its 0x81 group form
+static void EmitAlu(Compiler* c, uint8_t op, int digit, int reg, Instruction inst) {
+    if (inst.kind == OPND_REG) {
+        EmitRegReg(c, TRUE, op, c->host[inst.src], reg);
+        return;
+    }
+
+    long value = ImmediateValue(c->machine, inst);
+    if (FitsInt32(value)) {
+        EmitAluImm(c, digit, reg, value);
+    } else {
+        EmitMovImm(c, RAX, value);
+        EmitRegReg(c, TRUE, op, RAX, reg);
+    }
+}
+
+// eax = stackSize, leaving to the interpreter if the stack holds fewer than
+// 'needs' values or has no room for 'room' more. rcx is set up so that
+// [rcx + STACK_OFFSET(0)] is the first free slot. The capacity is fixed for
+// the life of the machine, so it is compiled in
+static void EmitStack(Compiler* c, uint32_t ip, int needs, int room) {
+    EmitMem(c, FALSE, 0x8B, RAX, RDI, MACHINE_OFFSET(stackSize));
+    if (needs > 0) {
+        EmitRegReg(c, FALSE, 0x81, 7, RAX);
+        Emit32(c, needs);
+        EmitGuard(c, CC_B, ip);
+    }
+    if (room > 0) {
+        EmitRegReg(c, FALSE, 0x81, 7, RAX);
+        Emit32(c, c->machine->stackCapacity - room);
+        EmitGuard(c, CC_A, ip);
+    }
+
+    // imul ecx, eax, sizeof(Value); add rcx, [rdi + stack]
+    Emit8(c, 0x6B);
+    Emit8(c, 0xC8);
+    Emit8(c, sizeof(Value));
+    EmitMem(c, TRUE, 0x03, RCX, RDI, MACHINE_OFFSET(stack));
+    c->flagsLive = FALSE;
+}
+
+static void EmitSetStackSize(Compiler* c, int delta) {
+    if (delta != 0) {
+        EmitRegReg(c, FALSE, 0x81, delta > 0 ? 0 : 5, RAX);
+        Emit32(c, delta > 0 ? delta : -delta);
+    }
+    EmitMem(c, FALSE, 0x89, RAX, RDI, MACHINE_OFFSET(stackSize));
+}
+
+#ifndef VM_NANBOX
+// mov dword [rcx + type of stack slot], type
+static void EmitSlotType(Compiler* c, int slot, DataType type) {
+    EmitMem(c, FALSE, 0xC7, 0, RCX, STACK_OFFSET(slot) + 8);
+    Emit32(c, type);
+}
+#else
+// top 17 bits of a boxed i64, and of a value kept in stackWide
+#define BOXED_I64 (NANBOX_BOXED(TY_I64 + 1) >> NANBOX_TAG_SHIFT)
+#define BOXED_WIDE (NANBOX_BOXED(NANBOX_WIDE) >> NANBOX_TAG_SHIFT)
+
+// shl, shr, sar or ror 'reg' by 'count', picked by 'digit'
+static void EmitShift(Compiler* c, int digit, int reg, uint8_t count) {
+    EmitRegReg(c, TRUE, 0xC1, digit, reg);
+    Emit8(c, count);
+}
+
+// leave to the interpreter if the top 17 bits of stack slot 'slot' are
+// (CC_E) or aren't (CC_NE) 'tag'. clobbers rdx
+static void EmitGuardTag(Compiler* c, uint32_t ip, int slot, int cc, uint32_t tag) {
+    EmitMem(c, TRUE, 0x8B, RDX, RCX, STACK_OFFSET(slot));
+    EmitShift(c, 5, RDX, NANBOX_TAG_SHIFT);
+    EmitAluImm(c, 7, RDX, tag);
+    EmitGuard(c, cc, ip);
+}
+
+// leave to the interpreter if the i64 in 'reg' is too big to box. clobbers 'scratch'
+static void EmitGuardFits(Compiler* c, uint32_t ip, int reg, int scratch) {
+    EmitRegReg(c, TRUE, 0x89, reg, scratch);
+    EmitShift(c, 4, scratch, 64 - NANBOX_TAG_SHIFT);
+    EmitShift(c, 7, scratch, 64 - NANBOX_TAG_SHIFT);
+    EmitRegReg(c, TRUE, 0x39, reg, scratch);
+    EmitGuard(c, CC_NE, ip);
+}
+
+// box the i64 in 'reg'. the tag is put under the payload and rotated above it
+static void EmitBox(Compiler* c, int reg) {
+    EmitShift(c, 4, reg, 64 - NANBOX_TAG_SHIFT);
+    EmitAluImm(c, 1, reg, BOXED_I64);
+    EmitShift(c, 1, reg, 64 - NANBOX_TAG_SHIFT);
+}
+
+// sign extend the payload of the boxed i64 in 'reg'
+static void EmitUnbox(Compiler* c, int reg) {
+    EmitShift(c, 4, reg, 64 - NANBOX_TAG_SHIFT);
+    EmitShift(c, 7, reg, 64 - NANBOX_TAG_SHIFT);
+}
+
+// the stack instructions on NaN boxed values. only boxed i64s are worked on,
+// anything else leaves to the interpreter before the instruction runs
+static void CompileBoxedStack(Compiler* c, uint32_t ip, Instruction inst) {
+    switch (inst.operation) {
+    case OP_PUSH:
+        if (inst.kind == OPND_REG) {
+            int src = c->host[inst.src];
+            EmitGuardFits(c, ip, src, RDX);
+            EmitStack(c, ip, 0, 1);
+            EmitRegReg(c, TRUE, 0x89, src, RDX);
+            EmitBox(c, RDX);
+        } else {
+            DataCell* constants = c->machine->constants;
+            Data data = inst.kind == OPND_I64   ? DATA_USING_I64(inst.imm)
+                        : inst.kind == OPND_F64 ? DATA_USING_F64(constants[inst.index].f64)
+                                                : DATA_USING_I64(constants[inst.index].i64);
+            Value boxed;
+            NanBox(data, &boxed); // JitRegisters turned down any that don't fit
+            EmitStack(c, ip, 0, 1);
+            EmitMovImm(c, RDX, boxed);
+        }
+        EmitMem(c, TRUE, 0x89, RDX, RCX, STACK_OFFSET(0));
+        EmitSetStackSize(c, 1);
+        break;
+    case OP_POP:
+        EmitStack(c, ip, 1, 0);
+        if (inst.kind == OPND_REG) {
+            int dest = c->host[inst.dest];
+            EmitGuardTag(c, ip, -1, CC_NE, BOXED_I64);
+            EmitMem(c, TRUE, 0x8B, dest, RCX, STACK_OFFSET(-1));
+            EmitUnbox(c, dest);
+        }
+        EmitSetStackSize(c, -1);
+        break;
+    case OP_DUP:
+        EmitStack(c, ip, 1, 1);
+        EmitGuardTag(c, ip, -1, CC_E, BOXED_WIDE);
+        EmitMem(c, TRUE, 0x8B, RDX, RCX, STACK_OFFSET(-1));
+        EmitMem(c, TRUE, 0x89, RDX, RCX, STACK_OFFSET(0));
+        EmitSetStackSize(c, 1);
+        break;
+    case OP_SIZE:
+        EmitStack(c, ip, 0, 1);
+        EmitMovImm(c, RDX, NANBOX_BOXED(TY_I64 + 1));
+        EmitRegReg(c, TRUE, 0x09, RAX, RDX);
+        EmitMem(c, TRUE, 0x89, RDX, RCX, STACK_OFFSET(0));
+        EmitSetStackSize(c, 1);
+        break;
+    case OP_SWAP:
+        // pushes back two i64s, which boxed i64s already are
+        EmitStack(c, ip, 2, 0);
+        EmitGuardTag(c, ip, -1, CC_NE, BOXED_I64);
+        EmitGuardTag(c, ip, -2, CC_NE, BOXED_I64);
+        break;
+    case OP_NEG:
+    case OP_NOTB:
+    case OP_SHL:
+    case OP_SHR:
+        EmitStack(c, ip, 1, 0);
+        EmitGuardTag(c, ip, -1, CC_NE, BOXED_I64);
+        EmitMem(c, TRUE, 0x8B, RDX, RCX, STACK_OFFSET(-1));
+        EmitUnbox(c, RDX);
+        if (inst.operation == OP_NEG || inst.operation == OP_NOTB)
+            EmitRegReg(c, TRUE, 0xF7, inst.operation == OP_NEG ? 3 : 2, RDX);
+        else
+            EmitShift(c, inst.operation == OP_SHL ? 4 : 7, RDX, inst.imm & 63);
+
+        // not and shifting right always give back something that fits
+        if (inst.operation == OP_NEG || inst.operation == OP_SHL)
+            EmitGuardFits(c, ip, RDX, RAX);
+        EmitBox(c, RDX);
+        EmitMem(c, TRUE, 0x89, RDX, RCX, STACK_OFFSET(-1));
+        break;
+    case OP_ANDB:
+    case OP_ORB:
+    case OP_XORB: {
+        uint8_t op = inst.operation == OP_ANDB ? 0x23 : inst.operation == OP_ORB ? 0x0B : 0x33;
+        EmitStack(c, ip, 2, 0);
+        EmitGuardTag(c, ip, -1, CC_NE, BOXED_I64);
+        EmitGuardTag(c, ip, -2, CC_NE, BOXED_I64);
+
+        // and, or and xor of two payloads is the payload of the result
+        EmitMem(c, TRUE, 0x8B, RDX, RCX, STACK_OFFSET(-1));
+        EmitMem(c, TRUE, op, RDX, RCX, STACK_OFFSET(-2));
+        EmitBox(c, RDX);
+        EmitMem(c, TRUE, 0x89, RDX, RCX, STACK_OFFSET(-2));
+        EmitSetStackSize(c, -1);
+        break;
+    }
+    }
+}
+#endif
+
+static void EmitCompare(Compiler* c, int reg, Instruction inst) {
+    // keep the operands so EFLAGS can be rebuilt when the code exits
+    if (inst.kind == OPND_REG) {
+        EmitMem(c, TRUE, 0x89, c->host[inst.src], RDI, MACHINE_OFFSET(jitCompare[0]));
+    } else {
+        long value = ImmediateValue(c->machine, inst);
+        if (FitsInt32(value)) {
+            EmitMem(c, TRUE, 0xC7, 0, RDI, MACHINE_OFFSET(jitCompare[0]));
+            Emit32(c, value);
+        } else {
+            EmitMovImm(c, RAX, value);
+            EmitMem(c, TRUE, 0x89, RAX, RDI, MACHINE_OFFSET(jitCompare[0]));
+        }
+    }
+    EmitMem(c, TRUE, 0x89, reg, RDI, MACHINE_OFFSET(jitCompare[1]));
+
+    EmitAlu(c, 0x39, 7, reg, inst);
+    c->flagsLive = TRUE;
+}
+
+static void EmitBranch(Compiler* c, int cc, uint32_t target) {
+    c->pending++;
+    FlushCycles(c);
+
+    if (c->flagsLive == FALSE) {
+        // mov rax, [b]; cmp rax, [a]
+        EmitMem(c, TRUE, 0x8B, RAX, RDI, MACHINE_OFFSET(jitCompare[1]));
+        EmitMem(c, TRUE, 0x3B, RAX, RDI, MACHINE_OFFSET(jitCompare[0]));
+        c->flagsLive = TRUE;
+    }
+
+    EmitJcc(c, cc, target);
+}
+
+// dest = dest / operand or dest % operand
+static void EmitDivide(Compiler* c, uint32_t ip, int reg, Instruction inst, BOOL remainder) {
+    int divisor = RCX;
+    if (inst.kind == OPND_REG) {
+        divisor = c->host[inst.src];
+        EmitRegReg(c, TRUE, 0x85, divisor, divisor);
+        EmitGuard(c, CC_E, ip); // the interpreter reports the divide by zero
+        EmitAluImm(c, 7, divisor, -1);
+        EmitGuard(c, CC_E, ip); // and LONG_MIN / -1 would trap, see DIV_I64
+    } else {
+        EmitMovImm(c, RCX, ImmediateValue(c->machine, inst));
+    }
+
+    EmitRegReg(c, TRUE, 0x89, reg, RAX);
+    Emit8(c, 0x48); // cqo
+    Emit8(c, 0x99);
+    EmitRegReg(c, TRUE, 0xF7, 7, divisor);
+    EmitRegReg(c, TRUE, 0x89, remainder ? RDX : RAX, reg);
+}
+
+/// @brief How many program instructions an opcode stands for
+static uint32_t InstructionLength(uint8_t operation) {
+    switch (operation) {
+    case OP_SHLI:
+    case OP_SHRI:
+        return 3;
+    case OP_ORR:
+    case OP_ANDR:
+    case OP_XORR:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+/// @brief Check if the jit can compile an instruction and list the registers it uses
+/// @return - number of registers written to regs, or -1 if it is not supported
+static int JitRegisters(Machine* machine, Instruction inst, uint8_t* regs) {
+    uint8_t op = GenericOpcode(inst.operation);
+
+    switch (op) {
+    case OP_NOP:
+    case OP_DUP:
+    case OP_SWAP:
+    case OP_SIZE:
+    case OP_CLR:
+    case OP_NEG:
+    case OP_NOTB:
+    case OP_ANDB:
+    case OP_ORB:
+    case OP_XORB:
+    case OP_SHL:
+    case OP_SHR:
+        return 0;
+    case OP_JMP:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JG:
+    case OP_JGE:
+    case OP_JL:
+    case OP_JLE:
+        return inst.index <= machine->programSize ? 0 : -1;
+    case OP_PUSH:
+        if (inst.kind == OPND_REG) {
+            regs[0] = inst.src;
+            return 1;
+        }
+#ifdef VM_NANBOX
+        // an immediate too big to box goes in stackWide, which only the interpreter writes
+        if (inst.kind == OPND_WIDE) {
+            Value boxed;
+            return NanBox(DATA_USING_I64(machine->constants[inst.index].i64), &boxed) ? 0 : -1;
+        }
+#endif
+        return (inst.kind == OPND_I64 || inst.kind == OPND_WIDE || inst.kind == OPND_F64) ? 0 : -1;
+    case OP_POP:
+        if (inst.kind == OPND_REG) {
+            regs[0] = inst.dest;
+            return 1;
+        }
+        return 0;
+    case OP_SHLI:
+    case OP_SHRI:
+        regs[0] = inst.dest;
+        return 1;
+    case OP_ORR:
+    case OP_ANDR:
+    case OP_XORR:
+        regs[0] = inst.dest;
+        regs[1] = inst.src;
+        regs[2] = inst.imm;
+        return 3;
+    case OP_DIV:
+    case OP_MOD:
+        if (inst.kind == OPND_I64 && (inst.imm == 0 || inst.imm == -1))
+            return -1;
+        // fall through
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+        regs[0] = inst.dest;
+        if (inst.kind == OPND_REG) {
+            regs[1] = inst.src;
+            return 2;
+        }
+        return (inst.kind == OPND_I64 || inst.kind == OPND_WIDE) ? 1 : -1;
+    case OP_CMP:
+    case OP_CMPJE:
+    case OP_CMPJNE:
+    case OP_CMPJG:
+    case OP_CMPJGE:
+    case OP_CMPJL:
+    case OP_CMPJLE:
+        regs[0] = inst.dest;
+        if (inst.kind == OPND_REG) {
+            regs[1] = inst.src;
+            return 2;
+        }
+        return (inst.kind == OPND_I64 || inst.kind == OPND_WIDE || inst.kind == OPND_F64) ? 1
+                                                                                         : -1;
+    case OP_LOAD:
+    case OP_LOADB:
+    case OP_STORE:
+    case OP_STOREB:
+        // checked memory and f64 loads and stores stay in the interpreter
+        if (machine->checkMemory == TRUE)
+            return -1;
+
+        regs[0] = inst.dest;
+        regs[1] = inst.src;
+        if (inst.kind == OPND_MEM_INDEX) {
+            regs[2] = MEM_INDEX_REG(inst);
+            return 3;
+        }
+        return 2;
+    default:
+        // calls, output, syscalls and exit stay in the interpreter
+        return -1;
+    }
+}
+
+// find how far the region reaches and give each register it uses a host register
+static void ScanRegion(Compiler* c) {
+    Machine* machine = c->machine;
+    JitRegion* region = c->region;
+
+    memset(c->host, -1, sizeof(c->host));
+
+    uint32_t i = c->start;
+    while (i < machine->programSize && i - c->start < JIT_MAX_REGION) {
+        Instruction inst = machine->program[i];
+        uint8_t regs[3];
+        int numRegs = JitRegisters(machine, inst, regs);
+        if (numRegs < 0)
+            break;
+
+        // a superinstruction's tail has to fit too, offsets and targets
+        // have a slot for each of JIT_MAX_REGION instructions
+        if (i - c->start + InstructionLength(inst.operation) > JIT_MAX_REGION)
+            break;
+
+        int needed = 0;
+        for (int r = 0; r < numRegs; r++) {
+            if (c->host[regs[r]] < 0) {
+                BOOL counted = FALSE;
+                for (int k = 0; k < r; k++)
+                    counted |= regs[k] == regs[r];
+                needed += !counted;
+            }
+        }
+        if (region->numRegs + needed > JIT_MAX_REGS)
+            break;
+
+        for (int r = 0; r < numRegs; r++) {
+            if (c->host[regs[r]] < 0) {
+                c->host[regs[r]] = hostRegs[region->numRegs];
+                region->regs[region->numRegs++] = regs[r];
+            }
+        }
+
+        i += InstructionLength(inst.operation);
+    }
+
+    c->end = i < machine->programSize ? i : machine->programSize;
+
+    for (i = c->start; i < c->end; i++) {
+        Instruction inst = c->machine->program[i];
+        if (inst.kind == OPND_LABEL && inst.index >= c->start && inst.index < c->end)
+            c->targets[inst.index - c->start] = TRUE;
+    }
+}
+
+static void CompileInstruction(Compiler* c, uint32_t ip, Instruction inst) {
+    int dest = c->host[inst.dest];
+
+    switch (GenericOpcode(inst.operation)) {
+    case OP_NOP:
+        break;
+    case OP_MOV:
+        if (inst.kind == OPND_REG)
+            EmitRegReg(c, TRUE, 0x89, c->host[inst.src], dest);
+        else
+            EmitMovImm(c, dest, ImmediateValue(c->machine, inst));
+        break;
+    case OP_LOAD:
+    case OP_LOADB:
+    case OP_STORE:
+    case OP_STOREB: {
+        BOOL indexed = (inst.kind == OPND_MEM_INDEX);
+        uint16_t op = (inst.operation == OP_LOAD)    ? 0x8B
+                      : (inst.operation == OP_LOADB) ? 0x0FBE // movsx
+                      : (inst.operation == OP_STORE) ? 0x89
+                                                     : 0x88;
+        EmitSib(c, inst.operation != OP_STOREB, op, dest, c->host[inst.src],
+                indexed ? c->host[MEM_INDEX_REG(inst)] : RSP, indexed ? MEM_INDEX_SHIFT(inst) : 0,
+                indexed ? 0 : inst.imm);
+        break;
+    }
+    case OP_ADD:
+        EmitAlu(c, 0x01, 0, dest, inst);
+        c->flagsLive = FALSE;
+        break;
+    case OP_SUB:
+        EmitAlu(c, 0x29, 5, dest, inst);
+        c->flagsLive = FALSE;
+        break;
+    case OP_MUL:
+        if (inst.kind == OPND_REG) {
+            // imul dest, src
+            EmitRex(c, TRUE, dest, c->host[inst.src]);
+            Emit8(c, 0x0F);
+            Emit8(c, 0xAF);
+            Emit8(c, 0xC0 | ((dest & 7) << 3) | (c->host[inst.src] & 7));
+        } else {
+            long value = ImmediateValue(c->machine, inst);
+            if (FitsInt32(value)) {
+                // imul dest, dest, imm32
+                EmitRegReg(c, TRUE, 0x69, dest, dest);
+                Emit32(c, value);
+            } else {
+                EmitMovImm(c, RAX, value);
+                EmitRex(c, TRUE, dest, RAX);
+                Emit8(c, 0x0F);
+                Emit8(c, 0xAF);
+                Emit8(c, 0xC0 | ((dest & 7) << 3));
+            }
+        }
+        c->flagsLive = FALSE;
+        break;
+    case OP_DIV:
+        EmitDivide(c, ip, dest, inst, FALSE);
+        c->flagsLive = FALSE;
+        break;
+    case OP_MOD:
+        EmitDivide(c, ip, dest, inst, TRUE);
+        c->flagsLive = FALSE;
+        break;
+    case OP_CMP:
+    case OP_CMPJE:
+    case OP_CMPJNE:
+    case OP_CMPJG:
+    case OP_CMPJGE:
+    case OP_CMPJL:
+    case OP_CMPJLE:
+        // the jcc of a fused pair is still in the next slot and compiled on its own
+        EmitCompare(c, dest, inst);
+        break;
+    case OP_JMP:
+        c->pending++;
+        FlushCycles(c);
+        EmitJmp(c, inst.index);
+        return;
+    case OP_JE:
+        EmitBranch(c, CC_E, inst.index);
+        return;
+    case OP_JNE:
+        EmitBranch(c, CC_NE, inst.index);
+        return;
+    case OP_JG:
+        EmitBranch(c, CC_G, inst.index);
+        return;
+    case OP_JGE:
+        EmitBranch(c, CC_GE, inst.index);
+        return;
+    case OP_JL:
+        EmitBranch(c, CC_L, inst.index);
+        return;
+    case OP_JLE:
+        EmitBranch(c, CC_LE, inst.index);
+        return;
+    case OP_CLR:
+        EmitMem(c, FALSE, 0xC7, 0, RDI, MACHINE_OFFSET(stackSize));
+        Emit32(c, 0);
+        break;
+#ifdef VM_NANBOX
+    case OP_PUSH:
+    case OP_POP:
+    case OP_DUP:
+    case OP_SIZE:
+    case OP_SWAP:
+    case OP_NEG:
+    case OP_NOTB:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_ANDB:
+    case OP_ORB:
+    case OP_XORB:
+        CompileBoxedStack(c, ip, inst);
+        break;
+#else
+    case OP_PUSH:
+        EmitStack(c, ip, 0, 1);
+        if (inst.kind == OPND_REG) {
+            EmitMem(c, TRUE, 0x89, c->host[inst.src], RCX, STACK_OFFSET(0));
+        } else {
+            long bits = inst.kind == OPND_I64 ? inst.imm : c->machine->constants[inst.index].i64;
+            EmitMovImm(c, RDX, bits);
+            EmitMem(c, TRUE, 0x89, RDX, RCX, STACK_OFFSET(0));
+        }
+        EmitSlotType(c, 0, inst.kind == OPND_F64 ? TY_F64 : TY_I64);
+        EmitSetStackSize(c, 1);
+        break;
+    case OP_POP:
+        EmitStack(c, ip, 1, 0);
+        if (inst.kind == OPND_REG) {
+            // a float has to keep its type, leave that to the interpreter
+            EmitMem(c, FALSE, 0x81, 7, RCX, STACK_OFFSET(-1) + 8);
+            Emit32(c, TY_F64);
+            EmitGuard(c, CC_E, ip);
+            EmitMem(c, TRUE, 0x8B, dest, RCX, STACK_OFFSET(-1));
+        }
+        EmitSetStackSize(c, -1);
+        break;
+    case OP_DUP:
+        EmitStack(c, ip, 1, 1);
+        EmitMem(c, TRUE, 0x8B, RDX, RCX, STACK_OFFSET(-1));
+        EmitMem(c, TRUE, 0x89, RDX, RCX, STACK_OFFSET(0));
+        EmitMem(c, FALSE, 0x8B, RDX, RCX, STACK_OFFSET(-1) + 8);
+        EmitMem(c, FALSE, 0x89, RDX, RCX, STACK_OFFSET(0) + 8);
+        EmitSetStackSize(c, 1);
+        break;
+    case OP_SIZE:
+        EmitStack(c, ip, 0, 1);
+        EmitMem(c, TRUE, 0x89, RAX, RCX, STACK_OFFSET(0));
+        EmitSlotType(c, 0, TY_I64);
+        EmitSetStackSize(c, 1);
+        break;
+    case OP_SWAP:
+        // pops two values and pushes them back in the same order, so only
+        // their types change
+        EmitStack(c, ip, 2, 0);
+        EmitSlotType(c, -1, TY_I64);
+        EmitSlotType(c, -2, TY_I64);
+        break;
+    case OP_NEG:
+    case OP_NOTB:
+        EmitStack(c, ip, 1, 0);
+        EmitMem(c, TRUE, 0xF7, inst.operation == OP_NEG ? 3 : 2, RCX, STACK_OFFSET(-1));
+        EmitSlotType(c, -1, TY_I64);
+        break;
+    case OP_SHL:
+    case OP_SHR:
+        EmitStack(c, ip, 1, 0);
+        EmitMem(c, TRUE, 0xC1, inst.operation == OP_SHL ? 4 : 7, RCX, STACK_OFFSET(-1));
+        Emit8(c, inst.imm & 63);
+        EmitSlotType(c, -1, TY_I64);
+        break;
+    case OP_ANDB:
+    case OP_ORB:
+    case OP_XORB: {
+        uint8_t op = inst.operation == OP_ANDB ? 0x21 : inst.operation == OP_ORB ? 0x09 : 0x31;
+        EmitStack(c, ip, 2, 0);
+        EmitMem(c, TRUE, 0x8B, RDX, RCX, STACK_OFFSET(-1));
+        EmitMem(c, TRUE, op, RDX, RCX, STACK_OFFSET(-2));
+        EmitSlotType(c, -2, TY_I64);
+        EmitSetStackSize(c, -1);
+        break;
+    }
+#endif
+    // the pushes these replaced leave to the interpreter on a full stack, so do they
+    case OP_SHLI:
+        EmitStack(c, ip, 0, 1);
+        EmitMovImm(c, dest, (long)((unsigned long)(long)inst.imm << (inst.src & 63)));
+        break;
+    case OP_SHRI:
+        EmitStack(c, ip, 0, 1);
+        EmitMovImm(c, dest, (long)inst.imm >> (inst.src & 63));
+        break;
+    case OP_ORR:
+    case OP_ANDR:
+    case OP_XORR: {
+        uint8_t op = inst.operation == OP_ANDR ? 0x21 : inst.operation == OP_ORR ? 0x09 : 0x31;
+        EmitStack(c, ip, 0, 2);
+        EmitRegReg(c, TRUE, 0x89, c->host[inst.src], RAX);
+        EmitRegReg(c, TRUE, op, c->host[inst.imm], RAX);
+        EmitRegReg(c, TRUE, 0x89, RAX, dest);
+        c->flagsLive = FALSE;
+        break;
+    }
+    }
+
+    c->pending += InstructionLength(inst.operation);
+}
+
+// set ip and leave through the epilogue at 'epilogue', or fall into it if it is -1
+static void EmitExit(Compiler* c, uint32_t ip, uint32_t cycles, long epilogue) {
+    if (cycles > 0)
+        EmitMem(c, TRUE, 0x8D, RBP, RBP, cycles);
+    EmitMem(c, FALSE, 0xC7, 0, RDI, MACHINE_OFFSET(ip));
+    Emit32(c, ip);
+
+    if (epilogue >= 0) {
+        Emit8(c, 0xE9);
+        Emit32(c, epilogue - (long)(c->size + 4));
+    }
+}
+
+static void Patch(Compiler* c, size_t at, size_t target) {
+    int32_t rel = (int32_t)((long)target - (long)(at + 4));
+    if (at + 4 <= c->capacity)
+        memcpy(c->code + at, &rel, 4);
+}
+
+static const int savedRegs[] = {RBX, RBP, R12, R13, R14, R15};
+
+// a jump inside the region back to itself or an earlier instruction
+static BOOL HasBackEdge(const Compiler* c) {
+    for (uint32_t ip = c->start; ip < c->end; ip++) {
+        Instruction inst = c->machine->program[ip];
+        if (inst.kind == OPND_LABEL && inst.index >= c->start && inst.index <= ip)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static BOOL CompileRegion(Compiler* c) {
+    JitRegion* region = c->region;
+
+    ScanRegion(c);
+    if (c->end == c->start)
+        return FALSE;
+
+    // entering native code costs more than interpreting a few instructions
+    // that leave straight away, e.g a called label that adds and returns
+    if (c->end - c->start < JIT_MIN_REGION && HasBackEdge(c) == FALSE)
+        return FALSE;
+
+    // prologue, load the vm registers
+    for (int i = 0; i < 6; i++)
+        EmitPush(c, savedRegs[i]);
+    EmitMem(c, TRUE, 0x8B, RBP, RDI, MACHINE_OFFSET(cycles));
+    for (int i = 0; i < region->numRegs; i++)
+        EmitMem(c, TRUE, 0x8B, c->host[region->regs[i]], RDI, REG_OFFSET(region->regs[i]));
+
+    // body
+    for (uint32_t ip = c->start; ip < c->end;) {
+        Instruction inst = c->machine->program[ip];
+
+        if (c->targets[ip - c->start]) {
+            FlushCycles(c);
+            c->flagsLive = FALSE;
+        }
+        c->offsets[ip - c->start] = c->size;
+
+        CompileInstruction(c, ip, inst);
+        ip += InstructionLength(inst.operation);
+    }
+
+    // ran off the end of the region, then store the vm registers back
+    EmitExit(c, c->end, c->pending, -1);
+    size_t epilogue = c->size;
+    for (int i = 0; i < region->numRegs; i++)
+        EmitMem(c, TRUE, 0x89, c->host[region->regs[i]], RDI, REG_OFFSET(region->regs[i]));
+    EmitMem(c, TRUE, 0x89, RBP, RDI, MACHINE_OFFSET(cycles));
+    for (int i = 5; i >= 0; i--)
+        EmitPop(c, savedRegs[i]);
+    Emit8(c, 0xC3);
+
+    // branches inside the region go straight to their code, everything else
+    // gets a stub that leaves to the interpreter
+    for (uint32_t i = 0; i < c->numBranches; i++) {
+        JitBranch* branch = &c->branches[i];
+        BOOL inside = branch->ip >= c->start && branch->ip < c->end &&
+                      c->offsets[branch->ip - c->start] >= 0;
+
+        if (branch->guard == FALSE && inside) {
+            size_t target = c->offsets[branch->ip - c->start];
+            if (target > branch->patch) {
+                Patch(c, branch->patch, target);
+                continue;
+            }
+
+            // a loop. go through a stub that leaves to the interpreter once
+            // the cycle budget is spent, the cycles were flushed before the branch
+            Patch(c, branch->patch, c->size);
+            EmitMem(c, TRUE, 0x3B, RBP, RDI, MACHINE_OFFSET(jitCycleLimit));
+            Emit8(c, 0x0F);
+            Emit8(c, 0x80 | CC_AE);
+            Emit32(c, 0);
+            AddBranch(c, branch->ip, 0, TRUE);
+            Emit8(c, 0xE9);
+            Emit32(c, 0);
+            Patch(c, c->size - 4, target);
+            continue;
+        }
+
+        Patch(c, branch->patch, c->size);
+        EmitExit(c, branch->ip, branch->cycles, epilogue);
+    }
+
+    return c->size <= c->capacity;
+}
+
+static JitRegion* Compile(Jit* jit, Machine* machine, uint32_t start) {
+    JitRegion* region = calloc(1, sizeof(JitRegion));
+    if (region == NULL)
+        return &uncompiled;
+
+    Compiler c = {0};
+    c.machine = machine;
+    c.region = region;
+    c.code = jit->code + jit->codeSize;
+    c.capacity = JIT_CODE_SIZE - jit->codeSize;
+    c.start = start;
+    c.offsets = malloc(JIT_MAX_REGION * sizeof(int32_t));
+    c.targets = calloc(JIT_MAX_REGION, sizeof(BOOL));
+    c.branches = malloc(JIT_MAX_REGION * 4 * sizeof(JitBranch));
+
+    BOOL compiled = FALSE;
+    if (c.offsets != NULL && c.targets != NULL && c.branches != NULL &&
+        mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) == 0) {
+        memset(c.offsets, -1, JIT_MAX_REGION * sizeof(int32_t));
+        compiled = CompileRegion(&c);
+        mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+    }
+
+    free(c.offsets);
+    free(c.targets);
+    free(c.branches);
+
+    if (compiled == FALSE) {
+        free(region);
+        return &uncompiled;
+    }
+
+    region->entry = (JitFunction)(void*)c.code;
+    jit->codeSize += (c.size + 15) & ~(size_t)15;
+    return region;
+}
+
+// pick cmp operands that make Compare() give back the current EFLAGS, so code
+// that branches before its first cmp sees the same flags as the interpreter
+static void SeedCompare(Machine* machine) {
+    uint8_t flags = machine->EFLAGS;
+    long a = 0, b = 1;
+
+    if (flags & FLAG_ZF)
+        b = 0;
+    else if ((flags & FLAG_SF) && (flags & FLAG_OF)) {
+        a = -1;
+        b = LONG_MAX;
+    } else if (flags & FLAG_SF) {
+        a = 1;
+        b = 0;
+    } else if (flags & FLAG_OF) {
+        a = 1;
+        b = LONG_MIN;
+    }
+
+    machine->jitCompare[0] = a;
+    machine->jitCompare[1] = b;
+}
+
+Jit* JitCreate(Machine* machine) {
+    Jit* jit = calloc(1, sizeof(Jit));
+    if (jit == NULL)
+        return NULL;
+
+    jit->programSize = machine->programSize;
+    jit->hotness = calloc(machine->programSize + 1, sizeof(uint16_t));
+    jit->regions = calloc(machine->programSize + 1, sizeof(JitRegion*));
+    jit->code =
+        mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (jit->hotness == NULL || jit->regions == NULL || jit->code == MAP_FAILED) {
+        jit->code = (jit->code == MAP_FAILED) ? NULL : jit->code;
+        JitDestroy(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void JitDestroy(Jit* jit) {
+    if (jit == NULL)
+        return;
+
+    if (jit->regions != NULL) {
+        for (uint32_t i = 0; i < jit->programSize; i++) {
+            if (jit->regions[i] != &uncompiled)
+                free(jit->regions[i]);
+        }
+    }
+
+    if (jit->code != NULL)
+        munmap(jit->code, JIT_CODE_SIZE);
+
+    free(jit->hotness);
+    free(jit->regions);
+    free(jit);
+}
+
+void JitEnter(Machine* machine) {
+    Jit* jit = machine->jit;
+
+    while (machine->ip < jit->programSize && machine->cycles < machine->jitCycleLimit) {
+        uint32_t ip = machine->ip;
+        JitRegion* region = jit->regions[ip];
+
+        if (region == NULL) {
+            if (++jit->hotness[ip] < JIT_HOT_THRESHOLD)
+                return;
+            region = jit->regions[ip] = Compile(jit, machine, ip);
+        }
+
+        if (region->entry == NULL)
+            return;
+
+        // the code assumes every register it touches holds an integer
+        for (int i = 0; i < region->numRegs; i++) {
+            if (machine->registerTypes[region->regs[i]] != TY_I64)
+                return;
+        }
+
+        SeedCompare(machine);
+        region->entry(machine);
+        Compare(machine, machine->jitCompare[0], machine->jitCompare[1]);
+
+        if (machine->ip == ip)
+            return;
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,87 @@
+/// Baseline JIT compiler for x86-64 linux
+///
+/// Counts how often each label is jumped to. Once a label is hot, the
+/// instructions from it up to the first one the jit does not support are
+/// compiled to native code with the vm registers kept in host registers.
+/// Unsupported instructions, jumps out of the compiled code and failed
+/// guards exit back to the interpreter, leaving the machine exactly as the
+/// interpreter would have. Loops in compiled code also exit once the
+/// machine's cycle budget is spent.
+
+#ifndef JIT_H
+#define JIT_H
+
+#include "inst.h"
+
+#include <stddef.h>
+
+#ifdef VM_JIT
+
+#define JIT_HOT_THRESHOLD 64        // jumps to a label before it is compiled
+#define JIT_MAX_REGION 256          // most instructions compiled for one label
+#define JIT_MIN_REGION 4            // fewest compiled for a label that doesn't loop
+#define JIT_MAX_REGS 10             // vm registers that fit in host registers
+#define JIT_CODE_SIZE (4 << 20)     // bytes of executable memory per machine
+
+typedef void (*JitFunction)(Machine* machine);
+
+/// @brief Native code compiled for one hot label
+///
+/// @param entry: compiled code, NULL if the label could not be compiled
+/// @param regs: vm registers the code keeps in host registers
+/// @param numRegs: number of registers in regs
+typedef struct {
+    JitFunction entry;
+    uint8_t regs[JIT_MAX_REGS];
+    uint8_t numRegs;
+} JitRegion;
+
+/// @brief JIT state of one machine
+///
+/// @param code: executable mapping every region is compiled into
+/// @param codeSize: bytes of code used so far
+/// @param programSize: instructions in the program the jit was created for
+/// @param hotness: times each instruction was jumped to by the interpreter
+/// @param regions: compiled code starting at each instruction, if any
+typedef struct Jit {
+    uint8_t* code;
+    size_t codeSize;
+    uint32_t programSize;
+    uint16_t* hotness;
+    JitRegion** regions;
+} Jit;
+
+/// @brief Create the jit state for a machine whose program is already set
+/// @param machine - machine to compile code for
+/// @return - jit state to store in machine->jit, or NULL if out of memory
+Jit* JitCreate(Machine* machine);
+
+/// @brief Free the jit state and all compiled code
+/// @param jit - jit state to free
+void JitDestroy(Jit* jit);
+
+/// @brief Count a jump to machine->ip and run native code for it if there is any
+///
+/// Only returns once machine->ip points to an instruction
+/// that has to be interpreted.
+/// @param machine - machine that just jumped
+void JitEnter(Machine* machine);
+
+/// @brief Whether a jump to machine->ip is worth a call to JitEnter
+///
+/// False once the label was tried and could not be compiled, so jumps
+/// to it stay in the interpreter's dispatch loop.
+/// @param machine - machine that just jumped
+/// @return - FALSE if JitEnter would return without doing anything
+static inline BOOL JitWanted(const Machine* machine) {
+    const Jit* jit = machine->jit;
+    if (machine->ip >= jit->programSize)
+        return FALSE;
+
+    const JitRegion* region = jit->regions[machine->ip];
+    return region == NULL || region->entry != NULL;
+}
+
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,167 @@
+/// Perfect hash tables for keywords
+///
+/// GENERATED by src/gen-keywords.py, do not edit by hand.
+///
+/// Each table gives every keyword a slot of its own, so looking a word up
+/// costs one hash and one comparison. Unused slots have a length of zero.
+
+#ifndef KEYWORDS_H
+#define KEYWORDS_H
+
+#include "inst.h" // for Opcode, Register and VectorRegister
+
+#include <stddef.h>
+#include <string.h>
+
+#define KEYWORD_HASH_BITS 7
+#define KEYWORD_SLOTS (1 << KEYWORD_HASH_BITS)
+#define KEYWORD_MAX_LEN 8
+
+typedef struct {
+    char name[KEYWORD_MAX_LEN];
+    uint8_t length;
+    uint8_t value;
+} Keyword;
+
+/// @brief Hash a word using its length, first two and last characters
+/// @param word - start of the word, does not need to be terminated
+/// @param length - characters in the word, at least one
+/// @param seed - seed of the table being searched
+/// @return - slot of the word in the table
+static inline uint32_t KeywordHash(const char* word, size_t length, uint32_t seed) {
+    uint32_t second = (length > 1) ? (uint8_t)word[1] : 0;
+    uint32_t key = (uint8_t)word[0] | second << 8 | (uint32_t)(uint8_t)word[length - 1] << 16 |
+                   (uint32_t)length << 24;
+
+    return (key * seed) >> (32 - KEYWORD_HASH_BITS);
+}
+
+/// @brief Find a word in a table generated by gen-keywords.py
+/// @param table - table to search
+/// @param seed - seed the table was generated with
+/// @param word - start of the word, does not need to be terminated
+/// @param length - characters in the word
+/// @return - the keyword, or NULL if word is not in the table
+static inline const Keyword* KeywordLookup(const Keyword* table, uint32_t seed, const char* word,
+                                           size_t length) {
+    if (length == 0 || length >= KEYWORD_MAX_LEN)
+        return NULL;
+
+    const Keyword* keyword = &table[KeywordHash(word, length, seed)];
+    if (keyword->length != length || memcmp(keyword->name, word, length) != 0)
+        return NULL;
+
+    return keyword;
+}
+
+#define OPCODE_KEYWORD_SEED 0x9F306163u
+
+static const Keyword opcodeKeywords[KEYWORD_SLOTS] = {
+    [0] = {"XOR", 3, OP_XORB},
+    [7] = {"dup", 3, OP_DUP},
+    [8] = {"sub", 3, OP_SUB},
+    [9] = {"div", 3, OP_DIV},
+    [13] = {"movf", 4, OP_LOADF},
+    [17] = {"mul", 3, OP_MUL},
+    [18] = {"nop", 3, OP_NOP},
+    [19] = {"swap", 4, OP_SWAP},
+    [20] = {"exit", 4, OP_EXIT},
+    [21] = {"syscall", 7, OP_SYSCALL},
+    [23] = {"jl", 2, OP_JL},
+    [24] = {"AND", 3, OP_ANDB},
+    [25] = {"je", 2, OP_JE},
+    [32] = {"print", 5, OP_PRNT},
+    [33] = {"ret", 3, OP_RET},
+    [34] = {"clear", 5, OP_CLR},
+    [35] = {"jmp", 3, OP_JMP},
+    [36] = {"jne", 3, OP_JNE},
+    [41] = {"size", 4, OP_SIZE},
+    [42] = {"flush", 5, OP_FLUSH},
+    [43] = {"jg", 2, OP_JG},
+    [49] = {"pop", 3, OP_POP},
+    [52] = {"shl", 3, OP_SHL},
+    [53] = {"add", 3, OP_ADD},
+    [67] = {"call", 4, OP_CALL},
+    [70] = {"NOT", 3, OP_NOTB},
+    [72] = {"read", 4, OP_READ},
+    [74] = {"movb", 4, OP_LOADB},
+    [75] = {"OR", 2, OP_ORB},
+    [88] = {"shr", 3, OP_SHR},
+    [103] = {"mov", 3, OP_MOV},
+    [106] = {"neg", 3, OP_NEG},
+    [110] = {"push", 4, OP_PUSH},
+    [114] = {"write", 5, OP_WRITE},
+    [116] = {"jle", 3, OP_JLE},
+    [118] = {"cmp", 3, OP_CMP},
+    [122] = {"mod", 3, OP_MOD},
+    [123] = {"jge", 3, OP_JGE},
+#ifndef USING_ARDUINO
+    [6] = {"vfsum", 5, OP_VFSUM},
+    [15] = {"vsum", 4, OP_VSUM},
+    [22] = {"vmax", 4, OP_VMAX},
+    [30] = {"vfmax", 5, OP_VFMAX},
+    [37] = {"vadd", 4, OP_VADD},
+    [44] = {"vfcmpeq", 7, OP_VFCMPEQ},
+    [47] = {"vmin", 4, OP_VMIN},
+    [50] = {"vcmpeq", 6, OP_VCMPEQ},
+    [55] = {"vfmin", 5, OP_VFMIN},
+    [62] = {"vfcmpgt", 7, OP_VFCMPGT},
+    [68] = {"vcmpgt", 6, OP_VCMPGT},
+    [71] = {"vsplat", 6, OP_VSPLAT},
+    [77] = {"vmul", 4, OP_VMUL},
+    [80] = {"vfadd", 5, OP_VFADD},
+    [85] = {"vfmul", 5, OP_VFMUL},
+    [97] = {"vload", 5, OP_VLOAD},
+    [109] = {"vstore", 6, OP_VSTORE},
+    [111] = {"vfsub", 5, OP_VFSUB},
+    [119] = {"vsub", 4, OP_VSUB},
+#endif
+};
+
+#define REGISTER_KEYWORD_SEED 0x9E3779B1u
+
+static const Keyword registerKeywords[KEYWORD_SLOTS] = {
+    [3] = {"rcx", 3, REG_RCX},
+    [10] = {"cp", 2, REG_CP},
+    [14] = {"rdi", 3, REG_RDI},
+    [31] = {"rdx", 3, REG_RDX},
+    [36] = {"r9", 2, REG_R9},
+    [40] = {"ep", 2, REG_EP},
+    [43] = {"r15", 3, REG_R15},
+    [46] = {"rsi", 3, REG_RSI},
+    [50] = {"r13", 3, REG_R13},
+    [56] = {"r11", 3, REG_R11},
+    [75] = {"rax", 3, REG_RAX},
+    [76] = {"r8", 2, REG_R8},
+    [103] = {"rbx", 3, REG_RBX},
+    [110] = {"r14", 3, REG_R14},
+    [117] = {"r12", 3, REG_R12},
+    [123] = {"r10", 3, REG_R10},
+};
+
+#ifndef USING_ARDUINO
+
+#define VECTOR_KEYWORD_SEED 0x9E3779B3u
+
+static const Keyword vectorKeywords[KEYWORD_SLOTS] = {
+    [0] = {"v5", 2, VREG_V5},
+    [10] = {"v8", 2, VREG_V8},
+    [30] = {"v1", 2, VREG_V1},
+    [40] = {"v4", 2, VREG_V4},
+    [46] = {"v14", 3, VREG_V14},
+    [50] = {"v7", 2, VREG_V7},
+    [52] = {"v12", 3, VREG_V12},
+    [59] = {"v10", 3, VREG_V10},
+    [69] = {"v0", 2, VREG_V0},
+    [79] = {"v3", 2, VREG_V3},
+    [89] = {"v6", 2, VREG_V6},
+    [99] = {"v9", 2, VREG_V9},
+    [107] = {"v15", 3, VREG_V15},
+    [113] = {"v13", 3, VREG_V13},
+    [119] = {"v2", 2, VREG_V2},
+    [120] = {"v11", 3, VREG_V11},
+};
+
+#endif
+
+#endif
\ No newline at end of file
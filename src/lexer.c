@@ -1,37 +1,71 @@
 #include "lexer.h"
+#include "arena.h"
+#include "keywords.h"
+#include "vector.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static const OpcodeEntry opcodeTable[] = {
-    {"nop", OP_NOP},     {"push", OP_PUSH}, {"pop", OP_POP},         {"mov", OP_MOV},
-    {"swap", OP_SWAP},   {"jmp", OP_JMP},   {"ret", OP_RET},         {"jne", OP_JNE},
-    {"je", OP_JE},       {"jg", OP_JG},     {"call", OP_CALL},       {"jge", OP_JGE},
-    {"jl", OP_JL},       {"jle", OP_JLE},   {"add", OP_ADD},         {"sub", OP_SUB},
-    {"cmp", OP_CMP},     {"mul", OP_MUL},   {"div", OP_DIV},         {"mod", OP_MOD},
-    {"neg", OP_NEG},     {"AND", OP_ANDB},  {"OR", OP_ORB},          {"NOT", OP_NOTB},
-    {"XOR", OP_XORB},    {"shl", OP_SHL},   {"shr", OP_SHR},         {"dup", OP_DUP},
-    {"clear", OP_CLR},   {"size", OP_SIZE}, {"print", OP_PRNT},      {"exit", OP_EXIT},
-    {"write", OP_WRITE}, {"read", OP_READ}, {"syscall", OP_SYSCALL}, {"null", OP_UNKNOWN},
+#ifdef LXR_PARALLEL
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// character classes for the scanner, so each character costs one table lookup
+#define CC_ALPHA 0x01
+#define CC_DIGIT 0x02
+#define CC_SPACE 0x04 // anything isspace accepts
+
+static const uint8_t charClass[256] = {
+    ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE, ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE, [' '] = CC_SPACE,   ['0' ... '9'] = CC_DIGIT,
+    ['A' ... 'Z'] = CC_ALPHA,               ['a' ... 'z'] = CC_ALPHA,
 };
 
-Opcode OpcodeFromKeyword(char* keyword) {
-    for (int i = 0; opcodeTable[i].opcode != OP_UNKNOWN; i++)
-        if (strcmp(opcodeTable[i].keyword, keyword) == 0)
-            return opcodeTable[i].opcode;
+#define CHAR_CLASS(c) charClass[(uint8_t)(c)]
 
-    return OP_UNKNOWN; // if the keyword doesn't match any known opcode
+Opcode LookupOpcode(const char* word, size_t length) {
+    const Keyword* keyword = KeywordLookup(opcodeKeywords, OPCODE_KEYWORD_SEED, word, length);
+
+    return (keyword != NULL) ? keyword->value : OP_UNKNOWN;
 }
 
-int LabelIndex(Lexer* lexer, char* name) {
-    for (int i = 0; i < lexer->numLabels; i++) {
-        if (strcmp(lexer->labels[i].name, name) == 0) {
-            return lexer->labels[i].index;
-        }
+Opcode OpcodeFromKeyword(char* keyword) { return LookupOpcode(keyword, strlen(keyword)); }
+
+// FNV-1a
+static uint32_t LabelHash(const char* name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+
+    return hash;
+}
+
+// slot holding the label called 'name', or the empty slot it would go in
+static uint32_t* FindLabelSlot(Lexer* lexer, const char* name, size_t length) {
+    uint32_t mask = lexer->labelSlotsCapacity - 1;
+    uint32_t slot = LabelHash(name, length) & mask;
+
+    while (lexer->labelSlots[slot] != 0) {
+        Label* label = &lexer->labels[lexer->labelSlots[slot] - 1];
+        if (label->nameLen == length && memcmp(label->name, name, length) == 0)
+            break;
+
+        slot = (slot + 1) & mask;
     }
-    return -1;
+
+    return &lexer->labelSlots[slot];
+}
+
+int LabelIndex(Lexer* lexer, const char* name) {
+    if (lexer->numLabels == 0)
+        return -1;
+
+    uint32_t slot = *FindLabelSlot(lexer, name, strlen(name));
+    return (slot != 0) ? lexer->labels[slot - 1].index : -1;
 }
 
 char* GetLine(Lexer* lexer) {
@@ -44,48 +78,54 @@ char* GetLine(Lexer* lexer) {
     while (lexer->text[end] != '\n' && lexer->text[end] != '\0')
         end++;
 
-    long lineLength = end - start;
-    char* line = malloc((lineLength + 1) * sizeof(char));
-    if (line == NULL)
-        return "";
-
-    strncpy(line, &lexer->text[start], lineLength);
-    line[lineLength] = '\0';
-
-    return line;
+    return ArenaCopy(&lexer->arena, &lexer->text[start], end - start);
 }
 
 #ifndef USING_ARDUINO
 
-char* ReadFromFile(char* path, int* stringLength) {
+char* ReadTextFile(const char* path, long* length) {
     FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file. Path: %s\n", path);
-        exit(1);
-    }
+    if (file == NULL)
+        return NULL;
 
     fseek(file, 0, SEEK_END);
-    long length = ftell(file);
+    *length = ftell(file);
     fseek(file, 0, SEEK_SET);
 
-    char* buffer = malloc(length + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Buffer allocation error for file contents.\n");
-        exit(1);
+    char* buffer = (*length >= 0) ? malloc(*length + 1) : NULL;
+    if (buffer == NULL || fread(buffer, 1, *length, file) != (size_t)*length) {
+        free(buffer);
+        fclose(file);
+        return NULL;
     }
 
-    fread(buffer, sizeof(char), length / sizeof(char), file);
     fclose(file);
+    buffer[*length] = '\0';
 
-    buffer[length] = '\0';
-    *stringLength = length;
+    return buffer;
+}
+
+char* ReadFromFile(char* path, int* stringLength) {
+    long length = 0;
+    char* buffer = ReadTextFile(path, &length);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error opening file. Path: %s\n", path);
+        exit(1);
+    }
 
+    *stringLength = length;
     return buffer;
 }
 
 #endif
 
 int OperandsExpected(Opcode op) {
+#ifndef USING_ARDUINO
+    // vector instructions always name two registers
+    if (IS_VECTOR_OPCODE(op))
+        return 2;
+#endif
+
     switch (op) {
     // operations that require 2 opands
     case OP_SUB:
@@ -93,6 +133,8 @@ int OperandsExpected(Opcode op) {
     case OP_MUL:
     case OP_MOD:
     case OP_MOV:
+    case OP_LOADB:
+    case OP_LOADF:
     case OP_CMP:
     case OP_DIV:
         return 2;
@@ -119,43 +161,43 @@ int OperandsExpected(Opcode op) {
     return -1;
 }
 
-void SyntaxError(Lexer* lexer, char* optMsg) {
+// format an error at the current position with the offending line underlined. with a
+// trap the text is left in lexer->error and the lexer jumps there, otherwise it is
+// printed and the process ends with 'code'
+static void LexerError(Lexer* lexer, Error code, const char* kind, const char* optMsg,
+                       const char* suffix) {
     char* line = GetLine(lexer);
-    fprintf(stderr, "%s:%ld:%ld: syntax error", lexer->filePath, lexer->lineNumber,
-            lexer->charIndex);
+    size_t lineLen = strlen(line);
 
-    if (optMsg) // include optional error message
-        fprintf(stderr, " - %s", optMsg);
+    int header = snprintf(NULL, 0, "%s:%ld:%ld: %s%s%s\n\t%s\n\t", lexer->filePath,
+                          lexer->lineNumber, lexer->charIndex, kind, optMsg ? " - " : "",
+                          optMsg ? optMsg : "", line);
+    size_t size = header + lineLen + strlen(suffix) + 1;
 
-    fprintf(stderr, "\n\t%s\n\t", line);
+    char* text = ArenaAlloc(&lexer->arena, size);
+    snprintf(text, size, "%s:%ld:%ld: %s%s%s\n\t%s\n\t", lexer->filePath, lexer->lineNumber,
+             lexer->charIndex, kind, optMsg ? " - " : "", optMsg ? optMsg : "", line);
 
-    // print a ^ underneath the bad line
-    for (size_t i = 0; i < strlen(line); i++)
-        fprintf(stderr, "^");
+    // a ^ underneath the bad line
+    memset(text + header, '^', lineLen);
+    strcpy(text + header + lineLen, suffix);
 
-    fprintf(stderr, " here\n");
+    if (lexer->trap != NULL) {
+        lexer->error = text;
+        lexer->errorCode = code;
+        longjmp(*lexer->trap, 1);
+    }
 
-    free(line);
-    exit(ERR_INVALID_SYNTAX);
+    fputs(text, stderr);
+    exit(code);
 }
 
-void TypeError(Lexer* lexer, char* optMsg) {
-    char* line = GetLine(lexer);
-    fprintf(stderr, "%s:%ld:%ld: type error", lexer->filePath, lexer->lineNumber, lexer->charIndex);
-
-    if (optMsg) // include optional error message
-        fprintf(stderr, " - %s", optMsg);
-
-    fprintf(stderr, "\n\t%s\n\t", line);
-
-    // print a ^ underneath the bad line
-    for (size_t i = 0; i < strlen(line); i++)
-        fprintf(stderr, "^");
-
-    fprintf(stderr, "\n");
+void SyntaxError(Lexer* lexer, char* optMsg) {
+    LexerError(lexer, ERR_INVALID_SYNTAX, "syntax error", optMsg, " here\n");
+}
 
-    free(line);
-    exit(ERR_TYPE_ERROR);
+void TypeError(Lexer* lexer, char* optMsg) {
+    LexerError(lexer, ERR_TYPE_ERROR, "type error", optMsg, "\n");
 }
 
 void ToOperandType(Operand* operands, int index, char* operand) {
@@ -167,8 +209,7 @@ void ToOperandType(Operand* operands, int index, char* operand) {
     }
 
     if (IsFloat(operand) == TRUE) {
-        char* endptr;
-        double asFloat = strtod(operand, endptr);
+        double asFloat = strtod(operand, NULL);
         operands[index].data.f64 = asFloat;
         operands[index].type = TY_F64;
         return;
@@ -185,28 +226,246 @@ void ToOperandType(Operand* operands, int index, char* operand) {
     }
 }
 
-// 'keyword' and 'operand' will both be free'd and put into Token::text
-Token NewToken(Opcode operation, char* keyword, Operand* operands, Lexer* lexer) {
-    int textLen = 1024;
+Data DecodeImmediate(const char* text) {
+    if (text[0] == LXR_CONSTANT_PREFIX)
+        text++;
+
+    if (IsFloat(text) == TRUE)
+        return DATA_USING_F64(strtod(text, NULL));
+
+    return DATA_USING_I64(strtol(text, NULL, 10));
+}
+
+// make room for at least 'needed' elements of 'size' bytes, doubling the capacity
+static void* GrowArray(void* array, uint32_t* capacity, uint32_t needed, size_t size,
+                       const char* name) {
+    if (needed <= *capacity)
+        return array;
+
+    uint32_t grown = (*capacity == 0) ? 64 : *capacity;
+    while (grown < needed)
+        grown *= 2;
+
+    array = realloc(array, grown * size);
+    if (array == NULL) {
+        fprintf(stderr, "Buffer allocation error for %s.\n", name);
+        exit(1);
+    }
+
+    *capacity = grown;
+    return array;
+}
+
+static uint32_t AddConstant(Lexer* lexer, DataCell value) {
+    lexer->constants = GrowArray(lexer->constants, &lexer->constantsCapacity,
+                                 lexer->numConstants + 1, sizeof(DataCell), "constant pool");
+    lexer->constants[lexer->numConstants] = value;
+
+    return lexer->numConstants++;
+}
+
+void EncodeImmediate(Lexer* lexer, Instruction* inst, Data value) {
+    if (value.type == TY_F64) {
+        inst->kind = OPND_F64;
+        inst->index = AddConstant(lexer, value.data);
+    } else if (value.data.i64 >= INT32_MIN && value.data.i64 <= INT32_MAX) {
+        inst->kind = OPND_I64;
+        inst->imm = value.data.i64;
+    } else {
+        inst->kind = OPND_WIDE;
+        inst->index = AddConstant(lexer, value.data);
+    }
+}
+
+// copy the inside of a literal to 'out' with its escapes resolved. an escape
+// that is not known is kept as written. returns the bytes written
+static uint32_t ResolveEscapes(char* out, const char* literal, size_t length) {
+    uint32_t written = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        char c = literal[i];
+
+        if (c == LXR_ESCAPE_CHAR && i + 1 < length) {
+            switch (literal[++i]) {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'a':
+                c = '\a';
+                break;
+            case 'v':
+                c = '\v';
+                break;
+            case '\\':
+            case '\'':
+            case '\"':
+                c = literal[i];
+                break;
+            default:
+                out[written++] = LXR_ESCAPE_CHAR;
+                c = literal[i];
+            }
+        }
+
+        out[written++] = c;
+    }
+
+    return written;
+}
+
+uint32_t AddString(Lexer* lexer, const char* text) {
+    size_t literal = strlen(text);
+    if (literal >= 2)
+        literal -= 2; // quotes
+
+    // resolving escapes only ever makes the string shorter
+    uint32_t needed = STRING_POOL_ALIGN(sizeof(uint32_t) + literal + 1);
+    lexer->strings = GrowArray(lexer->strings, &lexer->stringsCapacity,
+                               lexer->stringsSize + needed, 1, "string pool");
+
+    char* start = lexer->strings + lexer->stringsSize;
+    uint32_t length = ResolveEscapes(start + sizeof(uint32_t), text + 1, literal);
+    uint32_t size = STRING_POOL_ALIGN(sizeof(uint32_t) + length + 1);
+
+    memcpy(start, &length, sizeof(length));
+    memset(start + sizeof(uint32_t) + length, 0, size - sizeof(uint32_t) - length);
+
+    uint32_t offset = lexer->stringsSize + sizeof(uint32_t);
+    lexer->stringsSize += size;
+
+    return offset;
+}
 
+// 'text' is the statement exactly as written and is copied into Token::text
+Token NewToken(const char* text, size_t textLength, Lexer* lexer) {
     Token t = {0};
     t.line = lexer->lineNumber;
     t.filepath = lexer->filePath;
-    t.text = malloc(sizeof(char) * textLen);
+    t.text = ArenaCopy(&lexer->arena, text, textLength);
+
+    return t;
+}
+
+// read the register named at 'at' inside a memory operand and the spaces after it
+static Register MemoryRegister(Lexer* lexer, const char** at) {
+    while (isblank(**at))
+        (*at)++;
+
+    const char* name = *at;
+    while (isalnum(**at))
+        (*at)++;
+
+    const Keyword* keyword =
+        KeywordLookup(registerKeywords, REGISTER_KEYWORD_SEED, name, *at - name);
+    if (keyword == NULL)
+        SyntaxError(lexer, "invalid register in memory operand");
+
+    while (isblank(**at))
+        (*at)++;
+    return keyword->value;
+}
+
+void EncodeMemoryOperand(Lexer* lexer, Instruction* inst, const char* text) {
+    const char* at = text + 1; // after the [
+    inst->src = MemoryRegister(lexer, &at);
+    inst->kind = OPND_MEM;
+    inst->imm = 0;
+
+    if (*at == '+' || *at == LXR_SIGNED_INT) {
+        char sign = *at++;
+        while (isblank(*at))
+            at++;
+
+        if (isdigit(*at)) {
+            char* end;
+            long offset = strtol(at, &end, 10);
+            if (offset > INT32_MAX)
+                SyntaxError(lexer, "offset in memory operand does not fit in 32 bits");
+
+            inst->imm = (sign == LXR_SIGNED_INT) ? -offset : offset;
+            at = end;
+        } else {
+            if (sign == LXR_SIGNED_INT)
+                SyntaxError(lexer, "an index register can only be added");
+
+            Register index = MemoryRegister(lexer, &at);
+            uint32_t shift = 0;
+            if (*at == '*') {
+                at++;
+                while (isblank(*at))
+                    at++;
+
+                long scale = isdigit(*at) ? strtol(at, (char**)&at, 10) : 0;
+                if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+                    SyntaxError(lexer, "scale in memory operand must be 1, 2, 4 or 8");
+                shift = (scale == 8) ? 3 : (scale == 4) ? 2 : (scale == 2) ? 1 : 0;
+            }
 
-    Instruction i = {};
+            inst->kind = OPND_MEM_INDEX;
+            inst->index = MEM_INDEX(index, shift);
+        }
+
+        while (isblank(*at))
+            at++;
+    }
+
+    if (*at != LXR_MEM_END)
+        SyntaxError(lexer, "expected [reg], [reg+imm] or [reg+reg*scale]");
+}
+
+static BOOL IsMemoryOperand(const Operand* operand) {
+    return operand->type == TY_STR && ((char*)operand->data.ptr)[0] == LXR_MEM_START;
+}
+
+// a mov, movb or movf with a memory operand becomes the load or store of its width
+static void EncodeMemoryAccess(Lexer* lexer, Instruction* inst, Operand* operands) {
+    BOOL load = IsMemoryOperand(&operands[0]);
+    BOOL store = IsMemoryOperand(&operands[1]);
+    if (load == store)
+        SyntaxError(lexer, load == TRUE ? "only one operand can be in memory"
+                                        : "expected a memory operand");
+
+    const Operand* value = &operands[load == TRUE ? 1 : 0];
+    if (value->type != TY_I64)
+        SyntaxError(lexer, "a load or store needs a register");
+
+    // mov, movb and movf load in the order OP_LOAD, OP_LOADB, OP_LOADF, stores likewise
+    uint8_t width = (inst->operation == OP_MOV) ? 0 : inst->operation - OP_LOAD;
+    inst->operation = (load == TRUE ? OP_LOAD : OP_STORE) + width;
+    inst->dest = value->data.i64;
+    EncodeMemoryOperand(lexer, inst, operands[load == TRUE ? 0 : 1].data.ptr);
+}
+
+Instruction NewInstruction(Opcode operation, Operand* operands, Lexer* lexer) {
+    Instruction i = {0};
     i.operation = operation;
 
     switch (OperandsExpected(operation)) {
     case 2:
+        if (IsMoveOpcode(operation) == TRUE &&
+            (operation != OP_MOV || IsMemoryOperand(&operands[0]) == TRUE ||
+             IsMemoryOperand(&operands[1]) == TRUE)) {
+            EncodeMemoryAccess(lexer, &i, operands);
+            break;
+        }
+
         if (operation == OP_MOV || IsArithneticOpcode(operation) == TRUE || operation == OP_CMP) {
             if (operands[0].type == TY_STR &&
                 ((char*)operands[0].data.ptr)[0] == LXR_CONSTANT_PREFIX) {
-                i.data.value.data.ptr = operands[0].data.ptr;
-                i.data.registers.dest = operands[1].data.i64;
-                snprintf(t.text, textLen, "%s %s, %s", keyword, (char*)operands[0].data.ptr,
-                         GetRegisterName(i.data.registers.dest));
-
+                EncodeImmediate(lexer, &i, DecodeImmediate((char*)operands[0].data.ptr));
+                i.dest = operands[1].data.i64;
                 break;
             }
         }
@@ -216,50 +475,44 @@ Token NewToken(Opcode operation, char* keyword, Operand* operands, Lexer* lexer)
             (operands[0].type != TY_I64 || operands[1].type != TY_I64))
             TypeError(lexer, "expected I64 operand");
 
-        i.data.value.data.i64 = operands[0].data.i64;
-        i.data.value.type = operands[0].type;
-
-        i.data.registers.src = operands[0].data.i64;
-        i.data.registers.dest = operands[1].data.i64;
-        snprintf(t.text, textLen, "%s %s, %s", keyword, GetRegisterName(i.data.registers.src),
-                 GetRegisterName(i.data.registers.dest));
+        i.kind = OPND_REG;
+        i.src = operands[0].data.i64;
+        i.dest = operands[1].data.i64;
         break;
     case 1:
         if (i.operation == OP_PUSH && operands[0].type == TY_STR &&
             GetRegisterFromName((char*)operands[0].data.ptr) != REG_UNKNOWN) {
             // operand is a register
-            snprintf(t.text, textLen, "%s %s", keyword, (char*)operands[0].data.ptr);
-            i.data.value.data.i64 = operands[0].data.i64;
-            i.data.value.type = TY_STR;
+            i.kind = OPND_REG;
+            i.src = GetRegisterFromName((char*)operands[0].data.ptr);
             break;
         }
 
-        i.data.value = operands[0];
-
-        if (operands[0].type == TY_STR)
-            snprintf(t.text, textLen, "%s \"%s\"", keyword, (char*)i.data.value.data.ptr);
-        else if (operands[0].type == TY_I64 || operands[0].type == TY_U64)
-            snprintf(t.text, textLen, "%s %ld", keyword, i.data.value.data.i64);
+        if (IsJumpOpcode(operation) == TRUE) {
+            i.kind = OPND_LABEL;
+            i.index = operands[0].data.i64;
+        } else if (operands[0].type == TY_STR) {
+            // strings live in the string pool, the instruction only keeps the offset
+            i.kind = OPND_STR;
+            i.index = AddString(lexer, operands[0].data.ptr);
+        } else
+            EncodeImmediate(lexer, &i, operands[0]);
 
         break;
     case 0:
         // pop can have an optional operand
         if (i.operation == OP_POP && operands[0].type == TY_STR) {
-            snprintf(t.text, textLen, "%s %s", keyword, (char*)operands[0].data.ptr);
-            i.data.registers.dest = GetRegisterFromName((char*)operands[0].data.ptr);
+            i.kind = OPND_REG;
+            i.dest = GetRegisterFromName((char*)operands[0].data.ptr);
             break;
         }
 
-        snprintf(t.text, textLen, "%s", keyword);
         break;
     default:
         SyntaxError(lexer, "incorrect number of operands");
     }
 
-    t.inst = i;
-
-    free(keyword);
-    return t;
+    return i;
 }
 
 void PrintToken(Token* token) { printf("%06d: %s\n", token->line, token->text); }
@@ -276,15 +529,36 @@ BOOL IsArithneticOpcode(Opcode opcode) {
     return FALSE;
 }
 
+BOOL IsMoveOpcode(Opcode opcode) {
+    return opcode == OP_MOV || opcode == OP_LOADB || opcode == OP_LOADF;
+}
+
+BOOL IsJumpOpcode(Opcode opcode) {
+    switch (opcode) {
+    case OP_CALL:
+    case OP_JMP:
+    case OP_JE:
+    case OP_JG:
+    case OP_JGE:
+    case OP_JL:
+    case OP_JLE:
+    case OP_JNE:
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// copy the text scanned since 'start' into the lexer arena
+static char* ScannedText(Lexer* lexer, long start) {
+    return ArenaCopy(&lexer->arena, &lexer->text[start], lexer->charIndex - start);
+}
+
 char* ParseNumber(Lexer* lexer, Opcode opcode) {
-    char* operand = malloc(MAX_OPERAND_LEN * sizeof(char));
-    int operandIndex = 0;
+    long start = lexer->charIndex;
 
     if (lexer->text[lexer->charIndex] == LXR_CONSTANT_PREFIX &&
-        (opcode == OP_CMP || opcode == OP_MOV || IsArithneticOpcode(opcode) == TRUE)) {
-        operand[operandIndex++] = LXR_CONSTANT_PREFIX;
+        (opcode == OP_CMP || opcode == OP_MOV || IsArithneticOpcode(opcode) == TRUE))
         lexer->charIndex++;
-    }
 
     BOOL dotFound = FALSE;
     BOOL isSigned = FALSE;
@@ -306,47 +580,61 @@ char* ParseNumber(Lexer* lexer, Opcode opcode) {
                 isSigned = TRUE;
         }
 
-        operand[operandIndex] = lexer->text[lexer->charIndex];
-        operandIndex++;
         lexer->charIndex++;
     }
 
+    char* operand = ScannedText(lexer, start);
+
     if (lexer->text[lexer->charIndex] == LXR_OPRND_BRK) {
         lexer->charIndex++;
         SkipSpaces(lexer);
     }
 
-    operand[operandIndex] = '\0';
     return operand;
 }
 
 char* ParseOperand(Lexer* lexer, Opcode opcode) {
-    if (opcode == OP_SHL || opcode == OP_SHR) {
-        char* operand = malloc(MAX_OPERAND_LEN * sizeof(char));
-        int operandIndex = 0;
+    long start = lexer->charIndex;
 
-        while (isdigit(lexer->text[lexer->charIndex])) {
-            operand[operandIndex] = lexer->text[lexer->charIndex];
-            operandIndex++;
+    if (opcode == OP_SHL || opcode == OP_SHR) {
+        while (isdigit(lexer->text[lexer->charIndex]))
             lexer->charIndex++;
-        }
 
-        operand[operandIndex] = '\0';
-        return operand;
+        return ScannedText(lexer, start);
     }
 
     if (lexer->text[lexer->charIndex] == LXR_CONSTANT_PREFIX &&
         (opcode == OP_CMP || opcode == OP_MOV || IsArithneticOpcode(opcode) == TRUE))
         return ParseNumber(lexer, opcode);
 
-    if (opcode == OP_MOV || IsArithneticOpcode(opcode) == TRUE || opcode == OP_CMP) {
-        char* reg = malloc(12 * sizeof(char));
-        int regStrIndex = 0;
-        while (isdigit(lexer->text[lexer->charIndex]) || isalpha(lexer->text[lexer->charIndex])) {
-            reg[regStrIndex++] = lexer->text[lexer->charIndex++];
-        }
+    // memory operand, e.g [rax+8], decoded by EncodeMemoryOperand
+    if (lexer->text[lexer->charIndex] == LXR_MEM_START && IsMoveOpcode(opcode) == TRUE) {
+        while (lexer->text[lexer->charIndex] != LXR_MEM_END &&
+               lexer->text[lexer->charIndex] != '\0' && lexer->text[lexer->charIndex] != '\n')
+            lexer->charIndex++;
+
+        if (lexer->text[lexer->charIndex] != LXR_MEM_END)
+            SyntaxError(lexer, "missing ] after memory operand");
+
+        lexer->charIndex++;
+        return ScannedText(lexer, start);
+    }
+
+#ifndef USING_ARDUINO
+    // checked against the vector or scalar register names by ParseOperands
+    if (IS_VECTOR_OPCODE(opcode)) {
+        while (isalnum(lexer->text[lexer->charIndex]))
+            lexer->charIndex++;
+
+        return ScannedText(lexer, start);
+    }
+#endif
 
-        reg[regStrIndex] = '\0';
+    if (IsMoveOpcode(opcode) == TRUE || IsArithneticOpcode(opcode) == TRUE || opcode == OP_CMP) {
+        while (isdigit(lexer->text[lexer->charIndex]) || isalpha(lexer->text[lexer->charIndex]))
+            lexer->charIndex++;
+
+        char* reg = ScannedText(lexer, start);
         if (GetRegisterFromName(reg) == REG_UNKNOWN) {
             char buff[35] = {0};
             snprintf(buff, sizeof(reg) + 23, "invalid register '%s'", reg);
@@ -357,19 +645,14 @@ char* ParseOperand(Lexer* lexer, Opcode opcode) {
     } else if (lexer->text[lexer->charIndex] == LXR_LABEL_START &&
                (opcode == OP_CALL || opcode == OP_JMP || opcode == OP_JE || opcode == OP_JG ||
                 opcode == OP_JGE || opcode == OP_JL || opcode == OP_JLE || opcode == OP_JNE)) {
-        lexer->charIndex++;
-        char* labelName = malloc(MAX_LABEL_LEN * sizeof(char));
-        int labelNameIndex = 0;
+        start = ++lexer->charIndex; // name starts after the label start
 
         while (!isspace(lexer->text[lexer->charIndex]) && lexer->text[lexer->charIndex] != '\0' &&
                lexer->text[lexer->charIndex] != LXR_LABEL_END &&
-               lexer->text[lexer->charIndex] != '\n') {
-            labelName[labelNameIndex] = lexer->text[lexer->charIndex];
-            labelNameIndex++;
+               lexer->text[lexer->charIndex] != '\n')
             lexer->charIndex++;
-        }
-        labelName[labelNameIndex] = '\0';
-        return labelName;
+
+        return ScannedText(lexer, start);
     }
 
     // check if operand
@@ -381,54 +664,37 @@ char* ParseOperand(Lexer* lexer, Opcode opcode) {
     }
 
     if (opcode == OP_PUSH && lexer->text[lexer->charIndex] == LXR_STR_CHAR) {
-        int stringChars = 1;
-        char* string = malloc((STACK_CAPACITY / 4) * sizeof(char));
-        int stringIndex = 0;
-        string[stringIndex++] = LXR_STR_CHAR; // set first character to string
-
         lexer->charIndex++;
 
-        // iterate until next string character
-        while (lexer->text[lexer->charIndex] != '\0') {
-            if (lexer->text[lexer->charIndex] == LXR_STR_CHAR) {
-                stringChars++;
-                if (stringChars % 2 == 0) {
-                    lexer->charIndex++; // Closing quotation mark
-                    break;
-                }
-            } else
-                string[stringIndex++] = lexer->text[lexer->charIndex];
+        // iterate until next string character that is not escaped
+        while (lexer->text[lexer->charIndex] != '\0' &&
+               lexer->text[lexer->charIndex] != LXR_STR_CHAR) {
+            if (lexer->text[lexer->charIndex] == LXR_ESCAPE_CHAR &&
+                lexer->text[lexer->charIndex + 1] != '\0' &&
+                lexer->text[lexer->charIndex + 1] != '\n')
+                lexer->charIndex++;
             lexer->charIndex++;
         }
 
-        // add null terminator and string at the end
-        string[stringIndex++] = LXR_STR_CHAR;
-        string[stringIndex] = '\0';
-
         // strings in pairs
-        if (stringChars % 2 != 0) {
-            free(string);
+        if (lexer->text[lexer->charIndex] != LXR_STR_CHAR)
             SyntaxError(lexer, "missing quotation mark");
-        }
-        return string;
+
+        lexer->charIndex++; // Closing quotation mark
+
+        // keeps both quotation marks, like the source
+        return ScannedText(lexer, start);
     }
 
     if (((opcode == OP_PUSH || opcode == OP_POP) && !isdigit(lexer->text[lexer->charIndex]) &&
          lexer->text[lexer->charIndex] != LXR_SIGNED_INT)) {
-        char* reg = malloc(12 * sizeof(char));
-        int regStrIndex = 0;
         while (!isblank(lexer->text[lexer->charIndex]) &&
-               (isalpha(lexer->text[lexer->charIndex]) || isdigit(lexer->text[lexer->charIndex]))) {
-            reg[regStrIndex++] = lexer->text[lexer->charIndex++];
-        }
-        reg[regStrIndex] = '\0';
+               (isalpha(lexer->text[lexer->charIndex]) || isdigit(lexer->text[lexer->charIndex])))
+            lexer->charIndex++;
 
-        return reg;
+        return ScannedText(lexer, start);
     }
 
-    int operandLen = 0;
-    char* operand = malloc(sizeof(char) * 21);
-
     BOOL dotFound = FALSE;
     BOOL isSigned = FALSE;
 
@@ -449,18 +715,13 @@ char* ParseOperand(Lexer* lexer, Opcode opcode) {
                 isSigned = TRUE;
         }
 
-        operand[operandLen] = lexer->text[lexer->charIndex];
-        operandLen++;
         lexer->charIndex++;
     }
 
-    operand[operandLen] = '\0';
-    if (operandLen == 0) {
-        free(operand);
+    if (lexer->charIndex == start)
         return NULL;
-    }
 
-    return operand;
+    return ScannedText(lexer, start);
 }
 
 void ParseOperands(Lexer* lexer, Opcode opcode, Operand* operands) {
@@ -501,6 +762,12 @@ void ParseOperands(Lexer* lexer, Opcode opcode, Operand* operands) {
         if (operand == NULL)
             SyntaxError(lexer, "missing operand");
 
+        if (operand[0] == LXR_MEM_START) {
+            operands[opIndex].data.ptr = operand;
+            operands[opIndex].type = TY_STR;
+            continue;
+        }
+
         if ((opcode == OP_CMP || opcode == OP_MOV || IsArithneticOpcode(opcode) == TRUE) &&
             operand[0] == LXR_CONSTANT_PREFIX) {
             operands[0].data.ptr = operand;
@@ -511,16 +778,34 @@ void ParseOperands(Lexer* lexer, Opcode opcode, Operand* operands) {
 
         if (opcode == OP_CALL || opcode == OP_JMP || opcode == OP_JE || opcode == OP_JG ||
             opcode == OP_JGE || opcode == OP_JL || opcode == OP_JLE || opcode == OP_JNE) {
-            if (LabelIndex(lexer, operand) != -1) {
-                operands[0].data.i64 = LabelIndex(lexer, operand);
-                operands[0].type = TY_I64;
-                CheckOperandSyntax(lexer, opcode, operand);
-                return;
+            operands[0].data.i64 = LabelIndex(lexer, operand);
+            operands[0].type = TY_I64;
+            CheckOperandSyntax(lexer, opcode, operand);
+
+            // declared further down, patched after the whole file is read
+            if (operands[0].data.i64 == -1) {
+                lexer->fixups = GrowArray(lexer->fixups, &lexer->fixupsCapacity,
+                                          lexer->numFixups + 1, sizeof(LabelFixup), "labels");
+                lexer->fixups[lexer->numFixups++] = (LabelFixup){
+                    operand, lexer->numTokens, lexer->charIndex, lexer->lineNumber};
             }
-            SyntaxError(lexer,
-                        "unknown jump label. (implicit declaration not supported currently)");
+            return;
         }
 
+#ifndef USING_ARDUINO
+        if (IS_VECTOR_OPCODE(opcode)) {
+            BOOL scalar = IsScalarVectorOperand(opcode, opIndex);
+            int reg = scalar ? (int)GetRegisterFromName(operand)
+                             : (int)GetVectorRegisterFromName(operand);
+            if (reg == REG_UNKNOWN)
+                SyntaxError(lexer, scalar ? "expected a register" : "expected a vector register");
+
+            operands[opIndex].data.i64 = reg;
+            operands[opIndex].type = TY_I64;
+            continue;
+        }
+#endif
+
         ToOperandType(operands, opIndex, operand);
 
         // Check the syntax of the operand
@@ -551,161 +836,434 @@ void SkipSpaces(Lexer* lexer) {
 
 char CurrentChar(Lexer* lexer) { return lexer->text[lexer->charIndex]; }
 
-BOOL UniqueLabelName(Label* label, Lexer* lexer) {
-    for (unsigned int i = 0; i < lexer->numLabels; i++) {
-        if (strcmp(label->name, lexer->labels[i].name) == 0)
-            return FALSE;
+// keep the label table at most half full, so probes stay short
+static void GrowLabelSlots(Lexer* lexer) {
+    if ((lexer->numLabels + 1) * 2 <= lexer->labelSlotsCapacity)
+        return;
+
+    free(lexer->labelSlots);
+    lexer->labelSlotsCapacity =
+        (lexer->labelSlotsCapacity == 0) ? 64 : lexer->labelSlotsCapacity * 2;
+    lexer->labelSlots = calloc(lexer->labelSlotsCapacity, sizeof(uint32_t));
+    if (lexer->labelSlots == NULL) {
+        fprintf(stderr, "Buffer allocation error for labels.\n");
+        exit(1);
     }
-    return TRUE;
+
+    for (uint32_t i = 0; i < lexer->numLabels; i++)
+        *FindLabelSlot(lexer, lexer->labels[i].name, lexer->labels[i].nameLen) = i + 1;
 }
 
-#ifdef USING_ARDUINO
-Lexer ParseTokens(char* text) {
-    char* path = "";
-    unsigned int tl = strlen(text);
-#elif !defined(USING_ARDUINO)
-Lexer ParseTokens(char* path) {
-    // Open file and load its contents
-    unsigned int tl = 0;
-    char* text = ReadFromFile(path, &tl);
-#endif
+// point every jump to a label declared after it at the label
+static void ResolveFixups(Lexer* lexer) {
+    for (uint32_t i = 0; i < lexer->numFixups; i++) {
+        LabelFixup* fixup = &lexer->fixups[i];
+        int index = LabelIndex(lexer, fixup->name);
+
+        if (index == -1) {
+            char buff[64] = {0};
+            snprintf(buff, sizeof(buff), "unknown jump label '%s'", fixup->name);
+            lexer->charIndex = fixup->charIndex;
+            lexer->lineNumber = fixup->lineNumber;
+            SyntaxError(lexer, buff);
+        }
+
+        lexer->program[fixup->inst].index = index;
+    }
+}
 
-    // Create lexxer struct from known variables
-    Lexer lexer = {
-        .state = PARSE, .lineNumber = 1, .filePath = path, .text = text, .textLength = tl};
+// append a parsed statement, tokens and program always grow together
+static void AddStatement(Lexer* lexer, Token token, Instruction inst) {
+    if (lexer->numTokens == lexer->tokensCapacity) {
+        uint32_t capacity = lexer->tokensCapacity;
+        lexer->tokens =
+            GrowArray(lexer->tokens, &capacity, lexer->numTokens + 1, sizeof(Token), "tokens");
+        lexer->program = GrowArray(lexer->program, &lexer->tokensCapacity, lexer->numTokens + 1,
+                                   sizeof(Instruction), "program");
+    }
 
-    char keyword[MAX_KEYWORD_LEN] = {0};
-    unsigned int index = 0;
+    lexer->tokens[lexer->numTokens] = token;
+    lexer->program[lexer->numTokens++] = inst;
+}
 
-    Label currLabel = {0};
+void SkipLine(Lexer* lexer) {
+    while (lexer->text[lexer->charIndex] != '\n' && lexer->text[lexer->charIndex] != '\0')
+        lexer->charIndex++;
+}
 
-    while (lexer.charIndex <= lexer.textLength && lexer.numTokens <= MAX_PROGRAM_SIZE) {
-        if (lexer.state == SKIP_SPACES) {
-            if (isblank(lexer.text[lexer.charIndex])) {
-                lexer.charIndex++;
-                continue;
-            }
-            lexer.state = PARSE;
-        }
+void ParseLabel(Lexer* lexer) {
+    long start = ++lexer->charIndex; // name starts after the label start
+    while (CHAR_CLASS(lexer->text[lexer->charIndex]) & CC_ALPHA)
+        lexer->charIndex++;
 
-        if (lexer.text[lexer.charIndex] == LXR_LABEL_START && lexer.state != SKIP_LINE &&
-            (lexer.state != PARSE_KWD || lexer.state != PARSE_OPND)) {
-            if (lexer.state == PARSE_LABEL) // theres another underscore?
-                SyntaxError(&lexer, "unrecognized label token");
+    if (lexer->text[lexer->charIndex] != LXR_LABEL_END)
+        SyntaxError(lexer, "unrecognized label token");
 
-            memset(&currLabel, 0, sizeof(Label));
-            currLabel.index = lexer.numTokens;
-            lexer.state = PARSE_LABEL;
-            lexer.charIndex++;
-        }
+    if (lexer->charIndex == start)
+        SyntaxError(lexer, "unnamed label");
+
+    GrowLabelSlots(lexer);
+
+    uint32_t* slot = FindLabelSlot(lexer, &lexer->text[start], lexer->charIndex - start);
+    if (*slot != 0)
+        SyntaxError(lexer, "duplicate label name");
+
+    Label label = {.name = ScannedText(lexer, start),
+                   .nameLen = lexer->charIndex - start,
+                   .index = lexer->numTokens};
 
-        // is comment
-        if (lexer.text[lexer.charIndex] == LXR_COMMENT && lexer.state != SKIP_LINE) {
-            lexer.state = SKIP_LINE;
-            lexer.charIndex++;
+    lexer->labels = GrowArray(lexer->labels, &lexer->labelsCapacity, lexer->numLabels + 1,
+                              sizeof(Label), "labels");
+    lexer->labels[lexer->numLabels++] = label;
+    *slot = lexer->numLabels;
+    lexer->charIndex++; // label end
+}
+
+void FreeLexer(Lexer* lexer) {
+    ArenaFree(&lexer->arena);
+    free(lexer->tokens);
+    free(lexer->program);
+    free(lexer->labels);
+    free(lexer->labelSlots);
+    free(lexer->fixups);
+    free(lexer->constants);
+    free(lexer->strings);
+#ifndef USING_ARDUINO
+    free(lexer->text); // read by ParseTokens, on arduino the caller owns it
+#endif
+
+    memset(lexer, 0, sizeof(Lexer));
+}
+
+// lex every statement from lexer->charIndex up to lexer->textLength
+static void LexText(Lexer* lexer) {
+    while (lexer->charIndex < lexer->textLength) {
+        char c = lexer->text[lexer->charIndex];
+
+        if (CHAR_CLASS(c) & CC_SPACE) {
+            if (c == '\n')
+                lexer->lineNumber++;
+
+            lexer->charIndex++;
             continue;
         }
 
-        // skipping line
-        if (lexer.state == SKIP_LINE && lexer.text[lexer.charIndex] != '\n') {
-            lexer.charIndex++;
+        // comments and the rest of a label line are ignored
+        if (c == LXR_COMMENT) {
+            SkipLine(lexer);
             continue;
-        } else if (lexer.state == SKIP_LINE && lexer.text[lexer.charIndex] == '\n') {
-            lexer.charIndex++;
-            lexer.lineNumber++;
-            lexer.state = PARSE;
+        }
+
+        if (c == LXR_LABEL_START) {
+            ParseLabel(lexer);
+            SkipLine(lexer);
             continue;
         }
 
-        // parse a label
-        if (lexer.state == PARSE_LABEL) {
-            if (lexer.text[lexer.charIndex] == LXR_LABEL_END) {
-                // reached the end of the label
-                if (currLabel.nameLen == 0)
-                    SyntaxError(&lexer, "unnamed label");
-
-                if (UniqueLabelName(&currLabel, &lexer) == FALSE)
-                    SyntaxError(&lexer, "duplicate label name");
-
-                lexer.labels[lexer.numLabels++] = currLabel;
-                lexer.state = SKIP_LINE;
-
-                continue;
-            } else if (isalpha(lexer.text[lexer.charIndex])) {
-                // name of the label
-                currLabel.name[currLabel.nameLen++] = lexer.text[lexer.charIndex];
-                lexer.charIndex++;
-                continue;
-            }
+        if (!(CHAR_CLASS(c) & CC_ALPHA)) {
+            char buff[25] = {0};
+            snprintf(buff, 25, "unknown character '%c'", c);
+            SyntaxError(lexer, buff);
         }
 
-        // detect unknonwn characters
-        if (lexer.charIndex < lexer.textLength && !isalpha(lexer.text[lexer.charIndex]) &&
-            !isspace(lexer.text[lexer.charIndex])) {
-            if (lexer.text[lexer.charIndex] != LXR_STR_CHAR) {
-                char buff[25] = {0};
-                snprintf(buff, 25, "unknown character '%c'", lexer.text[lexer.charIndex]);
-                SyntaxError(&lexer, buff);
-            }
+        // a keyword is a run of letters, looked up once the whole word is read
+        long start = lexer->charIndex;
+        while (CHAR_CLASS(lexer->text[lexer->charIndex]) & CC_ALPHA)
+            lexer->charIndex++;
+
+        long length = lexer->charIndex - start;
+        Opcode opcode = LookupOpcode(&lexer->text[start], length);
+
+        if (opcode == OP_UNKNOWN) {
+            char buff[MAX_KEYWORD_LEN + 20] = {0};
+            snprintf(buff, MAX_KEYWORD_LEN + 20, "unknown opcode '%.*s'", (int)length,
+                     &lexer->text[start]);
+            SyntaxError(lexer, buff);
         }
 
-        // We are in general parsing state
-        if (lexer.state == PARSE) {
-            lexer.state = PARSE_KWD;
-            index = 0;
-            memset(keyword, 0, MAX_KEYWORD_LEN);
+        if (CHAR_CLASS(lexer->text[lexer->charIndex]) & CC_DIGIT) {
+            char buff[25] = {0};
+            snprintf(buff, 25, "unknown character '%c'", lexer->text[lexer->charIndex]);
+            SyntaxError(lexer, buff);
         }
 
-        // Parse a keyword
-        if (lexer.state == PARSE_KWD) {
-            if (lexer.charIndex < lexer.textLength &&
-                (isalpha(lexer.text[lexer.charIndex]) &&
-                 lexer.text[lexer.charIndex] != LXR_COMMENT)) {
-
-                keyword[index++] = lexer.text[lexer.charIndex++];
-
-                if (OpcodeFromKeyword(keyword) != OP_UNKNOWN) {
-                    if (isalpha(lexer.text[lexer.charIndex]) ||
-                        isdigit(lexer.text[lexer.charIndex])) {
-                        continue;
-                    }
-                }
-
-                if (OpcodeFromKeyword(keyword) == OP_UNKNOWN &&
-                    (!isalpha(lexer.text[lexer.charIndex]) ||
-                     !isdigit(lexer.text[lexer.charIndex])))
-                    continue;
-            }
+        SkipSpaces(lexer); // skip any spaces between opcode keyword and operands
 
-            if (index == 0) {
-                lexer.charIndex++;
-                continue;
-            }
+        Operand operands[2] = {0};
+        ParseOperands(lexer, opcode, operands);
+
+        // Create token from the statement, opcode, and operands
+        long end = lexer->charIndex;
+        while (end > start && (CHAR_CLASS(lexer->text[end - 1]) & CC_SPACE))
+            end--;
+
+        Instruction inst = NewInstruction(opcode, operands, lexer);
+        AddStatement(lexer, NewToken(&lexer->text[start], end - start, lexer), inst);
+    }
+}
+
+// lexer for text[start, end), where text[start] is on line 'lineNumber'
+static Lexer NewLexer(char* path, char* text, long start, long end, long lineNumber) {
+    Lexer lexer = {.charIndex = start,
+                   .lineNumber = lineNumber,
+                   .filePath = path,
+                   .text = text,
+                   .textLength = end};
 
-            keyword[index] = '\0';
-            lexer.state = PARSE;
+    // token text and operands together take about as much room as the source,
+    // so most files fit in the first block
+    lexer.arena.blockSize = 2 * (size_t)(end - start);
+    if (lexer.arena.blockSize < ARENA_BLOCK_SIZE)
+        lexer.arena.blockSize = ARENA_BLOCK_SIZE;
+
+    return lexer;
+}
+
+#ifdef USING_ARDUINO
+Lexer ParseTokens(char* text) {
+    Lexer lexer;
+    LexSource(&lexer, "", text, strlen(text), 1, NULL);
+    return lexer;
+}
+#elif !defined(USING_ARDUINO)
+Lexer ParseTokens(char* path) {
+    // Open file and load its contents
+    unsigned int tl = 0;
+    char* text = ReadFromFile(path, &tl);
+
+    Lexer lexer;
+    LexSource(&lexer, path, text, tl, 1, NULL);
+    return lexer;
+}
+#endif
+
+#ifdef LXR_PARALLEL
+// Split text into at most 'count' chunks that can be lexed on their own.
+// Chunks start right after a line break that is not inside a string, and
+// lines[i] is the line chunk i starts on, counted the way LexText counts
+static uint32_t SplitText(const char* text, long length, uint32_t count, long* starts,
+                          long* lines) {
+    enum { SPLIT_CODE, SPLIT_STRING, SPLIT_COMMENT } state = SPLIT_CODE;
+    uint32_t chunks = 1;
+    long line = 1;
+
+    starts[0] = 0;
+    lines[0] = 1;
+
+    for (long i = 0; i + 1 < length && chunks < count; i++) {
+        char c = text[i];
+
+        if (state == SPLIT_STRING) {
+            if (c == LXR_ESCAPE_CHAR && text[i + 1] != '\n')
+                i++;
+            else if (c == LXR_STR_CHAR)
+                state = SPLIT_CODE;
+            continue;
         }
 
-        // get opcode from keyword as an Opcode enum
-        Opcode opcode = OpcodeFromKeyword(keyword);
+        if (c == '\n') {
+            line++;
+            state = SPLIT_CODE;
 
-        if (opcode == OP_UNKNOWN) {
-            char buff[MAX_KEYWORD_LEN + 20] = {0};
-            snprintf(buff, MAX_KEYWORD_LEN + 20, "unknown opcode '%s'", keyword);
-            SyntaxError(&lexer, buff);
+            if (i + 1 >= length / count * chunks) {
+                starts[chunks] = i + 1;
+                lines[chunks++] = line;
+            }
+        } else if (state == SPLIT_CODE) {
+            // the rest of a label line is skipped like a comment
+            if (c == LXR_STR_CHAR)
+                state = SPLIT_STRING;
+            else if (c == LXR_COMMENT || c == LXR_LABEL_END)
+                state = SPLIT_COMMENT;
         }
+    }
 
-        SkipSpaces(&lexer); // skip any spaces between opcode keyword and operands
+    return chunks;
+}
 
-        Operand operands[2] = {0};
-        ParseOperands(&lexer, opcode, operands);
+// an error leaves chunk->error set. the error is reported by lexing the whole text again
+static void* LexChunk(void* arg) {
+    Lexer* chunk = arg;
+    jmp_buf trap;
+
+    chunk->trap = &trap;
+    if (setjmp(trap) == 0)
+        LexText(chunk);
+
+    chunk->trap = NULL;
+    return NULL;
+}
+
+// append a chunk that was lexed on its own, moving its indexes past what is
+// already in lexer. FALSE if the chunk had an error or declares a label an
+// earlier chunk did
+static BOOL MergeChunk(Lexer* lexer, Lexer* chunk) {
+    if (chunk->error != NULL)
+        return FALSE;
+
+    uint32_t base = lexer->numTokens;
+    uint32_t constants = lexer->numConstants;
+    uint32_t strings = lexer->stringsSize;
+
+    for (uint32_t i = 0; i < chunk->numLabels; i++) {
+        Label label = chunk->labels[i];
+        label.index += base;
+
+        GrowLabelSlots(lexer);
+        uint32_t* slot = FindLabelSlot(lexer, label.name, label.nameLen);
+        if (*slot != 0)
+            return FALSE;
+
+        lexer->labels = GrowArray(lexer->labels, &lexer->labelsCapacity, lexer->numLabels + 1,
+                                  sizeof(Label), "labels");
+        lexer->labels[lexer->numLabels++] = label;
+        *slot = lexer->numLabels;
+    }
+
+    for (uint32_t i = 0; i < chunk->numTokens; i++) {
+        Instruction inst = chunk->program[i];
+
+        switch (inst.kind) {
+        case OPND_LABEL:
+            inst.index += base; // jumps still waiting for a fixup are overwritten later
+            break;
+        case OPND_WIDE:
+        case OPND_F64:
+            inst.index += constants;
+            break;
+        case OPND_STR:
+            inst.index += strings;
+            break;
+        }
 
-        // Create token from keyword, opcode, and operands
-        char tokenKeyword[MAX_KEYWORD_LEN] = {0};
-        strncpy(tokenKeyword, keyword, MAX_KEYWORD_LEN - 1);
-        Token token = NewToken(opcode, tokenKeyword, operands, &lexer);
-        lexer.tokens[lexer.numTokens++] = token; // append token to array of tokens
+        AddStatement(lexer, chunk->tokens[i], inst);
     }
 
+    for (uint32_t i = 0; i < chunk->numConstants; i++)
+        AddConstant(lexer, chunk->constants[i]);
+
+    lexer->strings = GrowArray(lexer->strings, &lexer->stringsCapacity,
+                               lexer->stringsSize + chunk->stringsSize, 1, "string pool");
+    memcpy(lexer->strings + lexer->stringsSize, chunk->strings, chunk->stringsSize);
+    lexer->stringsSize += chunk->stringsSize;
+
+    for (uint32_t i = 0; i < chunk->numFixups; i++) {
+        lexer->fixups = GrowArray(lexer->fixups, &lexer->fixupsCapacity, lexer->numFixups + 1,
+                                  sizeof(LabelFixup), "labels");
+        lexer->fixups[lexer->numFixups] = chunk->fixups[i];
+        lexer->fixups[lexer->numFixups++].inst += base;
+    }
+
+    return TRUE;
+}
+
+// lex text in chunks on several threads into 'lexer'. FALSE if it was not
+// worth it or a chunk had an error, leaving the lexing to the calling thread
+static BOOL LexParallel(Lexer* lexer, char* path, char* text, long length, unsigned int threads,
+                        jmp_buf* trap) {
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > length / LXR_PARALLEL_MIN_CHUNK)
+        threads = length / LXR_PARALLEL_MIN_CHUNK;
+    if (threads > LXR_PARALLEL_MAX_THREADS)
+        threads = LXR_PARALLEL_MAX_THREADS;
+
+    long starts[LXR_PARALLEL_MAX_THREADS];
+    long lines[LXR_PARALLEL_MAX_THREADS];
+    uint32_t count = (threads > 1) ? SplitText(text, length, threads, starts, lines) : 1;
+    if (count == 1)
+        return FALSE;
+
+    Lexer* chunks = calloc(count, sizeof(Lexer));
+    pthread_t workers[LXR_PARALLEL_MAX_THREADS];
+    BOOL started[LXR_PARALLEL_MAX_THREADS] = {0};
+    if (chunks == NULL) {
+        fprintf(stderr, "Buffer allocation error for lexer chunks.\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        long end = (i + 1 < count) ? starts[i + 1] : length;
+        chunks[i] = NewLexer(path, text, starts[i], end, lines[i]);
+    }
+
+    // the calling thread takes the first chunk, and any chunk a thread could not be made for
+    for (uint32_t i = 1; i < count; i++)
+        started[i] = pthread_create(&workers[i], NULL, LexChunk, &chunks[i]) == 0;
+
+    LexChunk(&chunks[0]);
+    for (uint32_t i = 1; i < count; i++) {
+        if (started[i] == TRUE)
+            pthread_join(workers[i], NULL);
+        else
+            LexChunk(&chunks[i]);
+    }
+
+    *lexer = NewLexer(path, text, length, length, 1);
+    BOOL merged = TRUE;
+    for (uint32_t i = 0; i < count; i++) {
+        merged = merged && MergeChunk(lexer, &chunks[i]);
+
+        // token text and label names stay in the chunk arenas
+        ArenaAdopt(&lexer->arena, &chunks[i].arena);
+        chunks[i].text = NULL;
+        FreeLexer(&chunks[i]);
+    }
+
+    free(chunks);
+
+    // lex again in one piece so an error points at the same place it would have
+    if (merged == FALSE) {
+        lexer->text = NULL;
+        FreeLexer(lexer);
+        return FALSE;
+    }
+
+    lexer->trap = trap;
+    ResolveFixups(lexer);
+    lexer->entry = LabelIndex(lexer, LABEL_ENTRY_PNT);
+
+    return TRUE;
+}
+#endif
+
+void LexSource(Lexer* lexer, char* path, char* text, long length, unsigned int threads,
+               jmp_buf* trap) {
+#ifdef LXR_PARALLEL
+    if (threads != 1 && LexParallel(lexer, path, text, length, threads, trap) == TRUE)
+        return;
+#endif
+
+    *lexer = NewLexer(path, text, 0, length, 1);
+    lexer->trap = trap;
+    LexText(lexer);
+
+    ResolveFixups(lexer);
+    lexer->entry = LabelIndex(lexer, LABEL_ENTRY_PNT);
+}
+
+#ifndef USING_ARDUINO
+Lexer ParseTokensParallel(char* path, unsigned int threads) {
+    unsigned int tl = 0;
+    char* text = ReadFromFile(path, &tl);
+
+    Lexer lexer;
+    LexSource(&lexer, path, text, tl, threads, NULL);
     return lexer;
+}
+#endif
+
+void LoadProgram(Machine* machine, Lexer* lexer) {
+    machine->program = lexer->program;
+    machine->programSize = lexer->numTokens;
+    machine->constants = lexer->constants;
+    machine->strings = lexer->strings;
+    machine->labels = lexer->labels;
+    machine->numLabels = lexer->numLabels;
+
+    machine->rp = -1;
+    if (lexer->entry != -1) {
+        machine->ip = lexer->entry;
+        machine->started = TRUE;
+    }
 }
\ No newline at end of file
@@ -8,9 +8,12 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include "arena.h"  // for Arena
 #include "inst.h"   // for Instruction and Opcode
 #include "macros.h" // for size defintions, i.e MAX_KEYWORD_LEN
 
+#include <stddef.h>
+
 typedef enum {
     ERR_INVALID_SYNTAX,
     ERR_RUNTIME_EXCEPTION,
@@ -19,26 +22,25 @@ typedef enum {
 
 /// @brief More information about an instruction
 ///
-/// Includes the parsed instruction information
-/// file that the instruction was read from
+/// Includes the file that the instruction was read from
 /// line number the instruction is on
 /// and the actual raw line contents, e.g 'push 8'
+/// The instruction itself is at the same index in Lexer::program
 typedef struct {
-    Instruction inst;
     char* text;
     char* filepath;
     unsigned int line;
 } Token;
 
-typedef enum {
-    NONE = 0,
-    PARSE,
-    PARSE_KWD,
-    PARSE_OPND,
-    PARSE_LABEL,
-    SKIP_LINE,
-    SKIP_SPACES,
-} LexerState;
+/// @brief A jump to a label that was not declared yet
+///
+/// Patched once the whole file is read, when every label is known
+typedef struct {
+    const char* name;
+    uint32_t inst; // instruction to patch
+    long charIndex;
+    long lineNumber;
+} LabelFixup;
 
 typedef struct {
     long charIndex;
@@ -46,28 +48,60 @@ typedef struct {
     long textLength;
     long lineNumber;
     char* filePath;
-    LexerState state;
 
-    Token tokens[MAX_PROGRAM_SIZE];
-    unsigned int numTokens;
+    // tokens[i] describes program[i], both grow together as statements are parsed.
+    // program is handed to the machine as is
+    Token* tokens;
+    Instruction* program;
+    uint32_t numTokens;
+    uint32_t tokensCapacity;
 
-    Label labels[MAX_LABELS];
-    unsigned short numLabels;
-} Lexer;
+    Label* labels;
+    uint32_t numLabels;
+    uint32_t labelsCapacity;
 
-/// @brief An entry to represent relationship between string and enum
-///
-/// Map opcode to string representation
-/// Map string keyword to opcode
-/// Necessary when parsing language
-typedef struct {
-    char keyword[MAX_KEYWORD_LEN];
-    Opcode opcode;
-} OpcodeEntry;
+    // open addressing hash table of label names. a slot holds an index
+    // into labels plus one, zero is an empty slot
+    uint32_t* labelSlots;
+    uint32_t labelSlotsCapacity; // always a power of two
+
+    LabelFixup* fixups;
+    uint32_t numFixups;
+    uint32_t fixupsCapacity;
+
+    int entry; // instruction index of the _start label, -1 if there is none
+
+    // string literals referenced by OPND_STR operands, stored back to back
+    // with escapes resolved, see STRING_LENGTH
+    char* strings;
+    uint32_t stringsSize;
+    uint32_t stringsCapacity;
+
+    // immediates that do not fit inside an Instruction
+    DataCell* constants;
+    uint32_t numConstants;
+    uint32_t constantsCapacity;
+
+    // token text, operands and error lines, freed together by FreeLexer
+    Arena arena;
+
+    // errors jump here instead of ending the process, if not NULL. error is
+    // the text that would have been printed and errorCode what it would exit with
+    jmp_buf* trap;
+    char* error;
+    Error errorCode;
+} Lexer;
 
 /// File I/O operations
 #ifndef USING_ARDUINO
+/// @brief Read a whole file into a null terminated buffer, ending the process if it can't
 char* ReadFromFile(char* path, int* stringLength);
+
+/// @brief Read a whole file into a null terminated buffer
+/// @param path - file to read
+/// @param length - out, bytes read
+/// @return - the buffer, freed by the caller, or NULL if the file could not be read
+char* ReadTextFile(const char* path, long* length);
 #endif
 
 /// Error handling
@@ -93,6 +127,14 @@ void ToOperandType(Operand* operands, int index, char* operand);
 /// @param lexer - current lexer context
 void SkipSpaces(Lexer* lexer);
 
+/// @brief Skip to the end of the current line, leaving the newline unread
+/// @param lexer - current lexer context
+void SkipLine(Lexer* lexer);
+
+/// @brief Parse a label declaration, e.g '_loop:', and add it to the labels
+/// @param lexer - current lexer context, at the label start character
+void ParseLabel(Lexer* lexer);
+
 /// @brief Parse one operand for an opcode instruction
 /// @param lexer - current lexer context
 /// @param opcode - opcode to search operands for
@@ -122,19 +164,66 @@ void CheckOperandSyntax(Lexer* lexer, Opcode opcode, char* operand);
 /// correct
 int OperandsExpected(Opcode op);
 
+/// @brief Convert the text of an immediate, e.g '$5' or '2.5', to a value
+/// @param text - immediate to convert, with or without the constant prefix
+/// @return - TY_I64 or TY_F64 value
+Data DecodeImmediate(const char* text);
+
+/// @brief Store an immediate in an instruction
+///
+/// Integers that fit in 32 bits are stored inline, anything else
+/// is appended to the constant pool of the lexer
+/// @param lexer - lexer context owning the constant pool
+/// @param inst - instruction to store the immediate in
+/// @param value - TY_I64 or TY_F64 value
+void EncodeImmediate(Lexer* lexer, Instruction* inst, Data value);
+
+/// @brief Store a memory operand, e.g '[rax+8]', in a load or store
+///
+/// Sets src, kind and imm or index of the instruction, see OPND_MEM.
+/// Anything but [reg], [reg+imm], [reg-imm] and [reg+reg*scale] is a
+/// syntax error
+/// @param lexer - lexer context, for errors
+/// @param inst - load or store to store the operand in
+/// @param text - the operand, from [ to ]
+void EncodeMemoryOperand(Lexer* lexer, Instruction* inst, const char* text);
+
+/// @brief Append a string literal to the string pool of the lexer
+///
+/// The quotes are dropped and escapes resolved once here, so writing the
+/// string is a copy of STRING_LENGTH bytes
+/// @param lexer - lexer context owning the string pool
+/// @param text - literal as written, quotes included
+/// @return - byte offset of the string's bytes in the pool
+uint32_t AddString(Lexer* lexer, const char* text);
+
 /// @brief Constructor for a Token
-/// @param operation - opcode
-/// @param keyword - keyword
-/// @param operands - list of operands
+/// @param text - statement as written in the source, e.g 'push 8'
+/// @param textLength - characters in text, which does not need to be terminated
 /// @param lexer - lexer context
 /// @return - token
-Token NewToken(Opcode operation, char* keyword, Operand* operands, Lexer* lexer);
+Token NewToken(const char* text, size_t textLength, Lexer* lexer);
+
+/// @brief Encode a parsed statement as an Instruction
+/// @param operation - opcode
+/// @param operands - list of operands
+/// @param lexer - lexer context, owning the constant and string pools
+/// @return - instruction
+Instruction NewInstruction(Opcode operation, Operand* operands, Lexer* lexer);
 
 /// @brief Get an enum Opcode from a string, keyword
 /// @param keyword - string to convert into an opcode
 /// @return - Opcode representation of keyword or OP_UNKNOWN if failed
 Opcode OpcodeFromKeyword(char* keyword);
 
+/// @brief Get an enum Opcode from a word that is not null terminated
+///
+/// Uses the perfect hash in keywords.h, so it costs the same for every word
+/// @param word - start of the word
+/// @param length - characters in the word
+/// @return - Opcode representation of word or OP_UNKNOWN if failed
+Opcode LookupOpcode(const char* word, size_t length);
+
 /// @brief Read a file and try to make tokens out of text
 /// @param file - file path to read
 #ifndef USING_ARDUINO
@@ -143,11 +232,69 @@ Lexer ParseTokens(char* path);
 Lexer ParseTokens(char* text);
 #endif
 
+/// @brief Lex source text into a lexer the caller owns
+///
+/// The lexer owns text afterwards (except on Arduino) and frees it in
+/// FreeLexer. With a trap, an error jumps there with lexer->error set
+/// instead of ending the process, and the lexer can still be freed
+/// @param lexer - out, lexer to fill in
+/// @param path - file name used in error messages
+/// @param text - source text
+/// @param length - characters in text
+/// @param threads - 1 to lex on the calling thread, see ParseTokensParallel otherwise
+/// @param trap - where errors jump to, NULL to print them and end the process
+void LexSource(Lexer* lexer, char* path, char* text, long length, unsigned int threads,
+               jmp_buf* trap);
+
+/// @brief Free everything a lexer allocated
+///
+/// Token text and every string ParseOperand returned are invalid afterwards,
+/// and so are the source text, the program, the labels and the pools.
+/// A machine running the program must be finished first
+/// @param lexer - lexer returned by ParseTokens
+void FreeLexer(Lexer* lexer);
+
+#ifndef USING_ARDUINO
+/// @brief Read a file and lex it on several threads
+///
+/// The file is split at line breaks into chunks that are lexed
+/// concurrently, then merged in order on the calling thread, which
+/// also resolves every jump. The result is identical to ParseTokens.
+/// Chunks are at least LXR_PARALLEL_MIN_CHUNK bytes, so small files
+/// are lexed on the calling thread alone
+/// @param path - file path to read
+/// @param threads - most threads to use, 0 for one per core
+Lexer ParseTokensParallel(char* path, unsigned int threads);
+#endif
+
 /// @brief Get the starting index of a label from its name
 /// @param lexer - lexer context
 /// @param name - name of label
 /// @return - index of label or -1 if not found
-int LabelIndex(Lexer* lexer, char* name);
+int LabelIndex(Lexer* lexer, const char* name);
+
+/// @brief Point a machine at a lexed program
+///
+/// Nothing is copied, the lexer must outlive the machine. The entry
+/// point is set here, so the machine never has to search for _start
+/// @param machine - machine to load the program into
+/// @param lexer - lexer returned by ParseTokens
+void LoadProgram(Machine* machine, Lexer* lexer);
+
+/// @brief Check if an opcode can take a memory operand
+/// @param opcode - opcode to check
+/// @return - TRUE for mov, movb and movf
+BOOL IsMoveOpcode(Opcode opcode);
+
+/// @brief Check if an opcode is add, sub, mul, div or mod
+/// @param opcode - opcode to check
+/// @return - TRUE for the arithmetic opcodes
+BOOL IsArithneticOpcode(Opcode opcode);
+
+/// @brief Check if an opcode takes a label as its operand
+/// @param opcode - opcode to check
+/// @return - TRUE for jumps and calls
+BOOL IsJumpOpcode(Opcode opcode);
 
 /// @brief Print all information about a token
 /// @param token - token to print information about
@@ -1,20 +1,20 @@
 /// Macros and Instruction Macros
 ///
 /// Includes macros to make creating Instruction structs
-/// neater. Instead of having to do {.operation = OP_PUSH, .data.value = 3}
+/// neater. Instead of having to do {.operation = OP_PUSH, .kind = OPND_I64, .imm = 3}
 /// everytime you have to push a value, you can simply use an instruction macro.
 
 // #define USING_ARDUINO // comment this out if not using arduino
 
 #ifdef USING_ARDUINO
 #define STACK_CAPACITY 15
-#define MEMORY_CAPACITY 25
-#define MAX_PROGRAM_SIZE 15
+#define STACK_MAX_CAPACITY 64
 #define MAX_KEYWORD_LEN 12 // keywords should NOT exceed this length
 #define MAX_OPERAND_LEN 10 // worst case scenario you have two LLONG_MAX
 #define MAX_STRING_LEN 10
-#define MAX_LABELS 5
-#define MAX_LABEL_LEN 8
+#define ARENA_BLOCK_SIZE 128 // smallest block the lexer arena asks malloc for
+#define VM_OUTPUT_SIZE 16    // stdout bytes a machine holds before writing them out
+#define VM_MEMORY_REGIONS 1  // SYS_ALLOC regions a machine has room for at first
 
 // ripped from the internet
 // registers for the arduino to control pin states
@@ -65,14 +65,14 @@
 #define INPC (*(volatile unsigned char*)0x26)
 #define INPD (*(volatile unsigned char*)0x29)
 #elif !defined(USING_ARDUINO) // if not using arduino, the max sizes can be a bit bigger
-#define STACK_CAPACITY 2048
-#define MEMORY_CAPACITY 2048
-#define MAX_PROGRAM_SIZE 2048
+#define STACK_CAPACITY 2048          // values on a stack unless the machine is given another size
+#define STACK_MAX_CAPACITY (1 << 24) // largest stack a machine can be given
 #define MAX_KEYWORD_LEN 35 // key
 #define MAX_OPERAND_LEN 50
 #define MAX_STRING_LEN 256
-#define MAX_LABELS 100
-#define MAX_LABEL_LEN 15
+#define ARENA_BLOCK_SIZE (64 << 10)
+#define VM_OUTPUT_SIZE (8 << 10)
+#define VM_MEMORY_REGIONS 16
 #endif
 
 #define LXR_MAX_LINE_LEN MAX_KEYWORD_LEN + MAX_OPERAND_LEN // maximum length a line can be lexer
@@ -89,6 +89,94 @@
 #define LXR_ESCAPE_CHAR '\\'
 #define LXR_FLOAT '.'
 #define LXR_SIGNED_INT '-'
+#define LXR_MEM_START '[' // start and end of a memory operand, e.g [rax+8]
+#define LXR_MEM_END ']'
+
+/// Interpreter dispatch
+///
+/// Use computed goto (labels as values) for instruction dispatch when the
+/// compiler supports it. Define VM_NO_COMPUTED_GOTO to force the switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
+
+/// Small helpers the dispatch loop calls on every instruction. The loop is
+/// too big for the compiler to inline them into on its own
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_INLINE static inline __attribute__((always_inline))
+#else
+#define VM_INLINE static inline
+#endif
+
+/// Arithmetic instructions rewrite themselves into type specialized variants
+/// while running. Define VM_NO_QUICKEN to always run the generic handlers
+#ifndef VM_NO_QUICKEN
+#define VM_QUICKENING
+#endif
+
+/// Hot labels are compiled to native code on x86-64 linux. Define VM_NO_JIT to
+/// only ever interpret
+#if defined(__x86_64__) && defined(__linux__) && !defined(USING_ARDUINO) && !defined(VM_NO_JIT)
+#define VM_JIT
+#endif
+
+/// Large files can be lexed on several threads, see ParseTokensParallel.
+/// Define LXR_NO_PARALLEL to always lex on the calling thread
+#if !defined(USING_ARDUINO) && !defined(_WIN32) && !defined(LXR_NO_PARALLEL)
+#define LXR_PARALLEL
+#endif
+
+#ifndef LXR_PARALLEL_MIN_CHUNK
+#define LXR_PARALLEL_MIN_CHUNK (256 << 10) // smallest piece of a file given its own thread
+#endif
+#define LXR_PARALLEL_MAX_THREADS 64
+
+/// main can run a batch of programs on a pool of threads, see RunBatch
+#if !defined(USING_ARDUINO) && !defined(_WIN32)
+#define VM_BATCH
+#endif
+
+/// Build with -DVM_PROFILE (./build.sh profile) for --profile, which counts and
+/// times every instruction run, see profile.h. Without it the dispatch loop
+/// has no profiling code at all
+#if defined(VM_PROFILE) && defined(USING_ARDUINO)
+#undef VM_PROFILE
+#endif
+
+/// --trace records every instruction run to a file, see trace.h. Costs one
+/// check per instruction when not tracing. Define VM_NO_TRACE to leave it out
+#if !defined(USING_ARDUINO) && !defined(VM_NO_TRACE)
+#define VM_TRACE
+#endif
+
+/// A machine's stack can sit between two inaccessible pages (--guard-stack).
+/// The stack instructions then skip their bounds checks and an overflow or
+/// underflow faults instead, see CreateStack. Define VM_NO_GUARD_STACK to
+/// leave it out
+#if defined(__linux__) && !defined(USING_ARDUINO) && !defined(VM_NO_GUARD_STACK)
+#define VM_GUARD_STACK
+#endif
+
+/// Build with -DVM_NANBOX to keep every value on the stack in 8 bytes instead
+/// of a 16 byte Data, see Value in inst.h. Needs a 64 bit double, so it is
+/// left out on arduino. The jit only works on boxed i64s on the stack and
+/// leaves every other value to the interpreter
+#if defined(VM_NANBOX) && defined(USING_ARDUINO)
+#undef VM_NANBOX
+#endif
+
+/// Packed vector instructions run on AVX2 when the cpu has it, see vector.h.
+/// Define VM_NO_AVX2 to always run them as plain loops over the lanes
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(USING_ARDUINO) && \
+    !defined(VM_NO_AVX2)
+#define VM_AVX2
+#endif
+
+/// Buffered stdout is written with writev when it goes to a file descriptor,
+/// otherwise with fwrite
+#if !defined(USING_ARDUINO) && !defined(_WIN32)
+#define VM_WRITEV
+#endif
 
 /// Flag operatons
 #define FLAG_SF (1 << 0)
@@ -96,6 +184,14 @@
 #define FLAG_ZF (1 << 2)
 #define FLAG_OF (1 << 3)
 
+/// Conditions for jumps, from the flags set by a cmp
+#define COND_JE(flags) ((flags) & FLAG_ZF)
+#define COND_JNE(flags) (!((flags) & FLAG_ZF))
+#define COND_JG(flags) (!((flags) & FLAG_ZF) && ((flags) & FLAG_SF) == ((flags) & FLAG_OF))
+#define COND_JGE(flags) (((flags) & FLAG_ZF) || ((flags) & FLAG_SF) == ((flags) & FLAG_OF))
+#define COND_JL(flags) (((flags) & FLAG_SF) != ((flags) & FLAG_OF))
+#define COND_JLE(flags) (((flags) & FLAG_ZF) || ((flags) & FLAG_SF) != ((flags) & FLAG_OF))
+
 // types
 typedef int BOOL;
 
@@ -105,10 +201,10 @@ typedef int BOOL;
 /// Insturction macros
 #define INST_NOP() {.operation = OP_NOP}
 
-#define INST_PUSH(a) {.operation = OP_PUSH, .data.value = a}
+#define INST_PUSH(a) {.operation = OP_PUSH, .kind = OPND_I64, .imm = a}
 #define INST_POP() {.operation = OP_POP}
 #define INST_MOV(source, destination)                                                              \
-    {.operation = OP_MOV, .data.registers.src = source, .data.registers.dest = destination}
+    {.operation = OP_MOV, .kind = OPND_REG, .src = source, .dest = destination}
 #define INST_PRNT() {.operation = OP_PRNT}
 #define INST_SWAP() {.operation = OP_SWAP}
 
@@ -118,13 +214,13 @@ typedef int BOOL;
 #define INST_SUB() {.operation = OP_SUB}
 #define INST_MUL() {.operation = OP_MUL}
 
-#define INST_JMP(to) {.operation = OP_JMP, .data.value = to}
-#define INST_JNE(to) {.operation = OP_JNE, .data.value = to}
-#define INST_JE(to) {.operation = OP_JE, .data.value = to}
-#define INST_JG(to) {.operation = OP_JG, .data.value = to}
-#define INST_JGE(to) {.operation = OP_JGE, .data.value = to}
-#define INST_JL(to) {.operation = OP_JL, .data.value = to}
-#define INST_JLE(to) {.operation = OP_JLE, .data.value = to}
+#define INST_JMP(to) {.operation = OP_JMP, .kind = OPND_LABEL, .index = to}
+#define INST_JNE(to) {.operation = OP_JNE, .kind = OPND_LABEL, .index = to}
+#define INST_JE(to) {.operation = OP_JE, .kind = OPND_LABEL, .index = to}
+#define INST_JG(to) {.operation = OP_JG, .kind = OPND_LABEL, .index = to}
+#define INST_JGE(to) {.operation = OP_JGE, .kind = OPND_LABEL, .index = to}
+#define INST_JL(to) {.operation = OP_JL, .kind = OPND_LABEL, .index = to}
+#define INST_JLE(to) {.operation = OP_JLE, .kind = OPND_LABEL, .index = to}
 
 #define INST_DUP() {.operation = OP_DUP}
 #define INST_CLR() {.operation = OP_CLR}
@@ -135,5 +231,5 @@ typedef int BOOL;
 #define INST_XORB() {.operation = OP_XORB}
 #define INST_ANDB() {.operation = OP_ANDB}
 #define INST_NOTB() {.operation = OP_NOTB}
-#define INST_SHL(a) {.operation = OP_SHL, .value = a}
-#define INST_SHR(a) {.operation = OP_SHR, .value = a}
\ No newline at end of file
+#define INST_SHL(a) {.operation = OP_SHL, .kind = OPND_I64, .imm = a}
+#define INST_SHR(a) {.operation = OP_SHR, .kind = OPND_I64, .imm = a}
\ No newline at end of file
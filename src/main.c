@@ -1,38 +1,176 @@
-#include "lexer.h"
+#include "../api/pvb.h"
+#include "batch.h"
+#include "profile.h"
+#include "trace.h"
 
 #ifndef USING_ARDUINO
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 int main(int argc, char** argv) {
-    if (argc == 1) {
+    char* path = NULL;
+    char* output = NULL;  // -o <file.pvbc> compiles to bytecode instead of running
+    char* batch = NULL;   // --batch <jobs> runs every program listed in a file
+    BOOL fuse = TRUE;     // --no-fuse runs the program exactly as written, for debugging
+    BOOL jit = TRUE;      // --no-jit interprets every instruction
+    BOOL profile = FALSE; // --profile reports where the time went on stderr, needs VM_PROFILE
+    char* trace = NULL;   // --trace <file> records every instruction run, see trace.h
+    char* show = NULL;    // --show-trace <file> prints a recorded trace
+    BOOL guard = FALSE;   // --guard-stack puts the stack between guard pages, see CreateStack
+    BOOL check = FALSE;   // --check-memory keeps loads and stores inside SYS_ALLOC memory
+    long stack = 0;       // --stack <values> the stack holds, 0 for STACK_CAPACITY
+    int threads = -1;     // -j <threads> lexes a large file or runs a batch on several threads,
+                          // 0 for one per core
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-fuse") == 0)
+            fuse = FALSE;
+        else if (strcmp(argv[i], "--no-jit") == 0)
+            jit = FALSE;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile = TRUE;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batch = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            trace = argv[++i];
+        else if (strcmp(argv[i], "--show-trace") == 0 && i + 1 < argc)
+            show = argv[++i];
+        else if (strcmp(argv[i], "--guard-stack") == 0)
+            guard = TRUE;
+        else if (strcmp(argv[i], "--check-memory") == 0)
+            check = TRUE;
+        else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc)
+            stack = atol(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+
+#ifdef VM_TRACE
+    if (show != NULL)
+        return TraceDecode(show, stdout) == TRUE ? 0 : 1;
+#endif
+
+    if (stack == 0)
+        stack = STACK_CAPACITY;
+    if (stack < 1 || stack > STACK_MAX_CAPACITY) {
+        fprintf(stderr, "Invalid stack size %ld. Must be between 1 and %d.\n", stack,
+                STACK_MAX_CAPACITY);
+        exit(1);
+    }
+
+#ifndef VM_GUARD_STACK
+    if (guard == TRUE) {
+        fprintf(stderr, "Built without VM_GUARD_STACK, --guard-stack is ignored.\n");
+        guard = FALSE;
+    }
+#endif
+
+#ifdef VM_BATCH
+    if (batch != NULL)
+        return RunBatch(batch, threads < 0 ? 0 : threads, fuse, jit, stack, guard, check) == 0
+                   ? 0
+                   : 1;
+#endif
+
+    if (path == NULL) {
         fprintf(stderr,
                 "Insufficient amount of arguments passed. No file path specified. Aborted.\n");
         exit(1);
     }
 
-    Lexer lexer = ParseTokens(argv[1]);
+#ifndef VM_PROFILE
+    if (profile == TRUE) {
+        fprintf(stderr, "Built without VM_PROFILE, --profile is ignored.\n");
+        profile = FALSE;
+    }
+#endif
 
-    Instruction* insts = malloc(lexer.numTokens * sizeof(Instruction));
-    for (unsigned int i = 0; i < lexer.numTokens; i++) {
-        insts[i] = lexer.tokens[i].inst;
+#ifndef VM_TRACE
+    if (trace != NULL || show != NULL) {
+        fprintf(stderr, "Built without VM_TRACE, --trace is ignored.\n");
+        trace = NULL;
     }
+#endif
 
-    Machine* machine = malloc(sizeof(Machine));
-    machine->stackSize = 0;
-    machine->ip = 0;
-    machine->program = insts;
-    machine->rp = -1;
-    machine->programSize = lexer.numTokens;
-    for (int i = 0; i < lexer.numLabels; i++) {
-        machine->labels[i] = lexer.labels[i];
+    // nothing runs when compiling, so don't map JIT code. the profiler and
+    // the trace can't see native code
+    uint32_t flags =
+        (fuse == TRUE ? 0 : PVB_NO_FUSE) | (guard == TRUE ? PVB_GUARD_STACK : 0) |
+        (check == TRUE ? PVB_CHECK_MEMORY : 0) |
+        (jit == TRUE && output == NULL && profile == FALSE && trace == NULL ? 0 : PVB_NO_JIT);
+
+    PvbVm* vm = PvbCreate(flags);
+    if (vm == NULL) {
+        fprintf(stderr, "Buffer allocation error for machine.\n");
+        exit(1);
     }
 
-    machine->numLabels = lexer.numLabels;
+    vm->lexThreads = (threads < 0) ? 1 : threads;
+    vm->stackCapacity = stack;
+
+    PvbStatus status = PvbLoadFile(vm, path);
+    if (status == PVB_OK && output != NULL)
+        status = PvbWriteBytecode(vm, output);
+    else if (status == PVB_OK) {
+#ifdef VM_PROFILE
+        if (profile == TRUE)
+            vm->machine.profile = ProfileCreate(vm->machine.programSize);
+#endif
+
+#ifdef VM_TRACE
+        if (trace != NULL) {
+            vm->machine.trace = TraceCreate(trace, path);
+            if (vm->machine.trace == NULL) {
+                fprintf(stderr, "Error creating trace file. Path: %s\n", trace);
+                exit(1);
+            }
+        }
+#endif
+
+        status = PvbRun(vm, 0);
 
-    RunInstructions(machine);
-    PrintRegisterContents(machine);
+#ifdef VM_PROFILE
+        if (profile == TRUE) {
+            ProfileReport(vm->machine.profile, &vm->machine,
+                          vm->lexed == TRUE ? vm->lexer.tokens : NULL, stderr);
+            ProfileDestroy(vm->machine.profile);
+            vm->machine.profile = NULL;
+        }
+#endif
+
+#ifdef VM_TRACE
+        if (trace != NULL) {
+            if (TraceDestroy(vm->machine.trace) == FALSE)
+                fprintf(stderr, "Error writing trace file. Path: %s\n", trace);
+            vm->machine.trace = NULL;
+        }
+#endif
+    }
+
+    switch (status) {
+    case PVB_OK:
+        if (output == NULL)
+            PrintRegisterContents(&vm->machine);
+        break;
+    case PVB_EXITED:
+        exit(vm->machine.exitCode);
+    case PVB_SYNTAX_ERROR:
+        fputs(vm->error.message, stderr);
+        exit(ERR_INVALID_SYNTAX);
+    case PVB_TYPE_ERROR:
+        fputs(vm->error.message, stderr);
+        exit(ERR_TYPE_ERROR);
+    default:
+        fputs(vm->error.message, stderr);
+        exit(1);
+    }
 
+    PvbDestroy(vm);
     return 0;
 }
 
@@ -0,0 +1,120 @@
+#include "optimize.h"
+
+static Opcode FusedShift(Opcode op) {
+    switch (op) {
+    case OP_SHL:
+        return OP_SHLI;
+    case OP_SHR:
+        return OP_SHRI;
+    default:
+        return OP_UNKNOWN;
+    }
+}
+
+static Opcode FusedBitwise(Opcode op) {
+    switch (op) {
+    case OP_ORB:
+        return OP_ORR;
+    case OP_ANDB:
+        return OP_ANDR;
+    case OP_XORB:
+        return OP_XORR;
+    default:
+        return OP_UNKNOWN;
+    }
+}
+
+static Opcode FusedBranch(Opcode op) {
+    switch (op) {
+    case OP_JE:
+        return OP_CMPJE;
+    case OP_JNE:
+        return OP_CMPJNE;
+    case OP_JG:
+        return OP_CMPJG;
+    case OP_JGE:
+        return OP_CMPJGE;
+    case OP_JL:
+        return OP_CMPJL;
+    case OP_JLE:
+        return OP_CMPJLE;
+    default:
+        return OP_UNKNOWN;
+    }
+}
+
+// push imm; shl n; pop reg
+static BOOL FuseShift(Instruction* inst, uint32_t left) {
+    if (left < 3 || inst[0].operation != OP_PUSH || inst[0].kind != OPND_I64)
+        return FALSE;
+
+    Opcode fused = FusedShift(inst[1].operation);
+    if (fused == OP_UNKNOWN || inst[1].kind != OPND_I64 || inst[1].imm < 0 || inst[1].imm > 63)
+        return FALSE;
+
+    if (inst[2].operation != OP_POP || inst[2].kind != OPND_REG)
+        return FALSE;
+
+    int32_t value = inst[0].imm;
+    inst[0].operation = fused;
+    inst[0].dest = inst[2].dest;
+    inst[0].src = inst[1].imm; // shift amount
+    inst[0].imm = value;
+
+    return TRUE;
+}
+
+// push a; push b; OR; pop reg
+static BOOL FuseBitwise(Instruction* inst, uint32_t left) {
+    if (left < 4 || inst[0].operation != OP_PUSH || inst[0].kind != OPND_REG ||
+        inst[1].operation != OP_PUSH || inst[1].kind != OPND_REG)
+        return FALSE;
+
+    Opcode fused = FusedBitwise(inst[2].operation);
+    if (fused == OP_UNKNOWN || inst[3].operation != OP_POP || inst[3].kind != OPND_REG)
+        return FALSE;
+
+    inst[0].operation = fused;
+    inst[0].dest = inst[3].dest;
+    inst[0].imm = inst[1].src; // second register
+
+    return TRUE;
+}
+
+// cmp x, reg; jcc _label
+static BOOL FuseBranch(Instruction* inst, uint32_t left) {
+    if (left < 2 || inst[0].operation != OP_CMP)
+        return FALSE;
+
+    Opcode fused = FusedBranch(inst[1].operation);
+    if (fused == OP_UNKNOWN || inst[1].kind != OPND_LABEL)
+        return FALSE;
+
+    inst[0].operation = fused;
+
+    return TRUE;
+}
+
+unsigned int FuseInstructions(Instruction* program, uint32_t size) {
+    unsigned int fused = 0;
+
+    uint32_t i = 0;
+    while (i < size) {
+        Instruction* inst = &program[i];
+        uint32_t left = size - i;
+
+        if (FuseShift(inst, left) == TRUE) {
+            i += 3;
+            fused++;
+        } else if (FuseBitwise(inst, left) == TRUE) {
+            i += 4;
+            fused++;
+        } else if (FuseBranch(inst, left) == TRUE) {
+            i += 2;
+            fused++;
+        } else
+            i++;
+    }
+
+    return fused;
+}
@@ -0,0 +1,29 @@
+/// Optimization passes over lexed programs
+///
+/// Passes rewrite a program in place after lexing and before it is
+/// handed to the virtual machine. They never add or remove instructions,
+/// so label indexes and jump targets stay valid.
+
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "inst.h"
+
+/// @brief Replace common instruction sequences with superinstructions
+///
+/// The first instruction of a matched sequence is rewritten to the fused
+/// opcode and the rest of the sequence is left untouched behind it. The
+/// fused handler steps over them, while a jump into the middle of the
+/// sequence still runs the original instructions.
+///
+/// Sequences fused:
+///     push imm; shl n; pop reg          -> OP_SHLI (and shr -> OP_SHRI)
+///     push a; push b; OR; pop reg       -> OP_ORR (and AND, XOR)
+///     cmp x, reg; jcc _label            -> OP_CMPJcc
+///
+/// @param program - instructions to optimize
+/// @param size - number of instructions in program
+/// @return - number of sequences fused
+unsigned int FuseInstructions(Instruction* program, uint32_t size);
+
+#endif
@@ -0,0 +1,180 @@
+#include "profile.h"
+
+#ifdef VM_PROFILE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// @brief A counter and what it counts, for sorting
+typedef struct {
+    uint32_t index; // opcode, label or instruction index
+    ProfileCounter counter;
+} ProfileEntry;
+
+static uint64_t Nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Profile* ProfileCreate(uint32_t numInstructions) {
+    Profile* profile = calloc(1, sizeof(Profile));
+    if (profile != NULL)
+        profile->instructions = calloc(numInstructions + 1, sizeof(ProfileCounter));
+
+    if (profile == NULL || profile->instructions == NULL) {
+        fprintf(stderr, "Buffer allocation error for profile.\n");
+        exit(1);
+    }
+
+    profile->numInstructions = numInstructions;
+    profile->last = UINT32_MAX;
+    profile->firstTick = ProfileNow();
+    profile->firstNanoseconds = Nanoseconds();
+    return profile;
+}
+
+void ProfileDestroy(Profile* profile) {
+    if (profile == NULL)
+        return;
+
+    free(profile->instructions);
+    free(profile);
+}
+
+void ProfileStop(Profile* profile) {
+    ProfileCharge(profile, ProfileNow());
+    profile->last = UINT32_MAX;
+}
+
+// most time first, then most runs
+static int CompareEntries(const void* a, const void* b) {
+    const ProfileCounter* x = &((const ProfileEntry*)a)->counter;
+    const ProfileCounter* y = &((const ProfileEntry*)b)->counter;
+
+    if (x->ticks != y->ticks)
+        return x->ticks < y->ticks ? 1 : -1;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return 0;
+}
+
+static int CompareLabels(const void* a, const void* b) {
+    long x = ((const Label*)a)->index;
+    long y = ((const Label*)b)->index;
+    return (x > y) - (x < y);
+}
+
+static void PrintCounter(FILE* stream, const ProfileCounter* counter, double nsPerTick,
+                         uint64_t totalTicks) {
+    fprintf(stream, " %12lu %12.1f %6.1f%%", counter->count,
+            counter->ticks * nsPerTick / 1000.0,
+            totalTicks ? 100.0 * counter->ticks / totalTicks : 0.0);
+}
+
+void ProfileReport(Profile* profile, const Machine* machine, const Token* tokens, FILE* stream) {
+    ProfileStop(profile);
+
+    uint64_t elapsedTicks = ProfileNow() - profile->firstTick;
+    uint64_t elapsedNanoseconds = Nanoseconds() - profile->firstNanoseconds;
+    double nsPerTick = elapsedTicks ? (double)elapsedNanoseconds / elapsedTicks : 0;
+
+    ProfileCounter total = {0};
+    for (int i = 0; i < NUM_OPCODES; i++) {
+        total.count += profile->opcodes[i].count;
+        total.ticks += profile->opcodes[i].ticks;
+    }
+
+    // room for every opcode, instruction or label plus the code before the first label
+    uint32_t size = profile->numInstructions + machine->numLabels + NUM_OPCODES + 1;
+    ProfileEntry* entries = calloc(size, sizeof(ProfileEntry));
+    Label* labels = calloc(machine->numLabels + 1, sizeof(Label));
+    if (entries == NULL || labels == NULL) {
+        fprintf(stderr, "Buffer allocation error for profile report.\n");
+        exit(1);
+    }
+
+    fprintf(stream, "--- Profile Start ---\n");
+    fprintf(stream, "%lu instructions in %.3f ms\n", total.count,
+            total.ticks * nsPerTick / 1e6);
+
+    // by opcode, as they ran after quickening
+    uint32_t count = 0;
+    for (int i = 0; i < NUM_OPCODES; i++) {
+        if (profile->opcodes[i].count > 0)
+            entries[count++] = (ProfileEntry){i, profile->opcodes[i]};
+    }
+    qsort(entries, count, sizeof(ProfileEntry), CompareEntries);
+
+    fprintf(stream, "\n%-12s %12s %12s %7s\n", "opcode", "count", "time (us)", "time");
+    for (uint32_t i = 0; i < count; i++) {
+        fprintf(stream, "%-12s", GetOpcodeName(entries[i].index));
+        PrintCounter(stream, &entries[i].counter, nsPerTick, total.ticks);
+        fprintf(stream, "\n");
+    }
+
+    // by label, each instruction belongs to the closest label before it
+    memcpy(labels, machine->labels, machine->numLabels * sizeof(Label));
+    qsort(labels, machine->numLabels, sizeof(Label), CompareLabels);
+
+    memset(entries, 0, size * sizeof(ProfileEntry));
+    uint32_t label = 0;
+    for (uint32_t i = 0; i < profile->numInstructions; i++) {
+        while (label < machine->numLabels && labels[label].index <= (long)i)
+            label++;
+
+        // label 0 collects what runs before the first label
+        entries[label].index = label;
+        entries[label].counter.count += profile->instructions[i].count;
+        entries[label].counter.ticks += profile->instructions[i].ticks;
+    }
+    qsort(entries, machine->numLabels + 1, sizeof(ProfileEntry), CompareEntries);
+
+    fprintf(stream, "\n%-20s %12s %12s %7s\n", "label", "count", "time (us)", "time");
+    for (uint32_t i = 0; i < machine->numLabels + 1; i++) {
+        if (entries[i].counter.count == 0)
+            continue;
+
+        uint32_t index = entries[i].index;
+        if (index == 0)
+            fprintf(stream, "%-20s", "(before any label)");
+        else
+            fprintf(stream, "%c%-19.*s", LXR_LABEL_START, (int)labels[index - 1].nameLen,
+                    labels[index - 1].name);
+        PrintCounter(stream, &entries[i].counter, nsPerTick, total.ticks);
+        fprintf(stream, "\n");
+    }
+
+    // the hottest instructions with their source
+    count = 0;
+    for (uint32_t i = 0; i < profile->numInstructions; i++) {
+        if (profile->instructions[i].count > 0)
+            entries[count++] = (ProfileEntry){i, profile->instructions[i]};
+    }
+    qsort(entries, count, sizeof(ProfileEntry), CompareEntries);
+
+    fprintf(stream, "\n%-24s %12s %12s %7s  %s\n", "instruction", "count", "time (us)", "time",
+            "source");
+    for (uint32_t i = 0; i < count && i < PROFILE_HOT_SPOTS; i++) {
+        uint32_t index = entries[i].index;
+        char location[256];
+
+        if (tokens != NULL)
+            snprintf(location, sizeof(location), "%s:%u", tokens[index].filepath,
+                     tokens[index].line);
+        else
+            snprintf(location, sizeof(location), "#%u", index);
+
+        fprintf(stream, "%-24s", location);
+        PrintCounter(stream, &entries[i].counter, nsPerTick, total.ticks);
+        fprintf(stream, "  %s\n", tokens != NULL ? tokens[index].text : "");
+    }
+
+    fprintf(stream, "--- Profile End   ---\n");
+
+    free(labels);
+    free(entries);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+/// Instruction profiler
+///
+/// Counts and times every instruction the interpreter runs, built with
+/// VM_PROFILE. Time is charged to an instruction from the moment it is
+/// fetched until the next one is, so a superinstruction includes the
+/// instructions it replaced and a jit compiled label is not seen at all.
+/// Run with --no-fuse --no-jit for a per statement picture.
+///
+/// Without VM_PROFILE none of this is compiled and the dispatch loop has
+/// no profiling code in it.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "inst.h"
+#include "lexer.h" // for Token
+#include "macros.h"
+
+#ifdef VM_PROFILE
+
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+#define PROFILE_HOT_SPOTS 20 // instructions listed in the report
+
+/// @param count: times the instruction or opcode was fetched
+/// @param ticks: time spent in it, in ProfileNow ticks
+typedef struct {
+    uint64_t count;
+    uint64_t ticks;
+} ProfileCounter;
+
+typedef struct Profile {
+    ProfileCounter* instructions; // one per instruction index
+    ProfileCounter opcodes[NUM_OPCODES];
+    uint32_t numInstructions;
+
+    uint32_t last;      // instruction the running time is charged to, UINT32_MAX for none
+    uint8_t lastOpcode; // its opcode when it was fetched, before any quickening
+    uint64_t started;   // tick it was fetched at
+
+    // ticks and nanoseconds when profiling started, to convert ticks to time
+    uint64_t firstTick;
+    uint64_t firstNanoseconds;
+} Profile;
+
+/// @brief Read the profiler's clock, the time stamp counter where there is one
+static inline uint64_t ProfileNow(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/// @brief Charge the running instruction for the time up to now
+static inline void ProfileCharge(Profile* profile, uint64_t now) {
+    if (profile->last == UINT32_MAX)
+        return;
+
+    uint64_t ticks = now - profile->started;
+    profile->instructions[profile->last].ticks += ticks;
+    profile->opcodes[profile->lastOpcode].ticks += ticks;
+}
+
+/// @brief Record that an instruction was fetched, called from the dispatch loop
+/// @param profile - profile of the running machine
+/// @param ip - index of the instruction
+/// @param operation - its opcode
+static inline void ProfileTick(Profile* profile, uint32_t ip, uint8_t operation) {
+    uint64_t now = ProfileNow();
+    ProfileCharge(profile, now);
+
+    profile->last = ip;
+    profile->lastOpcode = operation;
+    profile->started = now;
+    profile->instructions[ip].count++;
+    profile->opcodes[operation].count++;
+}
+
+/// @brief Create an empty profile for a program
+/// @param numInstructions - size of the program that will be profiled
+/// @return - the profile, ends the process if out of memory
+Profile* ProfileCreate(uint32_t numInstructions);
+
+/// @brief Free a profile
+void ProfileDestroy(Profile* profile);
+
+/// @brief Charge the running instruction, when the interpreter stops
+void ProfileStop(Profile* profile);
+
+/// @brief Print time per opcode, per label and the hottest instructions
+/// @param profile - profile to report, stopped first
+/// @param machine - machine that was profiled, for its labels
+/// @param tokens - source of each instruction, NULL for a program loaded from bytecode
+/// @param stream - where to print the report
+void ProfileReport(Profile* profile, const Machine* machine, const Token* tokens, FILE* stream);
+
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,231 @@
+#include "trace.h"
+
+#ifdef VM_TRACE
+
+#include "bytecode.h"
+#include "lexer.h"
+#include "vector.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+Trace* TraceCreate(const char* path, const char* program) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return NULL;
+
+    Trace* trace = calloc(1, sizeof(Trace));
+    if (trace == NULL) {
+        fprintf(stderr, "Buffer allocation error for trace.\n");
+        exit(1);
+    }
+
+    TraceHeader header = {.version = TRACE_VERSION,
+                          .recordSize = sizeof(TraceRecord),
+                          .pathLength = strlen(program)};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+    trace->file = file;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(program, 1, header.pathLength, file) != header.pathLength)
+        trace->failed = TRUE;
+
+    return trace;
+}
+
+void TraceSpill(Trace* trace) {
+    if (trace->failed == FALSE &&
+        fwrite(trace->ring, sizeof(TraceRecord), trace->used, trace->file) != trace->used)
+        trace->failed = TRUE;
+
+    trace->records += trace->used;
+    trace->used = 0;
+}
+
+void TraceStep(Trace* trace, const Machine* machine, Instruction inst) {
+    TraceRecord* record = &trace->ring[trace->used];
+
+    record->ip = machine->ip;
+    record->flags = machine->EFLAGS;
+    // src of a fused shift is the shift amount, not a register
+    uint8_t src = (inst.src < NUM_REGISTERS) ? inst.src : REG_NONE;
+    record->types = machine->registerTypes[inst.dest] | (machine->registerTypes[src] << 4);
+    record->stackSize = (machine->stackSize < UINT16_MAX) ? machine->stackSize : UINT16_MAX;
+    record->inst = inst;
+    record->dest = machine->registers[inst.dest];
+    record->src = machine->registers[src];
+
+    if (++trace->used == TRACE_RING_RECORDS)
+        TraceSpill(trace);
+}
+
+BOOL TraceDestroy(Trace* trace) {
+    if (trace == NULL)
+        return TRUE;
+
+    TraceSpill(trace);
+    if (fclose(trace->file) != 0)
+        trace->failed = TRUE;
+
+    BOOL ok = (trace->failed == FALSE);
+    free(trace);
+    return ok;
+}
+
+// print a register value the way it was typed when recorded
+static void PrintValue(FILE* stream, Register reg, DataType type, DataCell value) {
+    fprintf(stream, " %s=", GetRegisterName(reg));
+
+    switch (type) {
+    case TY_EMPTY:
+        fprintf(stream, "empty");
+        break;
+    case TY_I64:
+        fprintf(stream, "%ld", value.i64);
+        break;
+    case TY_U64:
+        fprintf(stream, "%lu", value.u64);
+        break;
+    case TY_F64:
+        fprintf(stream, "%g", value.f64);
+        break;
+    case TY_STR:
+        fprintf(stream, "(string)"); // the pointer means nothing outside the process
+        break;
+    default:
+        fprintf(stream, "0x%lx", value.u64);
+        break;
+    }
+}
+
+// vector registers are not recorded, only their names are printed
+static void PrintVectorOperands(FILE* stream, const TraceRecord* record) {
+    const Instruction* inst = &record->inst;
+
+    if (IsScalarVectorOperand(inst->operation, 1))
+        PrintValue(stream, inst->dest, record->types & 0xF, record->dest);
+    else
+        fprintf(stream, " %s", GetVectorRegisterName(inst->dest));
+
+    if (IsScalarVectorOperand(inst->operation, 0))
+        PrintValue(stream, inst->src, record->types >> 4, record->src);
+    else
+        fprintf(stream, " %s", GetVectorRegisterName(inst->src));
+}
+
+static void PrintRecord(FILE* stream, uint64_t number, const TraceRecord* record,
+                        const Lexer* lexer) {
+    const Instruction* inst = &record->inst;
+    const Token* token = (lexer != NULL && record->ip < lexer->numTokens)
+                             ? &lexer->tokens[record->ip]
+                             : NULL;
+
+    char location[256];
+    if (token != NULL)
+        snprintf(location, sizeof(location), "%s:%u", token->filepath, token->line);
+    else
+        snprintf(location, sizeof(location), "#%u", record->ip);
+
+    fprintf(stream, "%10lu  %-24s %-12s", number, location, GetOpcodeName(inst->operation));
+
+    if (IS_VECTOR_OPCODE(inst->operation))
+        PrintVectorOperands(stream, record);
+    else if (inst->dest != REG_NONE)
+        PrintValue(stream, inst->dest, record->types & 0xF, record->dest);
+
+    switch (IS_VECTOR_OPCODE(inst->operation) ? OPND_NONE : inst->kind) {
+    case OPND_REG:
+        if (inst->src != REG_NONE) // pop names its register in dest only
+            PrintValue(stream, inst->src, record->types >> 4, record->src);
+        break;
+    case OPND_I64:
+        fprintf(stream, " $%d", inst->imm);
+        break;
+    case OPND_WIDE:
+    case OPND_F64:
+        fprintf(stream, " constant %u", inst->index);
+        break;
+    case OPND_STR:
+        fprintf(stream, " string %u", inst->index);
+        break;
+    case OPND_LABEL:
+        fprintf(stream, " -> %u", inst->index);
+        break;
+    case OPND_MEM:
+        fprintf(stream, " [%s%+d]", GetRegisterName(inst->src), inst->imm);
+        break;
+    case OPND_MEM_INDEX:
+        fprintf(stream, " [%s+%s*%d]", GetRegisterName(inst->src),
+                GetRegisterName(MEM_INDEX_REG(*inst)), 1 << MEM_INDEX_SHIFT(*inst));
+        break;
+    }
+
+    fprintf(stream, "  flags=%c%c%c%c stack=%u", (record->flags & FLAG_ZF) ? 'Z' : '-',
+            (record->flags & FLAG_SF) ? 'S' : '-', (record->flags & FLAG_CF) ? 'C' : '-',
+            (record->flags & FLAG_OF) ? 'O' : '-', record->stackSize);
+
+    if (token != NULL)
+        fprintf(stream, "  | %s", token->text);
+    fprintf(stream, "\n");
+}
+
+BOOL TraceDecode(const char* path, FILE* stream) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file. Path: %s\n", path);
+        return FALSE;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord) ||
+        header.pathLength >= 4096) {
+        fprintf(stderr, "Error reading trace file. Path: %s: not a version %d trace\n", path,
+                TRACE_VERSION);
+        fclose(file);
+        return FALSE;
+    }
+
+    char program[4096];
+    if (fread(program, 1, header.pathLength, file) != header.pathLength) {
+        fprintf(stderr, "Error reading trace file. Path: %s: truncated\n", path);
+        fclose(file);
+        return FALSE;
+    }
+    program[header.pathLength] = '\0';
+
+    // lex the program again for the source of each instruction. indexes are
+    // the same with or without fusion. bytecode has no source to show
+    Lexer lexer;
+    BOOL lexed = FALSE;
+    FILE* source = fopen(program, "rb");
+    if (source != NULL && IsBytecodeFile(program) == FALSE) {
+        fclose(source);
+        lexer = ParseTokens(program);
+        lexed = TRUE;
+    } else {
+        if (source != NULL)
+            fclose(source);
+        fprintf(stream, "source of %s is not available, showing instruction indexes\n", program);
+    }
+
+    fprintf(stream, "%10s  %-24s %-12s operands\n", "step", "instruction", "opcode");
+
+    TraceRecord records[256];
+    uint64_t number = 0;
+    size_t count;
+    while ((count = fread(records, sizeof(TraceRecord), 256, file)) > 0) {
+        for (size_t i = 0; i < count; i++)
+            PrintRecord(stream, number++, &records[i], lexed == TRUE ? &lexer : NULL);
+    }
+
+    fprintf(stream, "%lu instructions traced\n", number);
+
+    if (lexed == TRUE)
+        FreeLexer(&lexer);
+    fclose(file);
+    return TRUE;
+}
+
+#endif
\ No newline at end of file
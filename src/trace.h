@@ -0,0 +1,96 @@
+/// Execution trace
+///
+/// Records every instruction the interpreter runs as a fixed size binary
+/// record, for finding out what a misbehaving program actually did without
+/// printing from the dispatch loop. Records go into a ring in the trace that
+/// only the thread running the machine ever touches, so it needs no locks,
+/// and the ring is written to the trace file in one piece whenever it fills.
+///
+/// A record holds the instruction as it ran, after fusion and quickening,
+/// with the registers it names, the flags and the stack size from just
+/// before it ran. The next record shows the result. Native code from the
+/// jit is not traced, so --trace turns the jit off.
+///
+/// TraceDecode (pvb --show-trace) prints a trace with the source line of
+/// each instruction, lexing the program again to find it.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "inst.h"
+#include "macros.h"
+
+#ifdef VM_TRACE
+
+#include <stdio.h>
+
+#define TRACE_MAGIC "PVBT"
+#define TRACE_VERSION 1
+#define TRACE_RING_RECORDS 4096 // records buffered before they are written, 128 KB
+
+/// @brief One instruction that ran
+///
+/// @param ip: index of the instruction
+/// @param flags: EFLAGS before it ran
+/// @param types: DataType of the dest register in the low four bits, of the src register above
+/// @param stackSize: values on the stack before it ran, at most UINT16_MAX
+/// @param inst: the instruction as it ran
+/// @param dest: value of register inst.dest before it ran
+/// @param src: value of register inst.src before it ran
+typedef struct {
+    uint32_t ip;
+    uint8_t flags;
+    uint8_t types;
+    uint16_t stackSize;
+    Instruction inst;
+    DataCell dest;
+    DataCell src;
+} TraceRecord;
+
+_Static_assert(sizeof(TraceRecord) == 32, "TraceRecord must stay 32 bytes");
+
+/// @brief Start of a trace file, followed by the path of the program and the records
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t pathLength;
+} TraceHeader;
+
+typedef struct Trace {
+    TraceRecord ring[TRACE_RING_RECORDS];
+    uint32_t used; // records in ring not written yet
+
+    FILE* file;
+    uint64_t records; // recorded so far
+    BOOL failed;      // a write to the file failed, nothing more is written
+} Trace;
+
+/// @brief Write the records in the ring to the file and empty it
+void TraceSpill(Trace* trace);
+
+/// @brief Record an instruction, called from the dispatch loop before it runs
+/// @param trace - trace of the running machine
+/// @param machine - the running machine
+/// @param inst - the instruction about to run
+void TraceStep(Trace* trace, const Machine* machine, Instruction inst);
+
+/// @brief Create a trace file for a program
+/// @param path - trace file to create
+/// @param program - path of the program being traced, for the decoder to find its source
+/// @return - the trace, or NULL if the file could not be created
+Trace* TraceCreate(const char* path, const char* program);
+
+/// @brief Write what is left in the ring, close the file and free the trace
+/// @return - FALSE if any write to the file failed
+BOOL TraceDestroy(Trace* trace);
+
+/// @brief Print a trace file, one instruction per line with its source
+/// @param path - trace file written by a Trace
+/// @param stream - where to print it
+/// @return - FALSE if the file could not be read or is not a trace
+BOOL TraceDecode(const char* path, FILE* stream);
+
+#endif
+
+#endif
\ No newline at end of file
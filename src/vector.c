@@ -0,0 +1,190 @@
+#include "vector.h"
+
+#ifndef USING_ARDUINO
+
+#include <string.h>
+
+#ifdef VM_AVX2
+#include <immintrin.h>
+#endif
+
+BOOL IsScalarVectorOperand(Opcode opcode, int index) {
+    switch (opcode) {
+    case OP_VLOAD:
+    case OP_VSPLAT:
+        return index == 0;
+    case OP_VSTORE:
+    case OP_VSUM:
+    case OP_VFSUM:
+        return index == 1;
+    default:
+        return FALSE;
+    }
+}
+
+// apply 'expression' to every lane, 'i' is the lane
+#define LANES(expression)                                                                          \
+    for (int i = 0; i < VECTOR_LANES; i++)                                                         \
+        expression;                                                                                \
+    break
+
+// i64 lanes go through unsigned long so overflow wraps like it does in AVX2
+#define WRAP(a, operator, b) (long)((unsigned long)(a) operator(unsigned long)(b))
+
+static void PackedLanes(uint8_t operation, Vector* dest, const Vector* src) {
+    long* a = dest->i64;
+    const long* b = src->i64;
+    double* x = dest->f64;
+    const double* y = src->f64;
+
+    switch (operation) {
+    case OP_VADD:
+        LANES(a[i] = WRAP(a[i], +, b[i]));
+    case OP_VSUB:
+        LANES(a[i] = WRAP(a[i], -, b[i]));
+    case OP_VMUL:
+        LANES(a[i] = WRAP(a[i], *, b[i]));
+    case OP_VMIN:
+        LANES(a[i] = (a[i] < b[i]) ? a[i] : b[i]);
+    case OP_VMAX:
+        LANES(a[i] = (a[i] > b[i]) ? a[i] : b[i]);
+    case OP_VCMPEQ:
+        LANES(a[i] = -(long)(a[i] == b[i]));
+    case OP_VCMPGT:
+        LANES(a[i] = -(long)(a[i] > b[i]));
+    case OP_VFADD:
+        LANES(x[i] = x[i] + y[i]);
+    case OP_VFSUB:
+        LANES(x[i] = x[i] - y[i]);
+    case OP_VFMUL:
+        LANES(x[i] = x[i] * y[i]);
+    case OP_VFMIN:
+        LANES(x[i] = (x[i] < y[i]) ? x[i] : y[i]);
+    case OP_VFMAX:
+        LANES(x[i] = (x[i] > y[i]) ? x[i] : y[i]);
+    case OP_VFCMPEQ:
+        LANES(a[i] = -(long)(x[i] == y[i]));
+    case OP_VFCMPGT:
+        LANES(a[i] = -(long)(x[i] > y[i]));
+    }
+}
+
+#ifdef VM_AVX2
+// low 64 bits of each product. AVX2 only multiplies 32 bit halves, so
+// a * b = lo(a) * lo(b) + ((hi(a) * lo(b) + lo(a) * hi(b)) << 32)
+__attribute__((target("avx2"))) static inline __m256i MultiplyI64(__m256i a, __m256i b) {
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) static void PackedAvx2(uint8_t operation, Vector* dest,
+                                                       const Vector* src) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)dest);
+    __m256i b = _mm256_loadu_si256((const __m256i*)src);
+    __m256d x = _mm256_castsi256_pd(a);
+    __m256d y = _mm256_castsi256_pd(b);
+    __m256i result;
+
+    switch (operation) {
+    case OP_VADD:
+        result = _mm256_add_epi64(a, b);
+        break;
+    case OP_VSUB:
+        result = _mm256_sub_epi64(a, b);
+        break;
+    case OP_VMUL:
+        result = MultiplyI64(a, b);
+        break;
+    case OP_VMIN:
+        result = _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+        break;
+    case OP_VMAX:
+        result = _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+        break;
+    case OP_VCMPEQ:
+        result = _mm256_cmpeq_epi64(a, b);
+        break;
+    case OP_VCMPGT:
+        result = _mm256_cmpgt_epi64(a, b);
+        break;
+    case OP_VFADD:
+        result = _mm256_castpd_si256(_mm256_add_pd(x, y));
+        break;
+    case OP_VFSUB:
+        result = _mm256_castpd_si256(_mm256_sub_pd(x, y));
+        break;
+    case OP_VFMUL:
+        result = _mm256_castpd_si256(_mm256_mul_pd(x, y));
+        break;
+    case OP_VFMIN:
+        result = _mm256_castpd_si256(_mm256_min_pd(x, y));
+        break;
+    case OP_VFMAX:
+        result = _mm256_castpd_si256(_mm256_max_pd(x, y));
+        break;
+    case OP_VFCMPEQ:
+        result = _mm256_castpd_si256(_mm256_cmp_pd(x, y, _CMP_EQ_OQ));
+        break;
+    case OP_VFCMPGT:
+        result = _mm256_castpd_si256(_mm256_cmp_pd(x, y, _CMP_GT_OQ));
+        break;
+    default:
+        return;
+    }
+
+    _mm256_storeu_si256((__m256i*)dest, result);
+}
+#endif
+
+// memory a vload or vstore goes through, from a scalar register holding an address.
+// checked like any other load or store when the machine checks memory
+static void* VectorAddress(Machine* machine, uint8_t reg) {
+    Data address = REGISTER(machine, reg);
+    if ((address.type != TY_I64 && address.type != TY_U64) || address.data.ptr == NULL)
+        RuntimeError(machine, "vector load or store from an invalid address");
+
+    if (machine->checkMemory == TRUE)
+        CheckMemory(machine, address.data.u64, sizeof(Vector));
+    return address.data.ptr;
+}
+
+void RunVector(Machine* machine, Instruction inst) {
+    switch (inst.operation) {
+    case OP_VLOAD:
+        memcpy(&machine->vectors[inst.dest], VectorAddress(machine, inst.src), sizeof(Vector));
+        return;
+    case OP_VSTORE:
+        memcpy(VectorAddress(machine, inst.dest), &machine->vectors[inst.src], sizeof(Vector));
+        return;
+    case OP_VSPLAT:
+        for (int i = 0; i < VECTOR_LANES; i++)
+            machine->vectors[inst.dest].i64[i] = machine->registers[inst.src].i64;
+        return;
+    case OP_VSUM: {
+        const long* lanes = machine->vectors[inst.src].i64;
+        long sum = WRAP(WRAP(lanes[0], +, lanes[1]), +, WRAP(lanes[2], +, lanes[3]));
+        SET_REGISTER(machine, inst.dest, DATA_USING_I64(sum));
+        return;
+    }
+    case OP_VFSUM: {
+        // pairwise, the same order a horizontal add would use
+        const double* lanes = machine->vectors[inst.src].f64;
+        double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        SET_REGISTER(machine, inst.dest, DATA_USING_F64(sum));
+        return;
+    }
+    }
+
+#ifdef VM_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        PackedAvx2(inst.operation, &machine->vectors[inst.dest], &machine->vectors[inst.src]);
+        return;
+    }
+#endif
+
+    PackedLanes(inst.operation, &machine->vectors[inst.dest], &machine->vectors[inst.src]);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+/// Vector instructions
+///
+/// Sixteen vector registers of four 64 bit lanes each, loaded from and stored
+/// to memory a program got from SYS_ALLOC. The packed instructions run on
+/// AVX2 when the cpu running the vm has it, checked at runtime so one build
+/// runs everywhere. Otherwise they run as plain loops over the lanes, which
+/// the compiler turns into SSE2 on x86-64. Both give the same result, i64
+/// lanes wrap on overflow and f64 min and max return src when either lane
+/// is NaN, like minpd and maxpd. Only which NaN comes out of adding or
+/// multiplying two NaNs may differ. None of it is built on arduino.
+
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include "inst.h"
+
+#ifndef USING_ARDUINO
+
+/// @brief Run a vector instruction, see IS_VECTOR_OPCODE
+/// @param machine - machine to run it on
+/// @param inst - the instruction, its operands were checked by the lexer
+void RunVector(Machine* machine, Instruction inst);
+
+/// @brief TRUE if operand 'index' (0 for src, 1 for dest) of a vector
+/// opcode names a scalar register instead of a vector register
+BOOL IsScalarVectorOperand(Opcode opcode, int index);
+
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,221 @@
+#include "verify.h"
+
+#include <stdlib.h>
+
+#define DEPTH_UNKNOWN -1     // instruction not reached yet
+#define NO_TARGET UINT32_MAX // instruction does not jump
+
+/// @brief What an instruction does to the stack and where it goes next
+///
+/// @param pops: values it needs on the stack
+/// @param pushes: values it leaves in their place
+/// @param room: free slots it needs, for superinstructions standing in for pushes
+/// @param clears: it empties the stack, pops and pushes are ignored
+/// @param next: instructions stepped over when it doesn't jump, 0 if it never falls through
+/// @param target: instruction it can jump to, NO_TARGET if none
+/// @param returns: it continues after the last call, or at 0 before any call
+typedef struct {
+    int pops;
+    int pushes;
+    int room;
+    BOOL clears;
+    uint32_t next;
+    uint32_t target;
+    BOOL returns;
+} StackEffect;
+
+// FALSE for anything that does not always do the same to the stack
+static BOOL GetStackEffect(const Instruction* program, uint32_t size, uint32_t ip,
+                           StackEffect* effect) {
+    const Instruction* inst = &program[ip];
+    *effect = (StackEffect){.next = 1, .target = NO_TARGET};
+
+    switch (inst->operation) {
+    case OP_PUSH:
+    case OP_SIZE:
+        effect->pushes = 1;
+        return TRUE;
+    case OP_POP:
+        effect->pops = 1;
+        return TRUE;
+    case OP_SHL:
+    case OP_SHR:
+    case OP_NOTB:
+    case OP_NEG:
+        effect->pops = effect->pushes = 1;
+        return TRUE;
+    case OP_ANDB:
+    case OP_ORB:
+    case OP_XORB:
+        effect->pops = 2;
+        effect->pushes = 1;
+        return TRUE;
+    case OP_SWAP:
+        effect->pops = effect->pushes = 2;
+        return TRUE;
+    case OP_DUP:
+        effect->pops = 1;
+        effect->pushes = 2;
+        return TRUE;
+    case OP_CLR:
+        effect->clears = TRUE;
+        return TRUE;
+#ifdef USING_ARDUINO
+    case OP_ANWRITE:
+        effect->pops = 2;
+        return TRUE;
+#else
+    case OP_WRITE: // fd and string. on arduino a pin write also pops its state
+        effect->pops = 2;
+        return TRUE;
+#endif
+    case OP_NOP:
+    case OP_MOV:
+    case OP_LOAD:
+    case OP_LOADB:
+    case OP_LOADF:
+    case OP_STORE:
+    case OP_STOREB:
+    case OP_STOREF:
+    case OP_CMP:
+    case OP_PRNT:
+    case OP_FLUSH:
+    case OP_SYSCALL:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+        return TRUE;
+    case OP_EXIT:
+        effect->next = 0;
+        return TRUE;
+    case OP_JMP:
+    case OP_CALL:
+        effect->next = 0;
+        effect->target = inst->index;
+        return TRUE;
+    case OP_JE:
+    case OP_JNE:
+    case OP_JG:
+    case OP_JGE:
+    case OP_JL:
+    case OP_JLE:
+        effect->target = inst->index;
+        return TRUE;
+    case OP_RET:
+        effect->next = 0;
+        effect->returns = TRUE;
+        return TRUE;
+
+    // superinstructions work on registers and step over what they replaced.
+    // they still fail on a stack without room for the pushes
+    case OP_SHLI:
+    case OP_SHRI:
+        effect->room = 1;
+        effect->next = 3;
+        return TRUE;
+    case OP_ORR:
+    case OP_ANDR:
+    case OP_XORR:
+        effect->room = 2;
+        effect->next = 4;
+        return TRUE;
+    case OP_CMPJE:
+    case OP_CMPJNE:
+    case OP_CMPJG:
+    case OP_CMPJGE:
+    case OP_CMPJL:
+    case OP_CMPJLE:
+        if (ip + 1 >= size)
+            return FALSE;
+
+        // the jump left in the next slot holds the target
+        effect->next = 2;
+        effect->target = program[ip + 1].index;
+        return TRUE;
+    default:
+        // vector instructions and quickened arithmetic never touch the stack.
+        // read only pushes when there was a line to read
+#ifndef USING_ARDUINO
+        if (IS_VECTOR_OPCODE(inst->operation))
+            return TRUE;
+#endif
+        return inst->operation >= OP_ADD_I64_RI && inst->operation < NUM_OPCODES;
+    }
+}
+
+// reach ip with depth values on the stack. FALSE if it was reached before
+// with a different depth, or is outside the program
+static BOOL Reach(int32_t* depths, uint32_t* pending, uint32_t* numPending, uint32_t size,
+                  uint32_t ip, int32_t depth) {
+    if (ip == size) // ran off the end, the program is done
+        return TRUE;
+    if (ip > size)
+        return FALSE;
+
+    if (depths[ip] == DEPTH_UNKNOWN) {
+        depths[ip] = depth;
+        pending[(*numPending)++] = ip;
+        return TRUE;
+    }
+
+    return depths[ip] == depth;
+}
+
+BOOL VerifyStackDepth(const Instruction* program, uint32_t size, uint32_t entry, uint32_t depth,
+                      uint32_t capacity) {
+    int32_t* depths = malloc((size + 1) * sizeof(int32_t));
+    uint32_t* pending = malloc((size + 1) * sizeof(uint32_t));
+    uint32_t* returns = malloc((size + 1) * sizeof(uint32_t));
+    BOOL proven = (depths != NULL && pending != NULL && returns != NULL);
+
+    // ret goes back to the instruction after whichever call ran last. rp
+    // starts out before the first instruction, so before any call it's 0
+    uint32_t numReturns = 0;
+    if (proven == TRUE)
+        returns[numReturns++] = 0;
+    for (uint32_t ip = 0; proven == TRUE && ip < size; ip++) {
+        if (program[ip].operation == OP_CALL)
+            returns[numReturns++] = ip + 1;
+    }
+
+    for (uint32_t ip = 0; proven == TRUE && ip < size; ip++)
+        depths[ip] = DEPTH_UNKNOWN;
+
+    // every instruction is pending at most once, the first time it's reached
+    uint32_t numPending = 0;
+    if (proven == TRUE)
+        proven = Reach(depths, pending, &numPending, size, entry, depth);
+
+    while (proven == TRUE && numPending > 0) {
+        uint32_t ip = pending[--numPending];
+        int32_t before = depths[ip];
+
+        StackEffect effect;
+        if (GetStackEffect(program, size, ip, &effect) == FALSE ||
+            (effect.clears == FALSE && before < effect.pops)) {
+            proven = FALSE;
+            break;
+        }
+
+        int32_t after = (effect.clears == TRUE) ? 0 : before - effect.pops + effect.pushes;
+        if (after > (int64_t)capacity || before + effect.room > (int64_t)capacity) {
+            proven = FALSE;
+            break;
+        }
+
+        if (effect.next != 0)
+            proven = Reach(depths, pending, &numPending, size, ip + effect.next, after);
+        if (proven == TRUE && effect.target != NO_TARGET)
+            proven = Reach(depths, pending, &numPending, size, effect.target, after);
+
+        for (uint32_t i = 0; proven == TRUE && effect.returns == TRUE && i < numReturns; i++)
+            proven = Reach(depths, pending, &numPending, size, returns[i], after);
+    }
+
+    free(depths);
+    free(pending);
+    free(returns);
+    return proven;
+}
\ No newline at end of file
@@ -0,0 +1,28 @@
+/// Stack depth verification
+///
+/// Works out how many values are on the stack before every instruction a
+/// program can reach, following fall through, jumps, calls and rets. A
+/// program where every instruction has a single depth that never drops
+/// below what it pops or grows past the stack's capacity can't over or underflow
+/// the stack, and runs on stack handlers that skip the bounds checks.
+///
+/// Anything that can't be proven, e.g a loop that pushes on every
+/// iteration or a read that may or may not push, keeps the checked
+/// handlers. Verification never changes what a program does.
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "inst.h"
+
+/// @brief Prove that a program never over or underflows the stack
+/// @param program - instructions to verify, fused or not
+/// @param size - number of instructions in program
+/// @param entry - instruction the program starts at
+/// @param depth - values on the stack when it starts
+/// @param capacity - values the stack holds
+/// @return - TRUE if proven, FALSE if not or out of memory
+BOOL VerifyStackDepth(const Instruction* program, uint32_t size, uint32_t entry, uint32_t depth,
+                      uint32_t capacity);
+
+#endif
\ No newline at end of file